@@ -0,0 +1,243 @@
+// Benchmark for the SpiFlash driver
+//
+// Measures read throughput for each read mode and clock speed, page program latency, erase times,
+// and the effect of async queue depth, and prints the results to USB serial. Each result is a
+// single line starting with BENCH (or HIST for histogram buckets) followed by key=value fields
+// separated by spaces, so the output can be parsed and compared across driver versions and boards.
+//
+// WARNING: This erases and overwrites BENCH_REGION_SIZE bytes starting at BENCH_ADDR, and the whole
+// chip if BENCH_CHIP_ERASE is set.
+
+#include "Particle.h"
+
+#include "spiflash.h"
+
+SYSTEM_THREAD(ENABLED);
+SYSTEM_MODE(SEMI_AUTOMATIC);
+
+// Set to 1 to also time a chip erase (about 4 seconds, erases everything)
+#ifndef BENCH_CHIP_ERASE
+#define BENCH_CHIP_ERASE 0
+#endif
+
+// The last 64K block is used for the tests
+static const size_t BENCH_ADDR = (SpiFlash::NUM_BLOCKS - 1) * SpiFlash::BLOCK_SIZE;
+static const size_t BENCH_REGION_SIZE = SpiFlash::BLOCK_SIZE;
+
+// Clock speeds to test, in MHz. Speeds above the read mode's maximum are limited by the driver.
+static const unsigned clockSpeeds[] = { 8, 15, 30, 60 };
+
+static const size_t BUF_SIZE = 4096;
+static const size_t NUM_HIST_BUCKETS = 16;
+
+SpiFlash spiFlash(SPI, A2);
+
+static uint8_t buf[BUF_SIZE];
+static volatile size_t outstanding = 0;
+
+static void runBenchmarks();
+static void benchRead(SpiFlash::ReadMode mode, unsigned mhz);
+static void benchWritePage();
+static void benchErase();
+static void benchQueueDepth(size_t depth);
+static void waitForOutstanding(size_t maxOutstanding);
+static void printResult(const char *test, const char *params, size_t bytes, unsigned long us);
+static void opDone(void *param);
+
+void setup() {
+	Serial.begin();
+	waitFor(Serial.isConnected, 15000);
+	delay(1000);
+
+	spiFlash.begin();
+
+	runBenchmarks();
+}
+
+void loop() {
+}
+
+void runBenchmarks() {
+	uint8_t manufacturerId, deviceId1, deviceId2;
+	spiFlash.jedecIdRead(manufacturerId, deviceId1, deviceId2);
+
+	Serial.printlnf("BENCH test=start system=%s jedec=%02x%02x%02x valid=%d", System.version().c_str(),
+		manufacturerId, deviceId1, deviceId2, spiFlash.isValidChip());
+
+	if (!spiFlash.isValidChip()) {
+		Serial.printlnf("BENCH test=end error=no_chip");
+		return;
+	}
+
+	// Erase times first, which also leaves the test region erased for the page program test
+	benchErase();
+	benchWritePage();
+
+	// The test region now contains data, which doesn't affect read speed
+	static const SpiFlash::ReadMode modes[] = { SpiFlash::READ_MODE_NORMAL, SpiFlash::READ_MODE_FAST };
+	for(size_t ii = 0; ii < sizeof(modes) / sizeof(modes[0]); ii++) {
+		for(size_t jj = 0; jj < sizeof(clockSpeeds) / sizeof(clockSpeeds[0]); jj++) {
+			benchRead(modes[ii], clockSpeeds[jj]);
+		}
+	}
+	spiFlash.setReadMode(SpiFlash::READ_MODE_NORMAL);
+	spiFlash.setMaxClockSpeed(30);
+
+	for(size_t depth = 1; depth <= SpiFlash::QUEUE_SIZE; depth *= 2) {
+		benchQueueDepth(depth);
+	}
+
+	Serial.printlnf("BENCH test=end");
+}
+
+void benchRead(SpiFlash::ReadMode mode, unsigned mhz) {
+	char params[64];
+	unsigned long start;
+
+	spiFlash.setReadMode(mode);
+	spiFlash.setMaxClockSpeed(mhz);
+
+	unsigned modeMaxMHz = spiFlash.getChipReadModeInfo(spiFlash.getReadMode()).maxClockMHz;
+	snprintf(params, sizeof(params), "mode=%d mhz=%u", (int)spiFlash.getReadMode(), (mhz < modeMaxMHz) ? mhz : modeMaxMHz);
+
+	// One READ instruction per 256-byte page
+	start = micros();
+	for(size_t addr = BENCH_ADDR; addr < BENCH_ADDR + BENCH_REGION_SIZE; addr += SpiFlash::PAGE_SIZE) {
+		spiFlash.readPageSync(addr, buf, SpiFlash::PAGE_SIZE);
+	}
+	printResult("read_page_sync", params, BENCH_REGION_SIZE, micros() - start);
+
+	// One READ instruction per BUF_SIZE bytes
+	start = micros();
+	for(size_t addr = BENCH_ADDR; addr < BENCH_ADDR + BENCH_REGION_SIZE; addr += BUF_SIZE) {
+		spiFlash.readDataSync(addr, buf, BUF_SIZE);
+	}
+	printResult("read_data_sync", params, BENCH_REGION_SIZE, micros() - start);
+}
+
+void benchWritePage() {
+	uint32_t hist[NUM_HIST_BUCKETS];
+	unsigned long minUs = 0xffffffff, maxUs = 0, totalUs = 0;
+	size_t count = 0;
+
+	memset(hist, 0, sizeof(hist));
+	for(size_t ii = 0; ii < SpiFlash::PAGE_SIZE; ii++) {
+		buf[ii] = (uint8_t) ii;
+	}
+
+	for(size_t addr = BENCH_ADDR; addr < BENCH_ADDR + BENCH_REGION_SIZE; addr += SpiFlash::PAGE_SIZE) {
+		unsigned long start = micros();
+		spiFlash.writePageSync(addr, buf, SpiFlash::PAGE_SIZE);
+		unsigned long us = micros() - start;
+
+		// Bucket n holds latencies of 2^n to 2^(n+1) - 1 microseconds
+		size_t bucket = 0;
+		while((us >> (bucket + 1)) != 0 && bucket < NUM_HIST_BUCKETS - 1) {
+			bucket++;
+		}
+		hist[bucket]++;
+
+		if (us < minUs) {
+			minUs = us;
+		}
+		if (us > maxUs) {
+			maxUs = us;
+		}
+		totalUs += us;
+		count++;
+	}
+
+	Serial.printlnf("BENCH test=write_page_sync count=%u min_us=%lu avg_us=%lu max_us=%lu", (unsigned) count, minUs, totalUs / count, maxUs);
+	for(size_t ii = 0; ii < NUM_HIST_BUCKETS; ii++) {
+		if (hist[ii] != 0) {
+			Serial.printlnf("HIST test=write_page_sync bucket_min_us=%lu count=%lu", 1UL << ii, (unsigned long) hist[ii]);
+		}
+	}
+}
+
+void benchErase() {
+	unsigned long start;
+
+	// Start from a known state, with the first sector programmed so the sector erase does real work
+	spiFlash.blockErase(BENCH_ADDR);
+	memset(buf, 0, SpiFlash::PAGE_SIZE);
+	for(size_t addr = BENCH_ADDR; addr < BENCH_ADDR + SpiFlash::SECTOR_SIZE; addr += SpiFlash::PAGE_SIZE) {
+		spiFlash.writePageSync(addr, buf, SpiFlash::PAGE_SIZE);
+	}
+
+	start = micros();
+	spiFlash.sectorErase(BENCH_ADDR);
+	printResult("sector_erase", "", SpiFlash::SECTOR_SIZE, micros() - start);
+
+	start = micros();
+	spiFlash.block32Erase(BENCH_ADDR);
+	printResult("block32_erase", "", SpiFlash::BLOCK32_SIZE, micros() - start);
+
+	start = micros();
+	spiFlash.blockErase(BENCH_ADDR);
+	printResult("block_erase", "", SpiFlash::BLOCK_SIZE, micros() - start);
+
+	start = micros();
+	bool erased = spiFlash.isErased(BENCH_ADDR, BENCH_REGION_SIZE);
+	printResult("is_erased", erased ? "result=1" : "result=0", BENCH_REGION_SIZE, micros() - start);
+
+#if BENCH_CHIP_ERASE
+	start = micros();
+	spiFlash.chipErase();
+	printResult("chip_erase", "", SpiFlash::SECTOR_SIZE * SpiFlash::NUM_SECTORS, micros() - start);
+#endif
+}
+
+void benchQueueDepth(size_t depth) {
+	static const size_t READ_CHUNK = 1024;
+	char params[32];
+	unsigned long start;
+	size_t addr;
+
+	snprintf(params, sizeof(params), "depth=%u", (unsigned) depth);
+
+	// Reads, keeping depth operations queued. Each one reads into its own part of buf.
+	start = micros();
+	for(addr = BENCH_ADDR; addr < BENCH_ADDR + BENCH_REGION_SIZE; addr += READ_CHUNK) {
+		waitForOutstanding(depth - 1);
+		ATOMIC_BLOCK() {
+			outstanding++;
+		}
+		size_t slot = (addr / READ_CHUNK) % (BUF_SIZE / READ_CHUNK);
+		while(!spiFlash.readDataAsync(addr, &buf[slot * READ_CHUNK], READ_CHUNK, opDone, NULL)) {
+		}
+	}
+	waitForOutstanding(0);
+	printResult("read_data_async", params, BENCH_REGION_SIZE, micros() - start);
+
+	// Page programs into a freshly erased sector
+	spiFlash.sectorErase(BENCH_ADDR);
+	start = micros();
+	for(addr = BENCH_ADDR; addr < BENCH_ADDR + SpiFlash::SECTOR_SIZE; addr += SpiFlash::PAGE_SIZE) {
+		waitForOutstanding(depth - 1);
+		ATOMIC_BLOCK() {
+			outstanding++;
+		}
+		while(!spiFlash.writePageAsync(addr, buf, SpiFlash::PAGE_SIZE, opDone, NULL)) {
+		}
+	}
+	waitForOutstanding(0);
+	printResult("write_page_async", params, SpiFlash::SECTOR_SIZE, micros() - start);
+}
+
+void waitForOutstanding(size_t maxOutstanding) {
+	while(outstanding > maxOutstanding) {
+	}
+}
+
+void printResult(const char *test, const char *params, size_t bytes, unsigned long us) {
+	// KB/s = bytes / us * 1000000 / 1024
+	unsigned long kbps = (us > 0) ? (unsigned long) ((uint64_t)bytes * 1000000 / 1024 / us) : 0;
+
+	Serial.printlnf("BENCH test=%s%s%s bytes=%u us=%lu kbytes_per_sec=%lu", test, (params[0] != 0) ? " " : "", params, (unsigned) bytes, us, kbps);
+}
+
+void opDone(void *) {
+	// Called from the DMA completion interrupt or the timer thread
+	outstanding--;
+}
@@ -0,0 +1,732 @@
+// Host simulation of the SpiFlash driver
+//
+// Runs the driver against the simulated chip in host/spiflashsim.h: checks that the chip's SFDP
+// table decodes to the device traits and uses it, measures throughput in
+// simulated time for the same operations as the benchmark example, then appends records to a
+// SpiFlashLog and a SpiFlashKv store until the log has wrapped several times, rewrites sectors through
+// the FTL, stripes data over a second chip on SPI1, stages an image as it would arrive from the
+// network, and reports the erase counts and any NOR rule violations. Build and run on a workstation:
+//
+// g++ -std=gnu++14 -O2 -DSPIFLASH_HOST -Ihost -I. host/*.cpp spiflash*.cpp examples/hostsim/hostsim.cpp -o hostsim
+// ./hostsim
+//
+// With -DPLATFORM_THREADING=1 it also shares the chip between threads through SpiFlashThreadSafe.
+
+#include "Particle.h"
+
+#include "spiflash.h"
+#include "spiflashlog.h"
+#include "spiflashkv.h"
+#include "spiflashcursor.h"
+#include "spiflashreadstream.h"
+#include "spiflashlzlog.h"
+#include "spiflashftl.h"
+#include "spiflashstripe.h"
+#include "spiflashimage.h"
+#include "spiflashcrc.h"
+#include "spiflashsim.h"
+
+#if PLATFORM_THREADING
+#include "spiflashthreadsafe.h"
+#endif
+
+static const size_t BUF_SIZE = 4096;
+
+static SpiFlashSim sim;
+static SpiFlashSim sim1;			// Second chip for the stripe, on SPI1
+static SpiFlash spiFlash(SPI, A2);
+static SpiFlashCursorStatic<512> cursor(spiFlash);
+static SpiFlashReadStreamStatic<4, 1024> readStream(spiFlash);
+
+static uint8_t buf[BUF_SIZE];
+static volatile size_t outstanding = 0;
+static size_t failedTests = 0;			// Results that make the run fail, besides NOR rule violations
+static char priorityOrder[8];
+static size_t priorityCount = 0;
+
+static void printResult(const char *test, size_t bytes, uint64_t us);
+static bool checkSfdp();
+static void benchThroughput();
+static void simulateLog();
+static void simulateKv();
+static void simulateLzLog();
+static void simulateFtl();
+static void simulateStripe();
+static void simulateImage();
+static void imageChunk(size_t offset, uint8_t *buf, size_t len);
+static size_t sensorRecord(uint32_t seq, char *buf, size_t bufLen);
+static void opDone(void *param);
+static void priorityDone(void *param);
+#if PLATFORM_THREADING
+static void simulateThreadSafe();
+static void threadSafeApp(void *param);
+static void threadSafeChain(SpiFlashRequest *req, void *param);
+#endif
+
+int main() {
+	SPI.attach(&sim);
+	sim.setVerbose(true);
+
+	spiFlash.begin();
+	if (!spiFlash.isValidChip()) {
+		printf("SIM test=end error=no_chip\n");
+		return 1;
+	}
+	if (!checkSfdp()) {
+		return 1;
+	}
+
+	benchThroughput();
+	simulateLog();
+	simulateKv();
+	simulateLzLog();
+	simulateFtl();
+	simulateStripe();
+	simulateImage();
+#if PLATFORM_THREADING
+	simulateThreadSafe();
+#endif
+
+	const SpiFlashSim::Stats &stats = sim.getStats();
+	uint32_t violations = sim.getViolationCount() + sim1.getViolationCount();
+	printf("SIM test=end violations=%lu zero_to_one=%lu busy=%lu wren=%lu suspend=%lu format=%lu chip1_violations=%lu failed=%u\n",
+		(unsigned long) violations, (unsigned long) stats.zeroToOneBits, (unsigned long) stats.busyViolations,
+		(unsigned long) stats.wrenViolations, (unsigned long) stats.suspendViolations, (unsigned long) stats.formatViolations,
+		(unsigned long) sim1.getViolationCount(), (unsigned) failedTests);
+
+	return (violations == 0 && failedTests == 0) ? 0 : 1;
+}
+
+bool checkSfdp() {
+	SpiFlash::SfdpInfo info;
+
+	if (!spiFlash.readSfdp(info)) {
+		printf("SIM test=end error=no_sfdp\n");
+		return false;
+	}
+	printf("SIM test=sfdp rev=%u.%u size=%u page=%u read_modes=0x%02x erase=%02x/%02x/%02x "
+		"erase_us=%lu/%lu/%lu program_us=%lu chip_erase_us=%lu\n",
+		info.majorRev, info.minorRev, (unsigned) info.size, (unsigned) info.pageSize, info.readModes,
+		info.sectorEraseInst, info.block32EraseInst, info.blockEraseInst,
+		(unsigned long) info.sectorEraseUs, (unsigned long) info.block32EraseUs, (unsigned long) info.blockEraseUs,
+		(unsigned long) info.pageProgramUs, (unsigned long) info.chipEraseUs);
+
+	if (!spiFlash.applySfdp(info)) {
+		printf("SIM test=end error=sfdp_mismatch\n");
+		return false;
+	}
+	printf("SIM test=sfdp_mode read_mode=%d dummy_cycles=%u\n", (int) spiFlash.getReadMode(),
+		spiFlash.getChipReadModeInfo(spiFlash.getReadMode()).dummyCycles);
+	return true;
+}
+
+void benchThroughput() {
+	uint64_t start;
+
+	start = SpiFlashHost::getMicros();
+	spiFlash.chipErase();
+	printResult("chip_erase", sim.getSize(), SpiFlashHost::getMicros() - start);
+
+	for(size_t ii = 0; ii < BUF_SIZE; ii++) {
+		buf[ii] = (uint8_t) ii;
+	}
+
+	start = SpiFlashHost::getMicros();
+	for(size_t addr = 0; addr < SpiFlash::BLOCK_SIZE; addr += SpiFlash::PAGE_SIZE) {
+		spiFlash.writePageSync(addr, buf, SpiFlash::PAGE_SIZE);
+	}
+	printResult("write_page_sync", SpiFlash::BLOCK_SIZE, SpiFlashHost::getMicros() - start);
+
+	start = SpiFlashHost::getMicros();
+	for(size_t addr = 0; addr < SpiFlash::BLOCK_SIZE; addr += BUF_SIZE) {
+		spiFlash.readDataSync(addr, buf, BUF_SIZE);
+	}
+	uint64_t syncReadUs = SpiFlashHost::getMicros() - start;
+	printResult("read_data_sync", SpiFlash::BLOCK_SIZE, syncReadUs);
+
+	start = SpiFlashHost::getMicros();
+	for(size_t addr = 0; addr < SpiFlash::BLOCK_SIZE; addr += BUF_SIZE) {
+		outstanding++;
+		while(!spiFlash.readDataAsync(addr, buf, BUF_SIZE, opDone, NULL)) {
+			SpiFlashHost::poll();
+		}
+	}
+	while(outstanding > 0) {
+		SpiFlashHost::poll();
+	}
+	printResult("read_data_async", SpiFlash::BLOCK_SIZE, SpiFlashHost::getMicros() - start);
+
+	// Pulled from the stream as each buffer fills; should take about as long as read_data_sync
+	start = SpiFlashHost::getMicros();
+	size_t streamed = 0, streamBad = 0;
+	readStream.start(0, SpiFlash::BLOCK_SIZE);
+	while(!readStream.isDone()) {
+		size_t len;
+		const uint8_t *data = readStream.getData(len);
+		if (data == NULL) {
+			SpiFlashHost::poll();
+			continue;
+		}
+		for(size_t ii = 0; ii < len; ii++) {
+			if (data[ii] != (uint8_t) ((streamed + ii) % SpiFlash::PAGE_SIZE)) {
+				streamBad++;
+			}
+		}
+		streamed += len;
+		readStream.release();
+	}
+	uint64_t streamUs = SpiFlashHost::getMicros() - start;
+	const char *streamResult = "read_stream";
+	if (streamBad != 0 || streamed != SpiFlash::BLOCK_SIZE) {
+		streamResult = "read_stream_failed";
+	}
+	else
+	if (streamUs > syncReadUs + syncReadUs / 4) {
+		// The buffers should keep the bus as busy as one long read
+		streamResult = "read_stream_slow";
+	}
+	printResult(streamResult, streamed, streamUs);
+
+	// Byte at a time, as a parser would without the cursor
+	start = SpiFlashHost::getMicros();
+	for(size_t addr = 0; addr < SpiFlash::SECTOR_SIZE; addr++) {
+		spiFlash.readDataSync(addr, buf, 1);
+	}
+	printResult("read_byte_sync", SpiFlash::SECTOR_SIZE, SpiFlashHost::getMicros() - start);
+
+	start = SpiFlashHost::getMicros();
+	size_t bad = 0;
+	cursor.open(0, SpiFlash::BLOCK_SIZE);
+	for(size_t addr = 0; addr < SpiFlash::BLOCK_SIZE; addr++) {
+		if (cursor.read() != (int) (addr % SpiFlash::PAGE_SIZE)) {
+			bad++;
+		}
+	}
+	if (cursor.read() != -1) {
+		bad++;
+	}
+
+	// Backwards, and a mapped field across the window boundary
+	uint32_t value = 0;
+	cursor.seek(100);
+	if (!cursor.readUint32(value) || value != 0x67666564) {
+		bad++;
+	}
+	cursor.seek(510);
+	const uint8_t *field = cursor.map(4);
+	if (field == NULL || field[0] != 254 || field[3] != 1) {
+		bad++;
+	}
+	cursor.close();
+	printResult(bad == 0 ? "read_byte_cursor" : "read_byte_cursor_failed", SpiFlash::BLOCK_SIZE, SpiFlashHost::getMicros() - start);
+
+	start = SpiFlashHost::getMicros();
+	bool erased = spiFlash.isErased(SpiFlash::BLOCK_SIZE, SpiFlash::BLOCK_SIZE);
+	printResult(erased ? "is_erased" : "is_erased_failed", SpiFlash::BLOCK_SIZE, SpiFlashHost::getMicros() - start);
+
+	start = SpiFlashHost::getMicros();
+	for(size_t addr = 0; addr < SpiFlash::BLOCK_SIZE; addr += SpiFlash::SECTOR_SIZE) {
+		spiFlash.sectorErase(addr);
+	}
+	printResult("sector_erase", SpiFlash::BLOCK_SIZE, SpiFlashHost::getMicros() - start);
+
+	// Priority reads queued behind a running erase suspend it and run in the order they were queued.
+	// A suspended sector can't be read, so the reads are in the first sector and the erase in the last.
+	static const size_t NUM_PRIORITY = 4;
+	outstanding = 1;
+	spiFlash.sectorEraseAsync(SpiFlash::BLOCK_SIZE - SpiFlash::SECTOR_SIZE, opDone, NULL);
+	delay(2);
+	for(size_t ii = 0; ii < NUM_PRIORITY; ii++) {
+		while(!spiFlash.readDataPriorityAsync(ii * SpiFlash::PAGE_SIZE, buf, SpiFlash::PAGE_SIZE, priorityDone, (void *)('0' + ii))) {
+			SpiFlashHost::poll();
+		}
+	}
+	while(outstanding > 0 || priorityCount < NUM_PRIORITY) {
+		SpiFlashHost::poll();
+	}
+	bool inOrder = (strcmp(priorityOrder, "0123") == 0);
+	if (!inOrder) {
+		failedTests++;
+	}
+	printf("SIM test=%s order=%s\n", inOrder ? "priority_order" : "priority_order_failed", priorityOrder);
+
+	// Multi-page write with programs 10% slower than typical, so the polling latency shows
+	SpiFlashSim::Timing timing = sim.getTiming();
+	SpiFlashSim::Timing slowTiming = timing;
+	slowTiming.pageProgramUs += slowTiming.pageProgramUs / 10;
+	sim.setTiming(slowTiming);
+
+	start = SpiFlashHost::getMicros();
+	for(size_t addr = 0; addr < SpiFlash::BLOCK_SIZE; addr += BUF_SIZE) {
+		spiFlash.writeDataSync(addr, buf, BUF_SIZE);
+	}
+	printResult("write_data_sync_slow", SpiFlash::BLOCK_SIZE, SpiFlashHost::getMicros() - start);
+	printf("SIM test=write_data_sync_slow pages=%u page_program_us=%lu\n", (unsigned) (SpiFlash::BLOCK_SIZE / SpiFlash::PAGE_SIZE),
+		(unsigned long) slowTiming.pageProgramUs);
+
+	sim.setTiming(timing);
+	spiFlash.blockErase(0);
+}
+
+void simulateLog() {
+	// The first 64 sectors, wrapped around 8 times
+	static const size_t NUM_SECTORS = 64;
+	SpiFlashLog log(spiFlash, 0, NUM_SECTORS);
+	uint64_t start = SpiFlashHost::getMicros();
+	size_t bytes = 0;
+
+	log.format();
+	sim.resetStats();
+
+	for(uint32_t seq = 0; bytes < NUM_SECTORS * SpiFlash::SECTOR_SIZE * 8; seq++) {
+		uint8_t record[64];
+		size_t len = 8 + (seq % 56);
+		for(size_t ii = 0; ii < len; ii++) {
+			record[ii] = (uint8_t) (seq + ii);
+		}
+		log.append(record, len);
+		bytes += len;
+	}
+	log.flush();
+
+	uint32_t minErases = 0xffffffff, maxErases = 0;
+	for(size_t ii = 0; ii < NUM_SECTORS; ii++) {
+		uint32_t count = sim.getEraseCount(ii);
+		minErases = (count < minErases) ? count : minErases;
+		maxErases = (count > maxErases) ? count : maxErases;
+	}
+	printResult("log_append", bytes, SpiFlashHost::getMicros() - start);
+	printf("SIM test=log_wear sectors=%u min_erases=%lu max_erases=%lu page_programs=%lu\n", (unsigned) NUM_SECTORS,
+		(unsigned long) minErases, (unsigned long) maxErases, (unsigned long) sim.getStats().pagePrograms);
+}
+
+void simulateKv() {
+	static const size_t NUM_KEYS = 200;
+	static const uint32_t NUM_ROUNDS = 60;		// Enough to fill the log about twice, so it's compacted
+	static SpiFlashLog kvLog(spiFlash, 64, 32);
+	static SpiFlashKvStatic<512> kv(kvLog);
+	uint64_t start = SpiFlashHost::getMicros();
+	size_t puts = 0;
+
+	kvLog.format();
+	kv.begin();
+
+	for(uint32_t round = 0; round < NUM_ROUNDS; round++) {
+		for(size_t ii = 0; ii < NUM_KEYS; ii++) {
+			char key[16];
+			uint32_t value[4] = { round, (uint32_t) ii, round * 7, (uint32_t) ii * 13 };
+			snprintf(key, sizeof(key), "key%u", (unsigned) ii);
+			if (!kv.put(key, value, sizeof(value))) {
+				printf("SIM test=kv error=put_failed round=%lu key=%s\n", (unsigned long) round, key);
+				return;
+			}
+			puts++;
+		}
+	}
+	kvLog.flush();
+	printResult("kv_put", puts * 16, SpiFlashHost::getMicros() - start);
+
+	// Rebuild the index from the flash, as after a reset, and check every value
+	kvLog.begin();
+	kv.begin();
+	sim.resetStats();
+	size_t bad = 0;
+	for(size_t ii = 0; ii < NUM_KEYS; ii++) {
+		char key[16];
+		uint32_t value[4];
+		snprintf(key, sizeof(key), "key%u", (unsigned) ii);
+		if (kv.get(key, value, sizeof(value)) != (int) sizeof(value) || value[0] != NUM_ROUNDS - 1 || value[1] != ii) {
+			bad++;
+		}
+	}
+	printf("SIM test=kv_verify keys=%u count=%u bad=%u reads=%lu\n", (unsigned) NUM_KEYS, (unsigned) kv.getCount(), (unsigned) bad,
+		(unsigned long) sim.getStats().commands);
+}
+
+void simulateLzLog() {
+	// Sectors after the key/value store, written once without and once with compression
+	static const size_t NUM_RECORDS = 2000;
+	static SpiFlashLog rawLog(spiFlash, 96, 64);
+	static SpiFlashLog lzBlocks(spiFlash, 160, 64);
+	static SpiFlashLzLogStatic<2048> lzLog(lzBlocks);
+	char record[64];
+	size_t bytes = 0;
+
+	rawLog.format();
+	sim.resetStats();
+	for(uint32_t seq = 0; seq < NUM_RECORDS; seq++) {
+		size_t len = sensorRecord(seq, record, sizeof(record));
+		rawLog.append(record, len);
+		bytes += len;
+	}
+	rawLog.flush();
+	uint32_t rawPrograms = sim.getStats().pagePrograms;
+
+	lzBlocks.format();
+	sim.resetStats();
+	uint64_t start = SpiFlashHost::getMicros();
+	for(uint32_t seq = 0; seq < NUM_RECORDS; seq++) {
+		size_t len = sensorRecord(seq, record, sizeof(record));
+		lzLog.append(record, len);
+	}
+	lzLog.flush();
+	printResult("lz_log_append", bytes, SpiFlashHost::getMicros() - start);
+
+	const SpiFlashLzLog::Stats &stats = lzLog.getStats();
+	printf("SIM test=lz_log records=%lu blocks=%lu stored_blocks=%lu raw_bytes=%lu stored_bytes=%lu page_programs=%lu raw_page_programs=%lu\n",
+		(unsigned long) stats.records, (unsigned long) stats.blocks, (unsigned long) stats.storedBlocks,
+		(unsigned long) stats.rawBytes, (unsigned long) stats.storedBytes, (unsigned long) sim.getStats().pagePrograms,
+		(unsigned long) rawPrograms);
+
+	// Read back through the decompressor
+	SpiFlashLzLog::Position pos;
+	size_t count = 0, bad = 0;
+	char expected[64], data[64];
+	lzLog.getOldest(pos);
+	while(true) {
+		int len = lzLog.readNext(pos, data, sizeof(data));
+		if (len < 0) {
+			break;
+		}
+		size_t expectedLen = sensorRecord((uint32_t) count, expected, sizeof(expected));
+		if ((size_t) len != expectedLen || memcmp(data, expected, expectedLen) != 0) {
+			bad++;
+		}
+		count++;
+	}
+	printf("SIM test=lz_log_verify records=%u read=%u bad=%u\n", (unsigned) NUM_RECORDS, (unsigned) count, (unsigned) bad);
+}
+
+void simulateFtl() {
+	// The last 16 sectors of the 25LQ080, with most rewrites going to one hot logical sector
+	static const size_t FIRST_SECTOR = 240;
+	static const size_t NUM_SECTORS = 16;
+	static const uint32_t NUM_WRITES = 400;
+	static SpiFlashFtl ftl(spiFlash, FIRST_SECTOR, NUM_SECTORS, 4);
+	static uint32_t versions[NUM_SECTORS];
+	static uint8_t data[SpiFlashFtl::LOGICAL_SECTOR_SIZE];
+	uint64_t start = SpiFlashHost::getMicros();
+
+	ftl.format();
+	sim.resetStats();
+
+	size_t numLogical = ftl.getNumLogicalSectors();
+	for(size_t logical = 0; logical < numLogical; logical++) {
+		versions[logical] = 0xffffffff;
+	}
+	for(uint32_t write = 0; write < NUM_WRITES; write++) {
+		size_t logical = (write % 4 == 0) ? (write / 4) % numLogical : 0;
+		for(size_t ii = 0; ii < SpiFlashFtl::LOGICAL_SECTOR_SIZE; ii++) {
+			buf[ii] = (uint8_t) (logical * 31 + write + ii);
+		}
+		ftl.writeSector(logical, buf);
+		versions[logical] = write;
+	}
+	printResult("ftl_write", NUM_WRITES * SpiFlashFtl::LOGICAL_SECTOR_SIZE, SpiFlashHost::getMicros() - start);
+
+	// Rebuild the mapping from the sector headers, as after a reset, and check the latest version of each.
+	// A reset would stop the background erase, so let it finish instead of reading under it.
+	while(spiFlash.getQueueCount() > 0) {
+		delay(1);
+	}
+	SpiFlashFtl rebooted(spiFlash, FIRST_SECTOR, NUM_SECTORS, 4);
+	rebooted.begin();
+	size_t bad = 0;
+	for(size_t logical = 0; logical < numLogical; logical++) {
+		rebooted.readData(logical, 0, data, sizeof(data));
+		for(size_t ii = 0; ii < SpiFlashFtl::LOGICAL_SECTOR_SIZE; ii++) {
+			if (data[ii] != (uint8_t) (logical * 31 + versions[logical] + ii)) {
+				bad++;
+				break;
+			}
+		}
+	}
+
+	uint32_t minErases = 0xffffffff, maxErases = 0;
+	for(size_t ii = FIRST_SECTOR; ii < FIRST_SECTOR + NUM_SECTORS; ii++) {
+		uint32_t count = sim.getEraseCount(ii);
+		minErases = (count < minErases) ? count : minErases;
+		maxErases = (count > maxErases) ? count : maxErases;
+	}
+	printf("SIM test=ftl_verify writes=%lu logical=%u bad=%u sectors=%u min_erases=%lu max_erases=%lu\n",
+		(unsigned long) NUM_WRITES, (unsigned) numLogical, (unsigned) bad, (unsigned) NUM_SECTORS,
+		(unsigned long) minErases, (unsigned long) maxErases);
+}
+
+void simulateStripe() {
+	// A second chip on SPI1, striped with the free sectors between the compressed log and the FTL
+	static const size_t CHIP_ADDR = 224 * SpiFlash::SECTOR_SIZE;
+	static const size_t LEN = 2 * 16 * SpiFlash::SECTOR_SIZE;
+	static SpiFlash flash1(SPI1, D5);
+	static SpiFlash *chips[] = { &spiFlash, &flash1 };
+	static SpiFlashStripe stripe(chips, 2);
+	static uint8_t data[LEN];
+	size_t rejected = 0;
+
+	SPI1.attach(&sim1);
+	sim1.setVerbose(true);
+
+	// No chips, and a chip past MAX_INSTANCES that can't do async operations
+	SpiFlashStripe noChips(chips, 0);
+	if (!noChips.begin()) {
+		rejected++;
+	}
+	{
+		SpiFlash extra0(SPI1, D6), extra1(SPI1, D7), noAsync(SPI1, D7);
+		SpiFlash *noAsyncChips[] = { &flash1, &noAsync };
+		SpiFlashStripe noAsyncStripe(noAsyncChips, 2);
+		if (!noAsyncStripe.begin()) {
+			rejected++;
+		}
+	}
+
+	if (!stripe.begin() || !stripe.isValidChip()) {
+		printf("SIM test=stripe error=begin_failed\n");
+		return;
+	}
+	size_t addr = 2 * CHIP_ADDR;
+	for(size_t offset = 0; offset < LEN; offset += stripe.getSectorSize()) {
+		stripe.sectorErase(addr + offset);
+	}
+
+	for(size_t ii = 0; ii < LEN; ii++) {
+		data[ii] = (uint8_t) (ii * 7 + ii / 251);
+	}
+
+	// The same amount of data on one chip, for comparison
+	uint64_t start = SpiFlashHost::getMicros();
+	flash1.writeDataSync(0, data, LEN);
+	uint64_t singleWriteUs = SpiFlashHost::getMicros() - start;
+	printResult("stripe_single_write", LEN, singleWriteUs);
+
+	start = SpiFlashHost::getMicros();
+	stripe.writeDataSync(addr, data, LEN);
+	uint64_t writeUs = SpiFlashHost::getMicros() - start;
+	if (writeUs >= singleWriteUs) {
+		// The programs on the two chips should overlap whatever the page program time is
+		failedTests++;
+		printResult("stripe_write_slow", LEN, writeUs);
+	}
+	else {
+		printResult("stripe_write", LEN, writeUs);
+	}
+
+	start = SpiFlashHost::getMicros();
+	flash1.readDataSync(0, buf, BUF_SIZE);
+	for(size_t offset = BUF_SIZE; offset < LEN; offset += BUF_SIZE) {
+		flash1.readDataSync(offset, buf, BUF_SIZE);
+	}
+	uint64_t singleReadUs = SpiFlashHost::getMicros() - start;
+	printResult("stripe_single_read", LEN, singleReadUs);
+
+	size_t bad = 0;
+	start = SpiFlashHost::getMicros();
+	for(size_t offset = 0; offset < LEN; offset += BUF_SIZE) {
+		stripe.readDataSync(addr + offset, buf, BUF_SIZE);
+		if (memcmp(buf, &data[offset], BUF_SIZE) != 0) {
+			bad++;
+		}
+	}
+	uint64_t readUs = SpiFlashHost::getMicros() - start;
+	const char *readResult = "stripe_read";
+	if (bad != 0) {
+		readResult = "stripe_read_failed";
+		failedTests++;
+	}
+	else
+	if (readUs * 3 > singleReadUs * 2) {
+		// Both buses should be busy at once, so two chips should take well under 2/3 of the time
+		readResult = "stripe_read_slow";
+		failedTests++;
+	}
+	printResult(readResult, LEN, readUs);
+
+	// Each chip holds half of the data, in alternating stripes
+	flash1.readDataSync(CHIP_ADDR, buf, SpiFlash::PAGE_SIZE);
+	if (memcmp(buf, &data[SpiFlash::PAGE_SIZE], SpiFlash::PAGE_SIZE) != 0) {
+		bad++;
+	}
+
+	printf("SIM test=stripe_verify chips=2 bad=%u rejected=%u write_speedup_pct=%lu read_speedup_pct=%lu\n",
+		(unsigned) bad, (unsigned) rejected, (unsigned long) (singleWriteUs * 100 / writeUs),
+		(unsigned long) (singleReadUs * 100 / readUs));
+
+}
+
+void simulateImage() {
+	// 200K image in network sized chunks, arriving every 2 ms, staged over the first log
+	static const size_t IMAGE_ADDR = 0;
+	static const size_t IMAGE_SIZE = 200 * 1024;
+	static const size_t CHUNK_SIZE = 1460;
+	static const unsigned int CHUNK_US = 2000;
+	static SpiFlashImageWriterStatic<8> imageWriter(spiFlash);
+	uint8_t chunk[CHUNK_SIZE];
+	uint32_t expectedCrc = 0;
+
+	// Sector erases, sync writes and a separate read back, for comparison
+	uint64_t start = SpiFlashHost::getMicros();
+	for(size_t addr = 0; addr < IMAGE_SIZE; addr += SpiFlash::SECTOR_SIZE) {
+		spiFlash.sectorErase(IMAGE_ADDR + addr);
+	}
+	for(size_t offset = 0; offset < IMAGE_SIZE; offset += CHUNK_SIZE) {
+		size_t len = (IMAGE_SIZE - offset < CHUNK_SIZE) ? (IMAGE_SIZE - offset) : CHUNK_SIZE;
+		delayMicroseconds(CHUNK_US);
+		imageChunk(offset, chunk, len);
+		spiFlash.writeDataSync(IMAGE_ADDR + offset, chunk, len);
+		expectedCrc = SpiFlashCrc32::update(expectedCrc, chunk, len);
+	}
+	uint32_t readCrc = 0;
+	for(size_t offset = 0; offset < IMAGE_SIZE; offset += BUF_SIZE) {
+		readCrc = spiFlash.readDataSyncCrc(IMAGE_ADDR + offset, buf, BUF_SIZE, readCrc);
+	}
+	printResult(readCrc == expectedCrc ? "image_sync" : "image_sync_failed", IMAGE_SIZE, SpiFlashHost::getMicros() - start);
+
+	sim.resetStats();
+	start = SpiFlashHost::getMicros();
+	if (!imageWriter.begin(IMAGE_ADDR, IMAGE_SIZE)) {
+		printf("SIM test=image error=begin_failed\n");
+		return;
+	}
+	for(size_t offset = 0; offset < IMAGE_SIZE; offset += CHUNK_SIZE) {
+		size_t len = (IMAGE_SIZE - offset < CHUNK_SIZE) ? (IMAGE_SIZE - offset) : CHUNK_SIZE;
+		delayMicroseconds(CHUNK_US);
+		imageChunk(offset, chunk, len);
+		imageWriter.write(chunk, len);
+	}
+	bool verified = imageWriter.finish();
+	printResult(verified ? "image_writer" : "image_writer_failed", IMAGE_SIZE, SpiFlashHost::getMicros() - start);
+
+	const SpiFlashImageWriter::Stats &stats = imageWriter.getStats();
+	const SpiFlashSim::Stats &simStats = sim.getStats();
+	printf("SIM test=image_writer_verify crc_ok=%d pages=%lu page_programs=%lu erases=%lu wait_ms=%lu verify_ms=%lu\n",
+		(int) (verified && imageWriter.getCrc() == expectedCrc), (unsigned long) stats.pagePrograms,
+		(unsigned long) simStats.pagePrograms, (unsigned long) simStats.erases,
+		(unsigned long) stats.waitMs, (unsigned long) stats.verifyMs);
+}
+
+void imageChunk(size_t offset, uint8_t *buf, size_t len) {
+	// Pseudo-random bytes that depend only on the offset, so both runs write the same image
+	for(size_t ii = 0; ii < len; ii++) {
+		uint32_t value = (uint32_t) (offset + ii) * 2654435761UL;
+		buf[ii] = (uint8_t) (value >> 24);
+	}
+}
+
+size_t sensorRecord(uint32_t seq, char *buf, size_t bufLen) {
+	// Text telemetry with slowly changing values, which is what compresses well in practice
+	int len = snprintf(buf, bufLen, "seq=%lu t=%lu temp=%d.%d hum=%u bat=%u st=ok",
+		(unsigned long) seq, (unsigned long) (1700000000 + seq * 60), 20 + (int) (seq / 97) % 8, (int) (seq % 10),
+		40 + (unsigned) (seq / 31) % 20, 4100 - (unsigned) (seq / 50));
+	return (size_t) len;
+}
+
+void printResult(const char *test, size_t bytes, uint64_t us) {
+	unsigned long kbps = (us > 0) ? (unsigned long) ((uint64_t)bytes * 1000000 / 1024 / us) : 0;
+
+	printf("SIM test=%s bytes=%u us=%llu kbytes_per_sec=%lu\n", test, (unsigned) bytes, (unsigned long long) us, kbps);
+}
+
+void opDone(void *) {
+	outstanding--;
+}
+
+void priorityDone(void *param) {
+	if (priorityCount < sizeof(priorityOrder) - 1) {
+		priorityOrder[priorityCount++] = (char) (uintptr_t) param;
+	}
+}
+
+#if PLATFORM_THREADING
+
+static SpiFlashThreadSafe threadSafe(spiFlash);
+static SpiFlashRequest chainedReq;
+static uint8_t chainedBuf[SpiFlash::PAGE_SIZE];
+static volatile bool chainedSubmitted = false;
+static volatile size_t appBad = 0;
+static volatile bool appDone = false;
+
+void simulateThreadSafe() {
+	// Over the start of the image, which is no longer needed. The application thread writes and reads
+	// back sectors 0 and 1; the chained read is in sector 8 and the timeout test erases sector 9.
+	static const size_t APP_PAGES = 2 * SpiFlash::SECTOR_SIZE / SpiFlash::PAGE_SIZE;
+	static const size_t CHAIN_ADDR = 8 * SpiFlash::SECTOR_SIZE;
+	static const size_t TIMEOUT_ADDR = 9 * SpiFlash::SECTOR_SIZE;
+	static const unsigned long APP_TIMEOUT_MS = 10000;
+	SpiFlashRequest eraseReq, writeReq, timeoutReq;
+	uint8_t page[SpiFlash::PAGE_SIZE];
+	size_t bad = 0;
+
+	spiFlash.sectorErase(0);
+	spiFlash.sectorErase(SpiFlash::SECTOR_SIZE);
+	if (!threadSafe.begin()) {
+		printf("SIM test=threadsafe error=begin_failed\n");
+		return;
+	}
+	uint64_t start = SpiFlashHost::getMicros();
+	new Thread("app", threadSafeApp, (void *)APP_PAGES);
+
+	// lock() with two requests outstanding, the first of which submits another from its callback.
+	// The worker must not need the mutex that lock() holds for lock() to return.
+	eraseReq.setCallback(threadSafeChain, (void *)CHAIN_ADDR);
+	for(size_t ii = 0; ii < sizeof(page); ii++) {
+		page[ii] = (uint8_t) (ii ^ 0x5a);
+	}
+	threadSafe.sectorErase(eraseReq, CHAIN_ADDR);
+	threadSafe.writePage(writeReq, CHAIN_ADDR + SpiFlash::SECTOR_SIZE - SpiFlash::PAGE_SIZE, page, sizeof(page));
+	threadSafe.lock();
+	threadSafe.getFlash().readDataSync(CHAIN_ADDR + SpiFlash::SECTOR_SIZE - SpiFlash::PAGE_SIZE, buf, sizeof(page));
+	if (memcmp(buf, page, sizeof(page)) != 0) {
+		bad++;
+	}
+	threadSafe.unlock();
+
+	bool chained = eraseReq.wait(APP_TIMEOUT_MS) && writeReq.wait(APP_TIMEOUT_MS) && chainedSubmitted &&
+		chainedReq.wait(APP_TIMEOUT_MS);
+	for(size_t ii = 0; chained && ii < sizeof(chainedBuf); ii++) {
+		if (chainedBuf[ii] != 0xff) {
+			bad++;
+			break;
+		}
+	}
+
+	// A sector erase can't be done in 1 ms, but can be waited on again after the timeout
+	threadSafe.sectorErase(timeoutReq, TIMEOUT_ADDR);
+	bool timedOut = !timeoutReq.wait(1);
+	bool timeoutDone = timeoutReq.wait() && timeoutReq.isDone();
+
+	unsigned long waitStart = millis();
+	while(!appDone && millis() - waitStart < APP_TIMEOUT_MS) {
+		delay(1);
+	}
+	printResult(appDone ? "threadsafe" : "threadsafe_timeout", APP_PAGES * 2 * SpiFlash::PAGE_SIZE, SpiFlashHost::getMicros() - start);
+
+	printf("SIM test=threadsafe_verify bad=%u app_bad=%u chained=%d timeout=%d\n",
+		(unsigned) bad, (unsigned) appBad, (int) chained, (int) (timedOut && timeoutDone));
+}
+
+void threadSafeApp(void *param) {
+	size_t numPages = (size_t) param;
+	SpiFlashRequest req;
+	uint8_t page[SpiFlash::PAGE_SIZE];
+	uint8_t readBack[SpiFlash::PAGE_SIZE];
+
+	// Each page written and read back through the front end while the main thread uses it too
+	for(size_t pageIndex = 0; pageIndex < numPages; pageIndex++) {
+		for(size_t ii = 0; ii < sizeof(page); ii++) {
+			page[ii] = (uint8_t) (pageIndex * 13 + ii);
+		}
+		if (!threadSafe.writePage(req, pageIndex * SpiFlash::PAGE_SIZE, page, sizeof(page)) || !req.wait() ||
+			!threadSafe.read(req, pageIndex * SpiFlash::PAGE_SIZE, readBack, sizeof(readBack)) || !req.wait() ||
+			memcmp(page, readBack, sizeof(page)) != 0) {
+			appBad++;
+		}
+	}
+	appDone = true;
+}
+
+void threadSafeChain(SpiFlashRequest *, void *param) {
+	// Runs in the worker, possibly while the main thread holds lock()
+	chainedSubmitted = threadSafe.read(chainedReq, (size_t) param, chainedBuf, sizeof(chainedBuf));
+}
+
+#endif /* PLATFORM_THREADING */
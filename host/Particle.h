@@ -0,0 +1,291 @@
+#ifndef __PARTICLE_HOST_H
+#define __PARTICLE_HOST_H
+
+// Minimal stand-in for the Device OS API used by the SpiFlash library, so the library can be built
+// and profiled on a workstation against a simulated chip (see spiflashsim.h). Only used when the
+// host directory is on the include path, for example:
+//
+// g++ -DSPIFLASH_HOST -Ihost -I. host/*.cpp spiflash*.cpp myprogram.cpp
+//
+// Time is simulated. micros() and millis() only advance when the program calls delay() or
+// delayMicroseconds(), when SPI transfers clock data, or when a busy-wait calls SpiFlashHost::poll(),
+// so erases that take seconds on the chip take microseconds on the host. Timer callbacks and
+// DMA completions run from those calls, in time order, instead of from other threads and interrupts.
+//
+// Build with -DPLATFORM_THREADING=1 for Thread, Mutex, and the semaphore calls. Threads are
+// cooperative: only one runs at a time, and it only lets the others run when it waits in delay(),
+// on a semaphore, or on a locked mutex. Only the main thread advances the time while it waits.
+
+#ifndef SPIFLASH_HOST
+#error "host/Particle.h is only for host builds; define SPIFLASH_HOST"
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+
+#define MSBFIRST 1
+#define LSBFIRST 0
+#define SPI_MODE0 0
+
+#define MHZ 1000000
+
+#define A2 12
+#define D5 5
+#define D6 6
+#define D7 7
+
+#define SYSTEM_THREAD(x)
+#define SYSTEM_MODE(x)
+
+// Only one thing runs at a time on the host, so there is nothing to block
+#define ATOMIC_BLOCK() for(int __atomicOnce = 0; __atomicOnce < 1; __atomicOnce++)
+
+typedef void (*wiring_spi_dma_transfercomplete_callback_t)(void);
+
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long micros();
+unsigned long millis();
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+
+/**
+ * Returns true while a DMA completion callback is running, which stands in for an interrupt
+ */
+bool HAL_IsISR();
+
+/**
+ * A device on a simulated SPI bus. SPIClass calls it for every byte, and digitalWrite() calls
+ * select() and deselect() for its chip select pin.
+ */
+class SpiFlashHostDevice {
+public:
+	virtual ~SpiFlashHostDevice() {}
+
+	/**
+	 * Chip select went low
+	 */
+	virtual void select() = 0;
+
+	/**
+	 * Exchanges one byte while selected
+	 */
+	virtual uint8_t transfer(uint8_t data) = 0;
+
+	/**
+	 * Chip select went high
+	 */
+	virtual void deselect() = 0;
+};
+
+/**
+ * Simulated time and event loop
+ */
+class SpiFlashHost {
+public:
+	/**
+	 * Runs the DMA completions and timers that are due, or if none are, advances the time to the next
+	 * one. Call from busy-waits that would otherwise wait for an interrupt or another thread.
+	 */
+	static void poll();
+
+	/**
+	 * Advances the simulated time by us microseconds, running the events that become due
+	 */
+	static void advance(uint64_t us);
+
+	/**
+	 * Advances the simulated time without running any events, for time spent clocking SPI data
+	 */
+	static void elapse(uint64_t us);
+
+	/**
+	 * Returns the simulated time in microseconds, without wrapping
+	 */
+	static uint64_t getMicros();
+
+	/**
+	 * Schedules a DMA completion callback at the simulated time at
+	 */
+	static void scheduleDma(uint64_t at, wiring_spi_dma_transfercomplete_callback_t callback);
+
+#if PLATFORM_THREADING
+	/**
+	 * Lets the other threads run until each of them waits, then returns to the calling thread
+	 */
+	static void yield();
+
+	/**
+	 * Waits for another thread or an event: lets the other threads run, then on the main thread also
+	 * runs the next event, advancing the time to it if needed
+	 */
+	static void wait();
+#endif
+};
+
+class SPISettings {
+public:
+	SPISettings() {}
+	SPISettings(unsigned clock, int bitOrder, int dataMode) : clock(clock), bitOrder(bitOrder), dataMode(dataMode) {}
+
+	unsigned clock = 1 * MHZ;
+	int bitOrder = MSBFIRST;
+	int dataMode = SPI_MODE0;
+};
+
+/**
+ * SPI bus with a single simulated device. Transfers take the time the bytes would take at the
+ * configured clock; DMA transfers complete from the event loop.
+ */
+class SPIClass {
+public:
+	/**
+	 * Connects the device to the bus. It's selected by the pin passed to begin().
+	 */
+	void attach(SpiFlashHostDevice *device) { this->device = device; }
+
+	void begin(int ssPin);
+	void begin() {}
+	void end() {}
+	void setBitOrder(int order) { settings.bitOrder = order; }
+	void setDataMode(int mode) { settings.dataMode = mode; }
+	void setClockSpeed(unsigned value, unsigned scale = 1) { settings.clock = value * scale; }
+	int32_t beginTransaction(const SPISettings &newSettings) { settings = newSettings; return 0; }
+	int32_t beginTransaction() { return 0; }
+	void endTransaction() {}
+
+	uint8_t transfer(uint8_t data);
+	void transfer(const void *txBuf, void *rxBuf, size_t len, wiring_spi_dma_transfercomplete_callback_t callback);
+
+	/**
+	 * Called by digitalWrite() for the chip select pin
+	 */
+	void setSelected(bool selected);
+
+protected:
+	/**
+	 * Returns the time to clock len bytes, in microseconds
+	 */
+	uint64_t transferMicros(size_t len) const;
+
+	SpiFlashHostDevice *device = NULL;
+	SPISettings settings;
+	int csPin = -1;
+	uint64_t fractionalBits = 0;
+};
+
+extern SPIClass SPI;
+extern SPIClass SPI1;
+
+/**
+ * Software timer. The callback runs from the event loop when the period has elapsed.
+ */
+class Timer {
+public:
+	typedef std::function<void(void)> timer_callback_fn;
+
+	Timer(unsigned period, timer_callback_fn callback, bool oneShot = false);
+
+	template<typename T>
+	Timer(unsigned period, void (T::*handler)(), T &instance, bool oneShot = false) :
+		Timer(period, std::bind(handler, &instance), oneShot) {}
+
+	virtual ~Timer();
+
+	bool start(unsigned block = 0);
+	bool stop(unsigned block = 0);
+	bool reset(unsigned block = 0) { return start(block); }
+	bool changePeriod(unsigned period, unsigned block = 0);
+	bool startFromISR() { return start(); }
+	bool stopFromISR() { return stop(); }
+	bool resetFromISR() { return start(); }
+	bool changePeriodFromISR(unsigned period) { return changePeriod(period); }
+	bool isActive() const { return active; }
+
+	/**
+	 * Runs the callback if the timer is due at or before now. Used by the event loop.
+	 */
+	bool runIfDue(uint64_t now);
+
+	/**
+	 * Returns the list of all timers, for the event loop
+	 */
+	static Timer *getFirst() { return first; }
+	Timer *getNext() const { return next; }
+	uint64_t getDueMicros() const { return dueMicros; }
+
+protected:
+	timer_callback_fn callback;
+	unsigned period;
+	bool oneShot;
+	bool active = false;
+	uint64_t dueMicros = 0;
+	Timer *next = NULL;
+
+	static Timer *first;
+};
+
+/**
+ * Serial port that prints to stdout
+ */
+class USBSerial {
+public:
+	void begin(int baud = 9600) { (void)baud; }
+	bool isConnected() { return true; }
+	void printlnf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+	void printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+	void println(const char *str = "") { ::printf("%s\n", str); }
+};
+
+extern USBSerial Serial;
+
+#if PLATFORM_THREADING
+
+typedef uint32_t system_tick_t;
+typedef uint8_t os_thread_prio_t;
+typedef void (*os_thread_fn_t)(void *param);
+typedef struct SpiFlashHostSemaphore *os_semaphore_t;
+
+#define OS_THREAD_PRIORITY_DEFAULT 2
+#define CONCURRENT_WAIT_FOREVER ((system_tick_t)-1)
+
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial);
+int os_semaphore_destroy(os_semaphore_t semaphore);
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved);
+int os_semaphore_give(os_semaphore_t semaphore, bool reserved);
+
+/**
+ * Cooperative thread. It starts running the first time the thread that created it waits, and is
+ * never destroyed.
+ */
+class Thread {
+public:
+	Thread() {}
+	Thread(const char *name, os_thread_fn_t function, void *param = NULL, os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = 3072);
+};
+
+/**
+ * Non-recursive mutex. lock() lets the other threads run until it's unlocked.
+ */
+class Mutex {
+public:
+	void lock();
+	bool trylock();
+	void unlock() { locked = false; }
+
+protected:
+	bool locked = false;
+};
+
+#endif /* PLATFORM_THREADING */
+
+#endif /* __PARTICLE_HOST_H */
@@ -0,0 +1,433 @@
+
+#include "Particle.h"
+
+#include <stdarg.h>
+
+#if PLATFORM_THREADING
+#include <ucontext.h>
+#endif
+
+SPIClass SPI;
+SPIClass SPI1;
+USBSerial Serial;
+
+Timer *Timer::first = NULL;
+
+// Simulated time in microseconds
+static uint64_t nowMicros = 0;
+
+// True while a DMA completion callback (the stand-in for an interrupt) is running
+static bool inDma = false;
+
+// True while a timer callback is running. Timers don't preempt each other.
+static bool inTimer = false;
+
+// Pending DMA completions. There's at most one per bus at a time.
+static const size_t MAX_DMA_EVENTS = 8;
+
+struct DmaEvent {
+	uint64_t at;
+	wiring_spi_dma_transfercomplete_callback_t callback;
+};
+static DmaEvent dmaEvents[MAX_DMA_EVENTS];
+static size_t numDmaEvents = 0;
+
+// Chip select pins registered by SPIClass::begin()
+static const int MAX_PINS = 64;
+static SPIClass *csPins[MAX_PINS];
+
+/**
+ * Finds the earliest event that can run in the current context
+ *
+ * dmaIndex Set to the index of the DMA event, or MAX_DMA_EVENTS if the earliest event is a timer
+ * timer Set to the timer, or NULL if the earliest event is a DMA completion
+ *
+ * Returns false if there is nothing that can run.
+ */
+static bool findNextEvent(uint64_t &at, size_t &dmaIndex, Timer *&timer) {
+	bool found = false;
+
+	dmaIndex = MAX_DMA_EVENTS;
+	timer = NULL;
+
+	if (inDma) {
+		// Interrupts don't nest, and threads don't run until the interrupt returns
+		return false;
+	}
+
+	for(size_t ii = 0; ii < numDmaEvents; ii++) {
+		if (!found || dmaEvents[ii].at < at) {
+			at = dmaEvents[ii].at;
+			dmaIndex = ii;
+			found = true;
+		}
+	}
+
+	if (!inTimer) {
+		for(Timer *t = Timer::getFirst(); t != NULL; t = t->getNext()) {
+			if (t->isActive() && (!found || t->getDueMicros() < at)) {
+				at = t->getDueMicros();
+				dmaIndex = MAX_DMA_EVENTS;
+				timer = t;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+/**
+ * Runs one event found by findNextEvent()
+ */
+static void runEvent(size_t dmaIndex, Timer *timer) {
+	if (timer != NULL) {
+		inTimer = true;
+		timer->runIfDue(nowMicros);
+		inTimer = false;
+	}
+	else {
+		wiring_spi_dma_transfercomplete_callback_t callback = dmaEvents[dmaIndex].callback;
+		dmaEvents[dmaIndex] = dmaEvents[--numDmaEvents];
+
+		inDma = true;
+		callback();
+		inDma = false;
+	}
+}
+
+// [static]
+void SpiFlashHost::poll() {
+	uint64_t at;
+	size_t dmaIndex;
+	Timer *timer;
+
+	if (!findNextEvent(at, dmaIndex, timer)) {
+		// Nothing will ever happen, but let the time pass so timeouts in the caller still work
+		nowMicros++;
+		return;
+	}
+	if (at > nowMicros) {
+		nowMicros = at;
+	}
+	runEvent(dmaIndex, timer);
+}
+
+// [static]
+void SpiFlashHost::advance(uint64_t us) {
+	uint64_t target = nowMicros + us;
+	uint64_t at;
+	size_t dmaIndex;
+	Timer *timer;
+
+	while(findNextEvent(at, dmaIndex, timer) && at <= target) {
+		if (at > nowMicros) {
+			nowMicros = at;
+		}
+		runEvent(dmaIndex, timer);
+	}
+	if (target > nowMicros) {
+		nowMicros = target;
+	}
+}
+
+// [static]
+void SpiFlashHost::elapse(uint64_t us) {
+	nowMicros += us;
+}
+
+// [static]
+uint64_t SpiFlashHost::getMicros() {
+	return nowMicros;
+}
+
+// [static]
+void SpiFlashHost::scheduleDma(uint64_t at, wiring_spi_dma_transfercomplete_callback_t callback) {
+	if (numDmaEvents >= MAX_DMA_EVENTS) {
+		fprintf(stderr, "SpiFlashHost: too many DMA transfers in progress\n");
+		abort();
+	}
+	dmaEvents[numDmaEvents].at = at;
+	dmaEvents[numDmaEvents].callback = callback;
+	numDmaEvents++;
+}
+
+void delay(unsigned long ms) {
+#if PLATFORM_THREADING
+	// Other threads run while this one sleeps, but not from inside an event
+	if (!inDma && !inTimer) {
+		SpiFlashHost::yield();
+	}
+#endif
+	SpiFlashHost::advance((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+	SpiFlashHost::advance(us);
+}
+
+unsigned long micros() {
+	return (unsigned long) nowMicros;
+}
+
+unsigned long millis() {
+	return (unsigned long) (nowMicros / 1000);
+}
+
+void pinMode(int, int) {
+}
+
+void digitalWrite(int pin, int value) {
+	if (pin >= 0 && pin < MAX_PINS && csPins[pin] != NULL) {
+		csPins[pin]->setSelected(value == LOW);
+	}
+}
+
+bool HAL_IsISR() {
+	return inDma;
+}
+
+void SPIClass::begin(int ssPin) {
+	csPin = ssPin;
+	if (ssPin >= 0 && ssPin < MAX_PINS) {
+		csPins[ssPin] = this;
+	}
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+	SpiFlashHost::elapse(transferMicros(1));
+	return (device != NULL) ? device->transfer(data) : 0xff;
+}
+
+void SPIClass::transfer(const void *txBuf, void *rxBuf, size_t len, wiring_spi_dma_transfercomplete_callback_t callback) {
+	for(size_t ii = 0; ii < len; ii++) {
+		uint8_t value = (txBuf != NULL) ? ((const uint8_t *)txBuf)[ii] : 0xff;
+		value = (device != NULL) ? device->transfer(value) : 0xff;
+		if (rxBuf != NULL) {
+			((uint8_t *)rxBuf)[ii] = value;
+		}
+	}
+
+	if (callback != NULL) {
+		SpiFlashHost::scheduleDma(SpiFlashHost::getMicros() + transferMicros(len), callback);
+	}
+	else {
+		SpiFlashHost::elapse(transferMicros(len));
+	}
+}
+
+void SPIClass::setSelected(bool selected) {
+	if (device == NULL) {
+		return;
+	}
+	if (selected) {
+		device->select();
+	}
+	else {
+		device->deselect();
+	}
+}
+
+uint64_t SPIClass::transferMicros(size_t len) const {
+	// Carry the remainder so single byte transfers add up to the right time
+	uint64_t bits = (uint64_t)len * 8 * 1000000 + fractionalBits;
+	const_cast<SPIClass *>(this)->fractionalBits = bits % settings.clock;
+	return bits / settings.clock;
+}
+
+Timer::Timer(unsigned period, timer_callback_fn callback, bool oneShot) : callback(callback), period(period), oneShot(oneShot) {
+	next = first;
+	first = this;
+}
+
+Timer::~Timer() {
+	for(Timer **t = &first; *t != NULL; t = &(*t)->next) {
+		if (*t == this) {
+			*t = next;
+			break;
+		}
+	}
+}
+
+bool Timer::start(unsigned) {
+	active = true;
+	dueMicros = SpiFlashHost::getMicros() + (uint64_t)period * 1000;
+	return true;
+}
+
+bool Timer::stop(unsigned) {
+	active = false;
+	return true;
+}
+
+bool Timer::changePeriod(unsigned newPeriod, unsigned block) {
+	// Like Device OS, this also starts a dormant timer
+	period = newPeriod;
+	return start(block);
+}
+
+bool Timer::runIfDue(uint64_t now) {
+	if (!active || dueMicros > now) {
+		return false;
+	}
+	if (oneShot) {
+		active = false;
+	}
+	else {
+		dueMicros += (uint64_t)period * 1000;
+	}
+	callback();
+	return true;
+}
+
+void USBSerial::printlnf(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	::printf("\n");
+}
+
+void USBSerial::printf(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+#if PLATFORM_THREADING
+
+struct HostThread {
+	ucontext_t context;
+	os_thread_fn_t function;
+	void *param;
+	HostThread *next;		// Ring of all threads, starting with the main thread
+};
+
+struct SpiFlashHostSemaphore {
+	unsigned count;
+	unsigned max;
+};
+
+// Smallest stack for a host thread; the stack sizes used on the device are too small for libc
+static const size_t MIN_HOST_STACK_SIZE = 64 * 1024;
+
+static HostThread mainThread;
+static HostThread *currentThread = NULL;
+
+/**
+ * Returns the running thread, setting up the ring on first use
+ */
+static HostThread *getCurrentThread() {
+	if (currentThread == NULL) {
+		mainThread.next = &mainThread;
+		currentThread = &mainThread;
+	}
+	return currentThread;
+}
+
+/**
+ * Entry point of every thread created with Thread
+ */
+static void threadEntry() {
+	HostThread *thread = currentThread;
+
+	thread->function(thread->param);
+
+	// The function returned, so take the thread out of the ring for good. The stack is leaked.
+	HostThread *prev = thread;
+	while(prev->next != thread) {
+		prev = prev->next;
+	}
+	prev->next = thread->next;
+	currentThread = thread->next;
+	setcontext(&currentThread->context);
+}
+
+// [static]
+void SpiFlashHost::yield() {
+	HostThread *thread = getCurrentThread();
+
+	if (thread->next != thread) {
+		// Each thread runs until it waits and switches to the next, so this returns once they all have
+		currentThread = thread->next;
+		swapcontext(&thread->context, &currentThread->context);
+		currentThread = thread;
+	}
+}
+
+// [static]
+void SpiFlashHost::wait() {
+	yield();
+	if (currentThread == &mainThread) {
+		poll();
+	}
+}
+
+Thread::Thread(const char *, os_thread_fn_t function, void *param, os_thread_prio_t, size_t stackSize) {
+	HostThread *current = getCurrentThread();
+	HostThread *thread = new HostThread;
+
+	if (stackSize < MIN_HOST_STACK_SIZE) {
+		stackSize = MIN_HOST_STACK_SIZE;
+	}
+	thread->function = function;
+	thread->param = param;
+	getcontext(&thread->context);
+	thread->context.uc_stack.ss_sp = new uint8_t[stackSize];
+	thread->context.uc_stack.ss_size = stackSize;
+	thread->context.uc_link = NULL;
+	makecontext(&thread->context, threadEntry, 0);
+
+	thread->next = current->next;
+	current->next = thread;
+}
+
+void Mutex::lock() {
+	while(locked) {
+		SpiFlashHost::wait();
+	}
+	locked = true;
+}
+
+bool Mutex::trylock() {
+	if (locked) {
+		return false;
+	}
+	locked = true;
+	return true;
+}
+
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial) {
+	*semaphore = new SpiFlashHostSemaphore;
+	(*semaphore)->count = initial;
+	(*semaphore)->max = max;
+	return 0;
+}
+
+int os_semaphore_destroy(os_semaphore_t semaphore) {
+	delete semaphore;
+	return 0;
+}
+
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool) {
+	uint64_t start = SpiFlashHost::getMicros();
+
+	while(semaphore->count == 0) {
+		if (timeout != CONCURRENT_WAIT_FOREVER && SpiFlashHost::getMicros() - start >= (uint64_t)timeout * 1000) {
+			return 1;
+		}
+		SpiFlashHost::wait();
+	}
+	semaphore->count--;
+	return 0;
+}
+
+int os_semaphore_give(os_semaphore_t semaphore, bool) {
+	if (semaphore->count >= semaphore->max) {
+		return 1;
+	}
+	semaphore->count++;
+	return 0;
+}
+
+#endif /* PLATFORM_THREADING */
@@ -0,0 +1,497 @@
+
+#include "Particle.h"
+
+#include "spiflashsim.h"
+
+// Typical times from the device traits
+static const SpiFlashSim::Timing _defaultTiming = {
+	SpiFlash::Device::PAGE_PROGRAM_US,		// tPP
+	SpiFlash::Device::WRITE_STATUS_US,		// tW
+	SpiFlash::Device::SECTOR_ERASE_US,		// tSE
+	SpiFlash::Device::BLOCK32_ERASE_US,		// tBE 32K
+	SpiFlash::Device::BLOCK_ERASE_US,		// tBE
+	SpiFlash::Device::CHIP_ERASE_US			// tCE
+};
+
+// JEDEC ID: manufacturer, memory type, capacity
+static const uint8_t _jedecId[3] = {
+	SpiFlash::Device::JEDEC_MANUFACTURER, SpiFlash::Device::JEDEC_MEMORY_TYPE, SpiFlash::Device::JEDEC_CAPACITY
+};
+
+// Returned by RDP (0xAB), as on the 25LQ080. The driver doesn't check it.
+static const uint8_t _deviceId = 0x13;
+
+SpiFlashSim::SpiFlashSim(size_t size, uint8_t *memory) : memory(memory), size(size), ownMemory(memory == NULL), timing(_defaultTiming) {
+	if (ownMemory) {
+		this->memory = (uint8_t *) malloc(size);
+		memset(this->memory, 0xff, size);
+	}
+	eraseCounts = (uint32_t *) calloc(size / SECTOR_SIZE, sizeof(uint32_t));
+	memset(&stats, 0, sizeof(stats));
+}
+
+SpiFlashSim::~SpiFlashSim() {
+	if (ownMemory) {
+		free(memory);
+	}
+	free(eraseCounts);
+}
+
+void SpiFlashSim::resetStats() {
+	// Violations are kept for the whole run, so measuring one section can't hide failures in another
+	Stats violations = stats;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.zeroToOneBits = violations.zeroToOneBits;
+	stats.busyViolations = violations.busyViolations;
+	stats.wrenViolations = violations.wrenViolations;
+	stats.suspendViolations = violations.suspendViolations;
+	stats.formatViolations = violations.formatViolations;
+	memset(eraseCounts, 0, (size / SECTOR_SIZE) * sizeof(uint32_t));
+}
+
+uint32_t SpiFlashSim::getViolationCount() const {
+	return stats.zeroToOneBits + stats.busyViolations + stats.wrenViolations + stats.suspendViolations + stats.formatViolations;
+}
+
+bool SpiFlashSim::isBusy() const {
+	return SpiFlashHost::getMicros() < busyUntil;
+}
+
+void SpiFlashSim::select() {
+	selected = true;
+	ignoring = false;
+	pos = 0;
+	addr = 0;
+}
+
+uint8_t SpiFlashSim::transfer(uint8_t data) {
+	uint8_t result = 0xff;
+
+	if (!selected) {
+		return result;
+	}
+	if (pos == 0) {
+		result = startCommand(data);
+		pos++;
+		return result;
+	}
+	if (ignoring) {
+		pos++;
+		return result;
+	}
+	if (pos <= addrLen) {
+		addr = (addr << 8) | data;
+		pos++;
+		return result;
+	}
+
+	switch(cmd) {
+	case 0x05: // RDSR, repeats for as long as CS is low
+		result = status | (isBusy() ? (STATUS_WIP | STATUS_WEL) : 0);
+		break;
+
+	case 0x9f: // JEDEC ID
+		if (pos <= sizeof(_jedecId)) {
+			result = _jedecId[pos - 1];
+		}
+		break;
+
+	case 0xab: // RDP, device ID after 3 dummy bytes
+		if (pos >= 4) {
+			result = _deviceId;
+		}
+		break;
+
+	case 0x01: // WRSR
+		if (pos == 1) {
+			newStatus = data;
+		}
+		break;
+
+	case 0x03: // READ
+	case 0x13: // READ4B
+	case 0x0b: // FAST_READ
+	case 0x0c: // FAST_READ4B
+	case 0x3b: // FRDO, simulated on a single line
+	case 0x3c: // FRDO4B
+	case 0x6b: // FRQO, simulated on a single line
+	case 0x6c: // FRQO4B
+	{
+		// One dummy byte except for READ
+		size_t dataPos = 1 + addrLen + ((cmd == 0x03 || cmd == 0x13) ? 0 : 1);
+		if (pos >= dataPos) {
+			if (pos == dataPos && suspended && inSuspendedRange(addr % size, 1)) {
+				violation(stats.suspendViolations, "read of the suspended erase");
+			}
+			// Sequential reads wrap around at the end of the array
+			result = memory[addr % size];
+			addr++;
+			stats.readBytes++;
+		}
+		break;
+	}
+
+	case 0x5a: // RDSFDP, one dummy byte
+		if (pos >= 1 + addrLen + 1) {
+			result = (addr < sizeof(sfdp)) ? sfdp[addr] : 0xff;
+			addr++;
+		}
+		break;
+
+	case 0x02: // PAGE_PROG
+	case 0x12: // PAGE_PROG4B
+	{
+		// Only the last 256 bytes are programmed, wrapping around within the page
+		size_t offset = ((addr % PAGE_SIZE) + pageOffset) % PAGE_SIZE;
+		pageBuf[offset] = data;
+		pageWritten[offset] = true;
+		pageOffset++;
+		stats.programmedBytes++;
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	pos++;
+	return result;
+}
+
+uint8_t SpiFlashSim::startCommand(uint8_t data) {
+	cmd = data;
+	stats.commands++;
+
+	if (poweredDown && cmd != 0xab) {
+		violation(stats.busyViolations, "instruction while in deep power-down");
+		ignoring = true;
+	}
+	else
+	if (isBusy() && cmd != 0x05 && cmd != 0x75) {
+		violation(stats.busyViolations, "instruction while WIP is set");
+		ignoring = true;
+	}
+
+	addrLen = addressBytes(cmd);
+	if (cmd == 0x02 || cmd == 0x12) {
+		memset(pageWritten, 0, sizeof(pageWritten));
+		pageOffset = 0;
+	}
+	if (cmd == 0x5a) {
+		buildSfdp();
+	}
+	return 0xff;
+}
+
+void SpiFlashSim::buildSfdp() {
+	static const uint32_t eraseUnits[4] = { 1000, 16000, 128000, 1000000 };
+	static const uint32_t programUnits[2] = { 8, 64 };
+	static const uint32_t chipEraseUnits[4] = { 16000, 256000, 4000000, 64000000 };
+	uint32_t dw[SFDP_TABLE_DWORDS];
+
+	memset(sfdp, 0xff, sizeof(sfdp));
+	if (!sfdpEnabled) {
+		return;
+	}
+
+	// Header: signature, revision 1.6 (JESD216B), one parameter header
+	memcpy(sfdp, "SFDP", 4);
+	sfdp[4] = 6;
+	sfdp[5] = 1;
+	sfdp[6] = 0;
+
+	// Parameter header for the basic flash parameter table
+	sfdp[8] = 0x00;
+	sfdp[9] = 6;
+	sfdp[10] = 1;
+	sfdp[11] = SFDP_TABLE_DWORDS;
+	sfdp[12] = (uint8_t) SFDP_TABLE_ADDR;
+	sfdp[13] = 0;
+	sfdp[14] = 0;
+	sfdp[15] = 0xff;
+
+	// The table gives the 3-byte instructions even for parts that use the 4-byte ones
+	uint8_t sectorErase = (SpiFlash::ADDRESS_BYTES == 3) ? SpiFlash::Device::OPCODE_SECTOR_ERASE : 0x20;
+	uint8_t readModes = SpiFlash::Device::READ_MODES;
+	const SpiFlash::ReadModeInfo &dualOutput = SpiFlash::getReadModeInfo(SpiFlash::READ_MODE_DUAL_OUTPUT);
+	const SpiFlash::ReadModeInfo &quadOutput = SpiFlash::getReadModeInfo(SpiFlash::READ_MODE_QUAD_OUTPUT);
+	const SpiFlash::ReadModeInfo &dualIo = SpiFlash::getReadModeInfo(SpiFlash::READ_MODE_DUAL_IO);
+	const SpiFlash::ReadModeInfo &quadIo = SpiFlash::getReadModeInfo(SpiFlash::READ_MODE_QUAD_IO);
+
+	memset(dw, 0, sizeof(dw));
+
+	// 1: 4K erase and its instruction, address bytes, and the dual and quad reads
+	dw[0] = 0xff000000 | (1 << 23) | 0x04 | 0x01 | (sectorErase << 8);
+	dw[0] |= (uint32_t) ((SpiFlash::ADDRESS_BYTES == 4) ? 1 : 0) << 17;
+	dw[0] |= (readModes & (1 << SpiFlash::READ_MODE_DUAL_OUTPUT)) ? (1 << 16) : 0;
+	dw[0] |= (readModes & (1 << SpiFlash::READ_MODE_DUAL_IO)) ? (1 << 20) : 0;
+	dw[0] |= (readModes & (1 << SpiFlash::READ_MODE_QUAD_IO)) ? (1 << 21) : 0;
+	dw[0] |= (readModes & (1 << SpiFlash::READ_MODE_QUAD_OUTPUT)) ? (1 << 22) : 0;
+
+	// 2: density in bits, minus one
+	dw[1] = (uint32_t) (size * 8 - 1);
+
+	// 3 and 4: instructions and wait states. The mode clocks are counted as wait states.
+	dw[2] = (0xeb << 8) | quadIo.dummyCycles | (0x6b << 24) | (quadOutput.dummyCycles << 16);
+	dw[3] = (0x3b << 8) | dualOutput.dummyCycles | (0xbb << 24) | (dualIo.dummyCycles << 16);
+
+	// 5 to 7: no 2-2-2 or 4-4-4 modes
+	dw[4] = 0xffffffee;
+	dw[5] = 0x0000ffff;
+	dw[6] = 0x0000ffff;
+
+	// 8 and 9: erase types 4K, 32K, and 64K
+	dw[7] = 12 | (sectorErase << 8) | (15 << 16) | (0x52 << 24);
+	dw[8] = 16 | (0xd8 << 8);
+
+	// 10: typical erase times, with the maximum at 4 times typical
+	dw[9] = 0x01;
+	dw[9] |= encodeSfdpTime(timing.sectorEraseUs, eraseUnits, 4) << 4;
+	dw[9] |= encodeSfdpTime(timing.block32EraseUs, eraseUnits, 4) << 11;
+	dw[9] |= encodeSfdpTime(timing.blockEraseUs, eraseUnits, 4) << 18;
+
+	// 11: page size, typical page program and chip erase times
+	dw[10] = 0x01 | (8 << 4);
+	dw[10] |= encodeSfdpTime(timing.pageProgramUs, programUnits, 2) << 8;
+	dw[10] |= encodeSfdpTime(timing.chipEraseUs, chipEraseUnits, 4) << 24;
+
+	for(size_t ii = 0; ii < SFDP_TABLE_DWORDS; ii++) {
+		for(size_t jj = 0; jj < 4; jj++) {
+			sfdp[SFDP_TABLE_ADDR + ii * 4 + jj] = (uint8_t) (dw[ii] >> (8 * jj));
+		}
+	}
+}
+
+// [static]
+uint32_t SpiFlashSim::encodeSfdpTime(uint32_t us, const uint32_t *units, size_t numUnits) {
+	// Smallest unit that fits in 32 counts, rounding up
+	for(size_t ii = 0; ii < numUnits; ii++) {
+		uint32_t count = (us + units[ii] - 1) / units[ii];
+		if (count == 0) {
+			count = 1;
+		}
+		if (count <= 32 || ii == numUnits - 1) {
+			if (count > 32) {
+				count = 32;
+			}
+			return (uint32_t) ((count - 1) | (ii << 5));
+		}
+	}
+	return 0;
+}
+
+// [static]
+size_t SpiFlashSim::addressBytes(uint8_t cmd) {
+	switch(cmd) {
+	case 0x03: // READ
+	case 0x0b: // FAST_READ
+	case 0x3b: // FRDO
+	case 0x6b: // FRQO
+	case 0x02: // PAGE_PROG
+	case 0x5a: // RDSFDP
+	case 0x20: // SECTOR_ER
+	case 0xd7: // SECTOR_ER
+	case 0x52: // BLOCK_ER32
+	case 0xd8: // BLOCK_ER
+		return 3;
+
+	case 0x13: // READ4B
+	case 0x0c: // FAST_READ4B
+	case 0x3c: // FRDO4B
+	case 0x6c: // FRQO4B
+	case 0x12: // PAGE_PROG4B
+	case 0x21: // SECTOR_ER4B
+	case 0x5c: // BLOCK_ER32_4B
+	case 0xdc: // BLOCK_ER4B
+		return 4;
+
+	default:
+		return 0;
+	}
+}
+
+void SpiFlashSim::deselect() {
+	if (!selected) {
+		return;
+	}
+	selected = false;
+	if (ignoring || pos == 0) {
+		return;
+	}
+
+	switch(cmd) {
+	case 0x06: // WREN
+		status |= STATUS_WEL;
+		break;
+
+	case 0x04: // WRDI
+		status &= ~STATUS_WEL;
+		break;
+
+	case 0x01: // WRSR
+		if (pos != 2) {
+			violation(stats.formatViolations, "WRSR without exactly one data byte");
+		}
+		else
+		if ((status & STATUS_WEL) == 0) {
+			violation(stats.wrenViolations, "WRSR without WREN");
+		}
+		else {
+			status = (uint8_t) ((newStatus & ~(STATUS_WIP | STATUS_WEL)) | STATUS_WEL);
+			setBusy(timing.writeStatusUs, false);
+		}
+		break;
+
+	case 0x02: // PAGE_PROG
+	case 0x12:
+		finishProgram();
+		break;
+
+	case 0x20: // SECTOR_ER
+	case 0xd7:
+	case 0x21:
+		finishErase(SECTOR_SIZE, timing.sectorEraseUs);
+		break;
+
+	case 0x52: // BLOCK_ER32
+	case 0x5c:
+		finishErase(BLOCK32_SIZE, timing.block32EraseUs);
+		break;
+
+	case 0xd8: // BLOCK_ER
+	case 0xdc:
+		finishErase(BLOCK_SIZE, timing.blockEraseUs);
+		break;
+
+	case 0xc7: // CHIP_ER
+	case 0x60:
+		addr = 0;
+		finishErase(size, timing.chipEraseUs);
+		break;
+
+	case 0xb9: // DP
+		poweredDown = true;
+		break;
+
+	case 0xab: // RDP
+		poweredDown = false;
+		break;
+
+	case 0x75: // PERSUS
+		if (!isBusy() || !busyErase || suspended) {
+			violation(stats.formatViolations, "suspend without an erase in progress");
+			break;
+		}
+		suspended = true;
+		suspendedRemaining = busyUntil - SpiFlashHost::getMicros();
+		suspendedAddr = busyAddr;
+		suspendedLen = busyLen;
+		busyUntil = 0;
+		stats.suspends++;
+		break;
+
+	case 0x7a: // PERRSM
+		if (!suspended) {
+			violation(stats.formatViolations, "resume without a suspended erase");
+			break;
+		}
+		suspended = false;
+		busyErase = true;
+		busyAddr = suspendedAddr;
+		busyLen = suspendedLen;
+		busyUntil = SpiFlashHost::getMicros() + suspendedRemaining;
+		break;
+
+	default:
+		break;
+	}
+}
+
+void SpiFlashSim::setBusy(uint32_t us, bool erase) {
+	// WEL stays set while WIP is, and is cleared when the operation finishes
+	status &= ~STATUS_WEL;
+	busyUntil = SpiFlashHost::getMicros() + us;
+	busyErase = erase;
+}
+
+void SpiFlashSim::finishProgram() {
+	if (pos <= addrLen) {
+		violation(stats.formatViolations, "page program without an address");
+		return;
+	}
+	if ((status & STATUS_WEL) == 0) {
+		violation(stats.wrenViolations, "page program without WREN");
+		return;
+	}
+	if (pos == 1 + addrLen) {
+		// CS going high without any data cancels the program
+		status &= ~STATUS_WEL;
+		return;
+	}
+
+	size_t pageAddr = (addr % size) - (addr % PAGE_SIZE);
+	if (suspended && inSuspendedRange(pageAddr, PAGE_SIZE)) {
+		violation(stats.suspendViolations, "page program in the suspended erase");
+		status &= ~STATUS_WEL;
+		return;
+	}
+
+	bool zeroToOne = false;
+	for(size_t ii = 0; ii < PAGE_SIZE; ii++) {
+		if (pageWritten[ii]) {
+			// 0xff leaves a byte unchanged, which is how partial pages are normally programmed
+			if (pageBuf[ii] != 0xff && (pageBuf[ii] & ~memory[pageAddr + ii]) != 0) {
+				zeroToOne = true;
+			}
+			memory[pageAddr + ii] &= pageBuf[ii];
+		}
+	}
+	if (zeroToOne) {
+		violation(stats.zeroToOneBits, "page program of a 1 bit over a 0 bit");
+	}
+
+	stats.pagePrograms++;
+	busyAddr = pageAddr;
+	busyLen = PAGE_SIZE;
+	setBusy(timing.pageProgramUs, false);
+}
+
+void SpiFlashSim::finishErase(size_t len, uint32_t us) {
+	if (pos != 1 + addrLen) {
+		violation(stats.formatViolations, "erase with the wrong number of address bytes");
+		return;
+	}
+	if ((status & STATUS_WEL) == 0) {
+		violation(stats.wrenViolations, "erase without WREN");
+		return;
+	}
+	if (suspended) {
+		violation(stats.suspendViolations, "erase while another erase is suspended");
+		status &= ~STATUS_WEL;
+		return;
+	}
+
+	size_t start = (addr % size) - (addr % len);
+	memset(&memory[start], 0xff, len);
+	for(size_t sector = start / SECTOR_SIZE; sector < (start + len) / SECTOR_SIZE; sector++) {
+		eraseCounts[sector]++;
+	}
+
+	stats.erases++;
+	busyAddr = start;
+	busyLen = len;
+	setBusy(us, true);
+}
+
+bool SpiFlashSim::inSuspendedRange(size_t start, size_t len) const {
+	return start < suspendedAddr + suspendedLen && suspendedAddr < start + len;
+}
+
+void SpiFlashSim::violation(uint32_t &counter, const char *what) {
+	counter++;
+	if (verbose) {
+		fprintf(stderr, "SpiFlashSim: %s (instruction 0x%02x addr 0x%06lx at %llu us)\n", what, cmd,
+			(unsigned long) addr, (unsigned long long) SpiFlashHost::getMicros());
+	}
+}
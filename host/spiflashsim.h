@@ -0,0 +1,226 @@
+#ifndef __SPIFLASHSIM_H
+#define __SPIFLASHSIM_H
+
+#include "Particle.h"
+
+#include "spiflash.h"
+
+/**
+ * Simulated flash chip for host builds, by default the one in SpiFlash::Device
+ *
+ * Decodes the same instructions as the chip, one byte at a time from the simulated SPI bus, and
+ * enforces the NOR flash rules the driver depends on: programs can only clear bits, a program
+ * wraps around within its page, erases clear whole sectors or blocks, and program, erase, and
+ * write status instructions are ignored unless WREN was sent first. WIP stays set for the
+ * configured program and erase times of simulated time, and instructions other than RDSR and
+ * suspend are ignored while it is. Anything the real chip would ignore or do differently from
+ * what the driver intended is counted as a violation, and printed if verbose is set.
+ *
+ * Attach it to a bus before calling SpiFlash::begin(), for example:
+ *
+ * SpiFlashSim sim;
+ * SpiFlash spiFlash(SPI, A2);
+ *
+ * SPI.attach(&sim);
+ * spiFlash.begin();
+ */
+class SpiFlashSim : public SpiFlashHostDevice {
+public:
+	/**
+	 * Program and erase times, in microseconds
+	 */
+	struct Timing {
+		uint32_t pageProgramUs;		//!< tPP
+		uint32_t writeStatusUs;		//!< tW
+		uint32_t sectorEraseUs;		//!< tSE
+		uint32_t block32EraseUs;	//!< tBE for a 32K block
+		uint32_t blockEraseUs;		//!< tBE for a 64K block
+		uint32_t chipEraseUs;		//!< tCE
+	};
+
+	/**
+	 * Counters, see getStats()
+	 */
+	struct Stats {
+		uint32_t commands;				//!< Instructions received
+		uint32_t readBytes;				//!< Data bytes read
+		uint32_t pagePrograms;			//!< Page programs started
+		uint32_t programmedBytes;		//!< Data bytes received by page programs
+		uint32_t erases;				//!< Sector, block, and chip erases started
+		uint32_t suspends;				//!< Erases suspended
+		uint32_t zeroToOneBits;			//!< Programs with a 1 bit over a 0 bit, which the chip can't do (0xff bytes excepted)
+		uint32_t busyViolations;		//!< Instructions ignored because WIP was set
+		uint32_t wrenViolations;		//!< Programs, erases, and status writes ignored because WEL was clear
+		uint32_t suspendViolations;		//!< Reads and programs of a suspended erase's range
+		uint32_t formatViolations;		//!< Instructions with the wrong number of bytes
+	};
+
+	/**
+	 * Constructs the simulator
+	 *
+	 * size Size of the array in bytes, a multiple of the sector size
+	 * memory Array contents, or NULL to allocate it erased. Pass a mmap'd file to keep the contents
+	 * between runs.
+	 *
+	 * The JEDEC ID is the one in SpiFlash::Device. Both the 3-byte and the 4-byte address
+	 * instructions are decoded. The SFDP table (instruction 0x5A) describes the same chip, with the
+	 * current program and erase times.
+	 */
+	SpiFlashSim(size_t size = SpiFlash::NUM_SECTORS * SpiFlash::SECTOR_SIZE, uint8_t *memory = NULL);
+	virtual ~SpiFlashSim();
+
+	virtual void select();
+	virtual uint8_t transfer(uint8_t data);
+	virtual void deselect();
+
+	/**
+	 * Sets the program and erase times. The defaults are the typical times from the datasheet.
+	 */
+	void setTiming(const Timing &timing) { this->timing = timing; }
+
+	/**
+	 * Returns the current program and erase times
+	 */
+	const Timing &getTiming() const { return timing; }
+
+	/**
+	 * Makes the chip answer SFDP reads with an invalid signature, like a chip without SFDP
+	 */
+	void setSfdpEnabled(bool enabled) { sfdpEnabled = enabled; }
+
+	/**
+	 * Prints each violation to stderr
+	 */
+	void setVerbose(bool verbose) { this->verbose = verbose; }
+
+	/**
+	 * Returns the counters
+	 */
+	const Stats &getStats() const { return stats; }
+
+	/**
+	 * Clears the operation counters and the sector erase counts. The violation counters are not
+	 * cleared, so getViolationCount() always covers everything since construction.
+	 */
+	void resetStats();
+
+	/**
+	 * Returns the number of violations of all kinds
+	 */
+	uint32_t getViolationCount() const;
+
+	/**
+	 * Returns the number of times a sector has been erased, by any erase instruction
+	 */
+	uint32_t getEraseCount(size_t sector) const { return eraseCounts[sector]; }
+
+	/**
+	 * Returns the array contents, which can be inspected or preset directly
+	 */
+	uint8_t *getMemory() { return memory; }
+
+	/**
+	 * Returns the size of the array
+	 */
+	size_t getSize() const { return size; }
+
+	/**
+	 * Returns true while WIP is set
+	 */
+	bool isBusy() const;
+
+	static const size_t PAGE_SIZE = 256;
+	static const size_t SECTOR_SIZE = 4096;
+	static const size_t BLOCK32_SIZE = 32 * 1024;
+	static const size_t BLOCK_SIZE = 64 * 1024;
+
+	static const size_t SFDP_TABLE_ADDR = 0x30;
+	static const size_t SFDP_TABLE_DWORDS = 16;
+	static const size_t SFDP_SIZE = SFDP_TABLE_ADDR + SFDP_TABLE_DWORDS * 4;
+
+	static const uint8_t STATUS_WIP = 0x01;
+	static const uint8_t STATUS_WEL = 0x02;
+
+protected:
+	/**
+	 * Handles the first byte of an instruction
+	 */
+	uint8_t startCommand(uint8_t data);
+
+	/**
+	 * Returns the number of address bytes that follow an instruction code, or 0 if it has none
+	 */
+	static size_t addressBytes(uint8_t cmd);
+
+	/**
+	 * Fills in sfdp from the device traits and the current timing
+	 */
+	void buildSfdp();
+
+	/**
+	 * Encodes a typical time for the basic parameter table as a 5-bit count minus one and a 2-bit unit
+	 * index into units
+	 */
+	static uint32_t encodeSfdpTime(uint32_t us, const uint32_t *units, size_t numUnits);
+
+	/**
+	 * Starts a program or erase, setting WIP for us microseconds
+	 */
+	void setBusy(uint32_t us, bool erase);
+
+	/**
+	 * Finishes a page program when CS goes high
+	 */
+	void finishProgram();
+
+	/**
+	 * Erases [addr, addr + len) when CS goes high
+	 */
+	void finishErase(size_t len, uint32_t us);
+
+	/**
+	 * Returns true if [addr, addr + len) overlaps the suspended erase
+	 */
+	bool inSuspendedRange(size_t addr, size_t len) const;
+
+	/**
+	 * Counts a violation and prints it if verbose
+	 */
+	void violation(uint32_t &counter, const char *what);
+
+	uint8_t *memory;
+	size_t size;
+	bool ownMemory;
+	uint32_t *eraseCounts;
+	Timing timing;
+	Stats stats;
+	bool verbose = false;
+	bool sfdpEnabled = true;
+	uint8_t sfdp[SFDP_SIZE];
+
+	// Instruction in progress
+	bool selected = false;
+	bool ignoring = false;
+	uint8_t cmd = 0;
+	size_t pos = 0;
+	size_t addrLen = 0;
+	size_t addr = 0;
+	uint8_t pageBuf[PAGE_SIZE];
+	bool pageWritten[PAGE_SIZE];
+	size_t pageOffset = 0;
+	uint8_t newStatus = 0;
+
+	// Chip state
+	uint8_t status = 0;
+	bool poweredDown = false;
+	uint64_t busyUntil = 0;
+	bool busyErase = false;
+	bool suspended = false;
+	uint64_t suspendedRemaining = 0;
+	size_t suspendedAddr = 0;
+	size_t suspendedLen = 0;
+	size_t busyAddr = 0;
+	size_t busyLen = 0;
+};
+
+#endif /* __SPIFLASHSIM_H */
@@ -1,43 +1,595 @@
 #include "Particle.h"
 
 #include "spiflash.h"
+#include "spiflashreadcache.h"
+#include "spiflashcrc.h"
+
+// SpiFlash objects indexed by DMA completion slot. The SPI DMA completion callback has no context
+// parameter, so each slot has its own trampoline function that dispatches to the object.
+static SpiFlash *_instances[SpiFlash::MAX_INSTANCES];
+
+// Indexed by SpiFlash::ReadMode
+typedef SpiFlash::Device Device;
+
+static const SpiFlash::ReadModeInfo _readModeInfo[] = {
+	{ Device::OPCODE_READ, 0, 1, 1, Device::READ_MAX_MHZ }, 				// READ_MODE_NORMAL
+	{ Device::OPCODE_FAST_READ, 8, 1, 1, Device::MAX_CLOCK_MHZ }, 			// READ_MODE_FAST
+	{ Device::OPCODE_DUAL_OUTPUT_READ, 8, 1, 2, Device::MAX_CLOCK_MHZ }, 	// READ_MODE_DUAL_OUTPUT
+	{ Device::OPCODE_QUAD_OUTPUT_READ, 8, 1, 4, Device::MAX_CLOCK_MHZ }, 	// READ_MODE_QUAD_OUTPUT
+	{ Device::OPCODE_DUAL_IO_READ, 4, 2, 2, Device::MAX_CLOCK_MHZ }, 		// READ_MODE_DUAL_IO
+	{ Device::OPCODE_QUAD_IO_READ, 6, 4, 4, Device::MAX_CLOCK_MHZ }			// READ_MODE_QUAD_IO
+};
+
+// Expected duration of an operation that sets WIP, and how often to poll once that has elapsed.
+// Typical times are from the device traits, and are copied to busyTypicalUs so SFDP can replace
+// them. Indexed by SpiFlash::BusyOp.
+typedef struct {
+	unsigned long typicalUs;
+	unsigned long pollUs;
+} BusyTiming;
+
+static const BusyTiming _busyTiming[] = {
+	{ 0, 1000 },									// BUSY_NONE (unknown operation, such as one started before a reset)
+	{ Device::PAGE_PROGRAM_US, 50 },				// BUSY_PAGE_PROGRAM (tPP)
+	{ Device::WRITE_STATUS_US, 500 },				// BUSY_WRITE_STATUS (tW)
+	{ Device::SECTOR_ERASE_US, 5000 },				// BUSY_SECTOR_ERASE (tSE)
+	{ Device::BLOCK32_ERASE_US, 10000 },			// BUSY_BLOCK32_ERASE (tBE 32K)
+	{ Device::BLOCK_ERASE_US, 20000 },				// BUSY_BLOCK_ERASE (tBE)
+	{ Device::CHIP_ERASE_US, 100000 }				// BUSY_CHIP_ERASE (tCE)
+};
+
+#if SPIFLASH_STATS
+#define STATS_START(var)				unsigned long var = micros()
+#define STATS_RECORD(op, bytes, start)	recordStats(op, bytes, micros() - (start))
+#define STATS_ADD_BYTES(op, n)			stats.ops[op].bytes += (n)
+#define STATS_INCREMENT(field)			stats.field++
+#else
+#define STATS_START(var)
+#define STATS_RECORD(op, bytes, start)
+#define STATS_ADD_BYTES(op, n)
+#define STATS_INCREMENT(field)
+#endif
+
+// Erase instructions from the device traits, indexed by SpiFlash::BusyOp
+static const uint8_t _eraseInst[] = {
+	0, 0, 0, Device::OPCODE_SECTOR_ERASE, Device::OPCODE_BLOCK32_ERASE, Device::OPCODE_BLOCK_ERASE, 0xC7
+};
+
+// SFDP (JESD216)
+static const uint32_t _sfdpSignature = 0x50444653;	// "SFDP", little endian
+static const uint8_t _sfdpBasicIdLsb = 0x00;		// JEDEC basic flash parameter table
+static const uint8_t _sfdpBasicIdMsb = 0xFF;
+static const size_t _sfdpMaxDwords = 16;			// JESD216B; later DWORDs aren't used
+
+// Deep power-down timing from the IS25LQ080 datasheet
+static const unsigned long _tDpMicros = 3;		// CS high after DP (0xB9) until the chip is powered down
+static const unsigned long _tRes1Micros = 5;	// CS high after RDP (0xAB) until the chip accepts commands
+
+/**
+ * Blocks for us microseconds. Uses delay() for longer periods so the cloud connection will be
+ * serviced in non-threaded mode.
+ */
+static void _sleepMicros(unsigned long us) {
+	if (us < 1000) {
+		delayMicroseconds(us);
+	}
+	else {
+		delay(us / 1000);
+	}
+}
 
-static SpiFlash *_spiFlash = NULL;
-static CompletionCallback _callback = NULL;
-static void *_callbackParam = NULL;
+SpiFlash::SpiFlash(SPIClass &spi, int cs) : spi(spi), cs(cs), pollTimer(1, &SpiFlash::pollTimerCallback, *this, true),
+	idleTimer(1000, &SpiFlash::idleTimerCallback, *this, false) {
+	static const wiring_spi_dma_transfercomplete_callback_t trampolines[MAX_INSTANCES] = {
+		_dmaTrampoline<0>, _dmaTrampoline<1>, _dmaTrampoline<2>, _dmaTrampoline<3>
+	};
 
-SpiFlash::SpiFlash(SPIClass &spi, int cs) : spi(spi), cs(cs) {
+#if SPIFLASH_STATS
+	resetStats();
+#endif
+
+	for(size_t ii = 0; ii < NUM_READ_MODES; ii++) {
+		chipReadModeInfo[ii] = _readModeInfo[ii];
+	}
+	for(size_t ii = 0; ii <= BUSY_CHIP_ERASE; ii++) {
+		busyTypicalUs[ii] = _busyTiming[ii].typicalUs;
+		eraseInst[ii] = _eraseInst[ii];
+	}
 
+	ATOMIC_BLOCK() {
+		for(size_t ii = 0; ii < MAX_INSTANCES; ii++) {
+			if (_instances[ii] == NULL) {
+				_instances[ii] = this;
+				dmaCompletion = trampolines[ii];
+				break;
+			}
+		}
+	}
 }
 
 SpiFlash::~SpiFlash() {
-
+	ATOMIC_BLOCK() {
+		for(size_t ii = 0; ii < MAX_INSTANCES; ii++) {
+			if (_instances[ii] == this) {
+				_instances[ii] = NULL;
+			}
+		}
+	}
 }
 
-void SpiFlash::begin() {
+void SpiFlash::begin(bool useSfdp) {
 	spi.begin(cs);
-	if (!sharedBus) {
-		setSpiSettings();
+	setSpiSettings();
+
+	if (useSfdp) {
+		SfdpInfo info;
+		if (readSfdp(info)) {
+			applySfdp(info);
+		}
 	}
 }
 
+void SpiFlash::setSharedBus(bool shared) {
+	sharedBus = shared;
+	setSpiSettings();
+}
+
 void SpiFlash::beginTransaction() {
 	if (sharedBus) {
-		setSpiSettings();
-		// TODO: Figure out what this delay should be
-		delay(1);
+		// Waits for other users of the bus. Device OS only reconfigures the peripheral if the
+		// settings differ from the ones the bus is already using.
+		spi.beginTransaction(spiSettings);
+	}
+
+	// Set before checking poweredDown so the idle timer won't power down in between
+	inTransaction = true;
+	if (poweredDown) {
+		releasePowerDown();
 	}
+
 	digitalWrite(cs, LOW);
 }
 
 void SpiFlash::endTransaction() {
 	digitalWrite(cs, HIGH);
+
+	inTransaction = false;
+	lastActivityMillis = millis();
+
+	if (sharedBus) {
+		if (HAL_IsISR()) {
+			// The bus lock can't be released from a DMA completion interrupt. Async transfers on a
+			// shared bus are always started from the poll timer, so release it from there.
+			busReleasePending = true;
+			pollTimer.changePeriodFromISR(1);
+		}
+		else {
+			spi.endTransaction();
+		}
+	}
 }
 
 void SpiFlash::setSpiSettings() {
-	spi.setBitOrder(MSBFIRST);
-	spi.setClockSpeed(30, MHZ);
-	spi.setDataMode(SPI_MODE0);
+	spiSettings = SPISettings(getClockSpeedMHz() * MHZ, MSBFIRST, SPI_MODE0);
+
+	if (!sharedBus) {
+		// Nothing else uses the bus, so this only needs to be done when the settings change
+		spi.setBitOrder(MSBFIRST);
+		spi.setClockSpeed(getClockSpeedMHz(), MHZ);
+		spi.setDataMode(SPI_MODE0);
+	}
+}
+
+void SpiFlash::setAutoPowerDown(unsigned long idleMs) {
+	autoPowerDownMs = idleMs;
+	lastActivityMillis = millis();
+
+	if (idleMs > 0) {
+		// The timer runs periodically, so the chip is powered down between idleMs and 2 * idleMs
+		// after the last access
+		idleTimer.changePeriod(idleMs);
+	}
+	else {
+		idleTimer.stop();
+	}
+}
+
+void SpiFlash::powerDown() {
+	waitForWriteComplete();
+
+	if (sharedBus) {
+		spi.beginTransaction(spiSettings);
+	}
+	ATOMIC_BLOCK() {
+		powerDownCommand();
+	}
+	if (sharedBus) {
+		spi.endTransaction();
+	}
+}
+
+void SpiFlash::wakeUp() {
+	if (sharedBus) {
+		spi.beginTransaction(spiSettings);
+	}
+	ATOMIC_BLOCK() {
+		if (poweredDown) {
+			releasePowerDown();
+		}
+	}
+	if (sharedBus) {
+		spi.endTransaction();
+	}
+}
+
+void SpiFlash::getPowerStats(PowerStats &stats) const {
+	unsigned long now = millis();
+
+	ATOMIC_BLOCK() {
+		stats = powerStats;
+		stats.totalMillis = now - powerStatsStartMillis;
+		if (poweredDown) {
+			stats.poweredDownMillis += now - powerDownStartMillis;
+		}
+	}
+}
+
+void SpiFlash::resetPowerStats() {
+	ATOMIC_BLOCK() {
+		memset(&powerStats, 0, sizeof(powerStats));
+		powerStatsStartMillis = millis();
+		if (poweredDown) {
+			powerDownStartMillis = powerStatsStartMillis;
+		}
+	}
+}
+
+void SpiFlash::idleTimerCallback() {
+	if (autoPowerDownMs == 0 || poweredDown || queueCount > 0 || millis() - lastActivityMillis < autoPowerDownMs) {
+		return;
+	}
+
+	if (sharedBus) {
+		spi.beginTransaction(spiSettings);
+	}
+
+	// With interrupts off nothing can start a transaction between the check and the command
+	ATOMIC_BLOCK() {
+		if (!inTransaction && queueCount == 0) {
+			powerDownCommand();
+		}
+	}
+
+	if (sharedBus) {
+		spi.endTransaction();
+	}
+}
+
+void SpiFlash::powerDownCommand() {
+	uint8_t txBuf[2];
+
+	if (poweredDown) {
+		return;
+	}
+
+	// The chip ignores DP while a program or erase is in progress
+	txBuf[0] = 0x05; // RDSR
+	txBuf[1] = 0;
+	digitalWrite(cs, LOW);
+	commandTransfer(txBuf, txBuf, sizeof(txBuf));
+	digitalWrite(cs, HIGH);
+	if ((txBuf[1] & STATUS_WIP) != 0) {
+		return;
+	}
+	busyOp = BUSY_NONE;
+	writeIdle = true;
+
+	txBuf[0] = 0xB9; // DP
+	digitalWrite(cs, LOW);
+	commandTransfer(txBuf, NULL, 1);
+	digitalWrite(cs, HIGH);
+
+	poweredDown = true;
+	powerDownStartMicros = micros();
+	powerDownStartMillis = millis();
+	powerStats.powerDownCount++;
+}
+
+void SpiFlash::releasePowerDown() {
+	unsigned long start = micros();
+
+	// CS must stay high for tDP after DP, even if the chip is released right away
+	unsigned long sinceDown = start - powerDownStartMicros;
+	if (sinceDown < _tDpMicros) {
+		delayMicroseconds(_tDpMicros - sinceDown);
+	}
+
+	uint8_t txBuf[1];
+	txBuf[0] = 0xAB; // RDP
+	digitalWrite(cs, LOW);
+	commandTransfer(txBuf, NULL, sizeof(txBuf));
+	digitalWrite(cs, HIGH);
+
+	delayMicroseconds(_tRes1Micros);
+	poweredDown = false;
+
+	unsigned long wakeMicros = micros() - start;
+	powerStats.wakeCount++;
+	powerStats.lastWakeMicros = wakeMicros;
+	powerStats.totalWakeMicros += wakeMicros;
+	if (wakeMicros > powerStats.maxWakeMicros) {
+		powerStats.maxWakeMicros = wakeMicros;
+	}
+	powerStats.poweredDownMillis += millis() - powerDownStartMillis;
+}
+
+unsigned SpiFlash::getClockSpeedMHz() const {
+	unsigned mhz = chipReadModeInfo[readMode].maxClockMHz;
+	if (mhz > maxClockMHz) {
+		mhz = maxClockMHz;
+	}
+	return mhz;
+}
+
+void SpiFlash::setMaxClockSpeed(unsigned mhz) {
+	maxClockMHz = mhz;
+	setSpiSettings();
+}
+
+// [static]
+const SpiFlash::ReadModeInfo &SpiFlash::getReadModeInfo(ReadMode mode) {
+	return _readModeInfo[mode];
+}
+
+bool SpiFlash::isReadModeSupported(ReadMode mode) const {
+	const ReadModeInfo &info = getReadModeInfo(mode);
+	return info.addrLines == 1 && info.dataLines == 1;
+}
+
+void SpiFlash::setReadMode(ReadMode mode) {
+	if (!isReadModeSupported(mode) || !isChipReadMode(mode)) {
+		// Fast read is supported on every host and chip and is still faster than READ because of the higher clock
+		mode = READ_MODE_FAST;
+	}
+
+	if (chipReadModeInfo[mode].dataLines == 4) {
+		uint8_t status = readStatus();
+		if ((status & STATUS_QE) == 0) {
+			writeStatus(status | STATUS_QE);
+			waitForWriteComplete();
+		}
+	}
+
+	readMode = mode;
+	setSpiSettings();
+}
+
+void SpiFlash::selectFastestReadMode() {
+	ReadMode best = READ_MODE_FAST;
+	unsigned bestRate = 0;
+
+	for(size_t ii = 0; ii < NUM_READ_MODES; ii++) {
+		ReadMode mode = (ReadMode) ii;
+		const ReadModeInfo &info = chipReadModeInfo[mode];
+		if (!isReadModeSupported(mode) || !isChipReadMode(mode)) {
+			continue;
+		}
+
+		unsigned mhz = (info.maxClockMHz < maxClockMHz) ? info.maxClockMHz : maxClockMHz;
+		unsigned rate = mhz * info.dataLines;
+
+		// On a tie, fewer dummy cycles is faster for short reads
+		if (rate > bestRate || (rate == bestRate && info.dummyCycles < chipReadModeInfo[best].dummyCycles)) {
+			best = mode;
+			bestRate = rate;
+		}
+	}
+	setReadMode(best);
+}
+
+bool SpiFlash::readSfdp(SfdpInfo &info) {
+	uint8_t header[16];
+	uint32_t dw[_sfdpMaxDwords];
+
+	memset(&info, 0, sizeof(info));
+
+	readSfdpData(0, header, 8);
+	uint32_t signature = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+	if (signature != _sfdpSignature) {
+		return false;
+	}
+	info.minorRev = header[4];
+	info.majorRev = header[5];
+
+	// Use the longest basic parameter table; newer revisions add DWORDs and keep the earlier ones
+	size_t numHeaders = (size_t)header[6] + 1;
+	size_t tableAddr = 0, tableDwords = 0;
+
+	for(size_t ii = 0; ii < numHeaders; ii++) {
+		readSfdpData(8 + ii * 8, header, 8);
+		if (header[0] == _sfdpBasicIdLsb && header[7] == _sfdpBasicIdMsb && header[3] > tableDwords) {
+			tableDwords = header[3];
+			tableAddr = header[4] | (header[5] << 8) | (header[6] << 16);
+		}
+	}
+	if (tableDwords < 9) {
+		// JESD216 requires at least 9
+		return false;
+	}
+	if (tableDwords > _sfdpMaxDwords) {
+		tableDwords = _sfdpMaxDwords;
+	}
+
+	uint8_t table[_sfdpMaxDwords * 4];
+	readSfdpData(tableAddr, table, tableDwords * 4);
+	memset(dw, 0, sizeof(dw));
+	for(size_t ii = 0; ii < tableDwords; ii++) {
+		dw[ii] = table[ii * 4] | (table[ii * 4 + 1] << 8) | (table[ii * 4 + 2] << 16) | ((uint32_t)table[ii * 4 + 3] << 24);
+	}
+
+	// DWORD 2: density in bits
+	if (dw[1] & 0x80000000) {
+		uint32_t exp = dw[1] & 0x7fffffff;
+		info.size = (exp >= 35) ? 0 : (size_t) (((uint64_t)1 << exp) / 8);
+	}
+	else {
+		info.size = (size_t) (((uint64_t)dw[1] + 1) / 8);
+	}
+
+	// READ and FAST_READ are always supported and their dummy cycles aren't in the table
+	for(size_t ii = 0; ii < NUM_READ_MODES; ii++) {
+		info.readModeInfo[ii] = _readModeInfo[ii];
+	}
+	info.readModes = (1 << READ_MODE_NORMAL) | (1 << READ_MODE_FAST);
+
+	// DWORD 1 says which of the others are, and DWORDs 3 and 4 give their instructions and wait
+	// states plus mode clocks, which are both dummy cycles as far as the driver is concerned
+	static const struct {
+		ReadMode mode;
+		uint32_t supportedBit;
+		uint8_t dword;
+		uint8_t shift;
+	} modes[] = {
+		{ READ_MODE_QUAD_IO, 1 << 21, 2, 0 },		// 1-4-4
+		{ READ_MODE_QUAD_OUTPUT, 1 << 22, 2, 16 },	// 1-1-4
+		{ READ_MODE_DUAL_OUTPUT, 1 << 16, 3, 0 },	// 1-1-2
+		{ READ_MODE_DUAL_IO, 1 << 20, 3, 16 }		// 1-2-2
+	};
+	for(size_t ii = 0; ii < sizeof(modes) / sizeof(modes[0]); ii++) {
+		if ((dw[0] & modes[ii].supportedBit) == 0) {
+			continue;
+		}
+		uint32_t bits = dw[modes[ii].dword] >> modes[ii].shift;
+		ReadModeInfo &modeInfo = info.readModeInfo[modes[ii].mode];
+
+		modeInfo.dummyCycles = (uint8_t) ((bits & 0x1f) + ((bits >> 5) & 0x07));
+		modeInfo.inst = (uint8_t) (bits >> 8);
+		info.readModes |= (uint8_t) (1 << modes[ii].mode);
+	}
+
+	// DWORDs 8 and 9: erase types as size exponent and instruction. DWORD 10 (JESD216A) has the
+	// typical time of each as a count and a unit.
+	static const unsigned long eraseUnitsUs[4] = { 1000, 16000, 128000, 1000000 };
+	for(size_t ii = 0; ii < 4; ii++) {
+		uint32_t bits = dw[7 + ii / 2] >> (16 * (ii % 2));
+		uint8_t sizeExp = (uint8_t) bits;
+		uint8_t inst = (uint8_t) (bits >> 8);
+		uint32_t us = 0;
+
+		if (tableDwords >= 10) {
+			uint32_t timeBits = dw[9] >> (4 + 7 * ii);
+			us = ((timeBits & 0x1f) + 1) * eraseUnitsUs[(timeBits >> 5) & 0x03];
+		}
+
+		if (sizeExp == 12) {
+			info.sectorEraseInst = inst;
+			info.sectorEraseUs = us;
+		}
+		else
+		if (sizeExp == 15) {
+			info.block32EraseInst = inst;
+			info.block32EraseUs = us;
+		}
+		else
+		if (sizeExp == 16) {
+			info.blockEraseInst = inst;
+			info.blockEraseUs = us;
+		}
+	}
+
+	// DWORD 1 also has the 4K erase instruction, for tables that don't list it as an erase type
+	if (info.sectorEraseInst == 0 && (dw[0] & 0x03) == 0x01) {
+		info.sectorEraseInst = (uint8_t) (dw[0] >> 8);
+	}
+
+	// DWORD 11 (JESD216A): page size and typical page program and chip erase times
+	if (tableDwords >= 11) {
+		static const unsigned long chipEraseUnitsMs[4] = { 16, 256, 4000, 64000 };
+
+		info.pageSize = (size_t)1 << ((dw[10] >> 4) & 0x0f);
+		info.pageProgramUs = (((dw[10] >> 8) & 0x1f) + 1) * (((dw[10] >> 13) & 0x01) ? 64 : 8);
+		info.chipEraseUs = (((dw[10] >> 24) & 0x1f) + 1) * chipEraseUnitsMs[(dw[10] >> 29) & 0x03] * 1000;
+	}
+
+	return true;
+}
+
+bool SpiFlash::applySfdp(const SfdpInfo &info) {
+	if (info.size != NUM_SECTORS * SECTOR_SIZE || info.sectorEraseInst == 0) {
+		return false;
+	}
+	if (info.pageSize != 0 && info.pageSize != PAGE_SIZE) {
+		return false;
+	}
+
+	chipReadModes = info.readModes;
+	for(size_t ii = 0; ii < NUM_READ_MODES; ii++) {
+		if (ADDRESS_BYTES == 3) {
+			chipReadModeInfo[ii].inst = info.readModeInfo[ii].inst;
+		}
+		chipReadModeInfo[ii].dummyCycles = info.readModeInfo[ii].dummyCycles;
+	}
+
+	if (ADDRESS_BYTES == 3) {
+		eraseInst[BUSY_SECTOR_ERASE] = info.sectorEraseInst;
+		eraseInst[BUSY_BLOCK32_ERASE] = info.block32EraseInst;
+		eraseInst[BUSY_BLOCK_ERASE] = info.blockEraseInst;
+	}
+	else {
+		// Keep the 4-byte instructions, but not for sizes the chip doesn't have
+		if (info.block32EraseInst == 0) {
+			eraseInst[BUSY_BLOCK32_ERASE] = 0;
+		}
+		if (info.blockEraseInst == 0) {
+			eraseInst[BUSY_BLOCK_ERASE] = 0;
+		}
+	}
+
+	if (info.pageProgramUs != 0) {
+		busyTypicalUs[BUSY_PAGE_PROGRAM] = info.pageProgramUs;
+	}
+	if (info.sectorEraseUs != 0) {
+		busyTypicalUs[BUSY_SECTOR_ERASE] = info.sectorEraseUs;
+	}
+	if (info.block32EraseUs != 0) {
+		busyTypicalUs[BUSY_BLOCK32_ERASE] = info.block32EraseUs;
+	}
+	if (info.blockEraseUs != 0) {
+		busyTypicalUs[BUSY_BLOCK_ERASE] = info.blockEraseUs;
+	}
+	if (info.chipEraseUs != 0) {
+		busyTypicalUs[BUSY_CHIP_ERASE] = info.chipEraseUs;
+	}
+
+	// Don't use a block erase that's slower than the smaller erases it replaces
+	if (busyTypicalUs[BUSY_BLOCK32_ERASE] > busyTypicalUs[BUSY_SECTOR_ERASE] * (BLOCK32_SIZE / SECTOR_SIZE)) {
+		eraseInst[BUSY_BLOCK32_ERASE] = 0;
+	}
+	unsigned long halfBlockUs = (eraseInst[BUSY_BLOCK32_ERASE] != 0) ?
+		busyTypicalUs[BUSY_BLOCK32_ERASE] * 2 : busyTypicalUs[BUSY_SECTOR_ERASE] * (BLOCK_SIZE / SECTOR_SIZE);
+	if (busyTypicalUs[BUSY_BLOCK_ERASE] > halfBlockUs) {
+		eraseInst[BUSY_BLOCK_ERASE] = 0;
+	}
+
+	selectFastestReadMode();
+	return true;
+}
+
+void SpiFlash::readSfdpData(size_t addr, void *buf, size_t bufLen) {
+	uint8_t txBuf[5];
+
+	txBuf[0] = 0x5A; // RDSFDP
+	txBuf[1] = (uint8_t) (addr >> 16);
+	txBuf[2] = (uint8_t) (addr >> 8);
+	txBuf[3] = (uint8_t) addr;
+	txBuf[4] = 0; // 8 dummy cycles
+
+	beginTransaction();
+	commandTransfer(txBuf, NULL, sizeof(txBuf));
+
+	// Always single-line, and only a few bytes at a time
+	commandTransfer(NULL, (uint8_t *)buf, bufLen);
+	endTransaction();
 }
 
 
@@ -48,7 +600,7 @@ bool SpiFlash::isValidChip() {
 
 	Serial.printlnf("manufacturerId=%02x deviceId1=%02x deviceId2=%02x", manufacturerId, deviceId1, deviceId2);
 
-	return manufacturerId == 0x9d && deviceId1 == 0x13 && deviceId2 == 0x44;
+	return manufacturerId == Device::JEDEC_MANUFACTURER && deviceId1 == Device::JEDEC_MEMORY_TYPE && deviceId2 == Device::JEDEC_CAPACITY;
 }
 
 
@@ -58,7 +610,7 @@ void SpiFlash::jedecIdRead(uint8_t &manufacturerId, uint8_t &deviceId1, uint8_t
 	txBuf[0] = 0x9f;
 
 	beginTransaction();
-	SPI.transfer(txBuf, rxBuf, sizeof(txBuf), NULL);
+	commandTransfer(txBuf, rxBuf, sizeof(txBuf));
 	endTransaction();
 
 	manufacturerId = rxBuf[1];
@@ -69,89 +621,631 @@ void SpiFlash::jedecIdRead(uint8_t &manufacturerId, uint8_t &deviceId1, uint8_t
 uint8_t SpiFlash::readStatus() {
 	uint8_t txBuf[2], rxBuf[2];
 	txBuf[0] = 0x05; // RDSR
+	txBuf[1] = 0;
 
 	beginTransaction();
-	SPI.transfer(txBuf, rxBuf, sizeof(txBuf), NULL);
+	commandTransfer(txBuf, rxBuf, sizeof(txBuf));
 	endTransaction();
 
 	return rxBuf[1];
 }
 
 bool SpiFlash::isWriteInProgress() {
+	STATS_INCREMENT(statusPolls);
 	return (readStatus() & STATUS_WIP) != 0;
 }
 
+bool SpiFlash::pollWriteComplete() {
+	if (writeIdle) {
+		return true;
+	}
+	if (isWriteInProgress()) {
+		return false;
+	}
+	busyDone();
+	return true;
+}
+
 void SpiFlash::waitForWriteComplete() {
-	while(isWriteInProgress()) {
-		delay(1);
+	const BusyTiming &timing = _busyTiming[busyOp];
+	unsigned long typicalUs = busyTypicalUs[busyOp];
+
+	if (writeIdle) {
+		// Nothing has been started since WIP was last seen clear
+		return;
+	}
+	STATS_START(start);
+
+	if (busyOp != BUSY_NONE) {
+		// Don't bother polling until the operation would typically be done
+		unsigned long elapsed = micros() - busyStartMicros;
+		if (elapsed < typicalUs) {
+			_sleepMicros(typicalUs - elapsed);
+		}
+	}
+
+	// Short operations are nearly done by now, so keep the status streaming instead of sleeping
+	// between polls. The next WREN can then follow as soon as WIP clears.
+	bool done = false;
+	if (busyOp == BUSY_PAGE_PROGRAM || busyOp == BUSY_WRITE_STATUS) {
+		done = waitForWipContinuous(typicalUs);
+	}
+	while(!done && isWriteInProgress()) {
+		_sleepMicros(timing.pollUs);
+	}
+	busyDone();
+
+	STATS_RECORD(STATS_WAIT, 0, start);
+}
+
+bool SpiFlash::waitForWriteCompleteAsync(CompletionCallback callback, void *param) {
+	return enqueue(OP_WAIT, 0, NULL, 0, callback, param);
+}
+
+void SpiFlash::whenReady(CompletionCallback callback, void *param) {
+	// On a shared bus, async operations only use the bus from the timer thread, so the bus lock
+	// is always acquired and released by the same thread. A dedicated bus can be checked from
+	// anywhere, so operations chain back-to-back from the DMA completion.
+	bool canCheck = !sharedBus || inPollTimer;
+
+	if (canCheck && busyOp == BUSY_NONE && (writeIdle || !isWriteInProgress())) {
+		writeIdle = true;
+		callback(param);
+		return;
+	}
+
+	readyCallback = callback;
+	readyParam = param;
+	schedulePoll(true);
+}
+
+void SpiFlash::setBusy(BusyOp op) {
+	busyOp = op;
+	busyStartMicros = micros();
+	writeIdle = false;
+}
+
+void SpiFlash::busyDone() {
+#if SPIFLASH_STATS
+	// Indexed by BusyOp
+	static const int8_t statsOps[] = {
+		-1, STATS_PAGE_PROGRAM, -1, STATS_SECTOR_ERASE, STATS_BLOCK32_ERASE, STATS_BLOCK_ERASE, STATS_CHIP_ERASE
+	};
+	if (statsOps[busyOp] >= 0) {
+		// Bytes were counted when the operation was started
+		STATS_RECORD((StatsOp)statsOps[busyOp], 0, busyStartMicros);
+	}
+#endif
+	busyOp = BUSY_NONE;
+	writeIdle = true;
+}
+
+bool SpiFlash::waitForWipContinuous(unsigned long maxUs) {
+	uint8_t txBuf[1];
+	bool done = false;
+
+	txBuf[0] = 0x05; // RDSR, repeated for as long as CS is low
+
+	beginTransaction();
+	commandTransfer(txBuf, NULL, sizeof(txBuf));
+
+	unsigned long start = micros();
+	do {
+		STATS_INCREMENT(statusPolls);
+		done = (spi.transfer(0) & STATUS_WIP) == 0;
+	} while(!done && micros() - start < maxUs);
+
+	endTransaction();
+
+	return done;
+}
+
+#if SPIFLASH_STATS
+void SpiFlash::getStats(Stats &result) const {
+	ATOMIC_BLOCK() {
+		result = stats;
+	}
+}
+
+void SpiFlash::resetStats() {
+	ATOMIC_BLOCK() {
+		memset(&stats, 0, sizeof(stats));
+		for(size_t ii = 0; ii < STATS_NUM_OPS; ii++) {
+			stats.ops[ii].minMicros = 0xffffffff;
+		}
+	}
+}
+
+void SpiFlash::recordStats(StatsOp op, size_t bytes, unsigned long micros) {
+	size_t bucket = 0;
+	while((micros >> (bucket + 1)) != 0 && bucket < STATS_NUM_BUCKETS - 1) {
+		bucket++;
+	}
+
+	// Can be called from the DMA completion interrupt
+	ATOMIC_BLOCK() {
+		OpStats &opStats = stats.ops[op];
+		opStats.count++;
+		opStats.bytes += bytes;
+		opStats.totalMicros += micros;
+		if (micros < opStats.minMicros) {
+			opStats.minMicros = micros;
+		}
+		if (micros > opStats.maxMicros) {
+			opStats.maxMicros = micros;
+		}
+		opStats.histogram[bucket]++;
+	}
+}
+#endif
+
+// [static]
+size_t SpiFlash::segmentsLength(const Segment *segs, size_t numSegs) {
+	size_t len = 0;
+	for(size_t ii = 0; ii < numSegs; ii++) {
+		len += segs[ii].len;
+	}
+	return len;
+}
+
+void SpiFlash::schedulePoll(bool first) {
+	const BusyTiming &timing = _busyTiming[busyOp];
+
+	unsigned long us = timing.pollUs;
+	if (first) {
+		unsigned long elapsed = micros() - busyStartMicros;
+		us = (elapsed < busyTypicalUs[busyOp]) ? (busyTypicalUs[busyOp] - elapsed) : 0;
+	}
+
+	// Software timers have millisecond resolution
+	unsigned ms = (unsigned) ((us + 999) / 1000);
+	if (ms == 0) {
+		ms = 1;
+	}
+
+	// Changing the period of a dormant timer also starts it
+	if (HAL_IsISR()) {
+		pollTimer.changePeriodFromISR(ms);
+	}
+	else {
+		pollTimer.changePeriod(ms);
+	}
+}
+
+void SpiFlash::pollTimerCallback() {
+	inPollTimer = true;
+
+	if (busReleasePending) {
+		// An async transfer ended in an interrupt
+		busReleasePending = false;
+		spi.endTransaction();
+	}
+
+	if (suspendRequested) {
+		suspendRequested = false;
+		if (suspendHeadErase()) {
+			inPollTimer = false;
+			return;
+		}
+	}
+
+	if (readyCallback == NULL) {
+		// Only woken up to release the bus
+	}
+	else
+	if (isWriteInProgress()) {
+		schedulePoll(false);
+	}
+	else {
+		busyDone();
+
+		CompletionCallback callback = readyCallback;
+		readyCallback = NULL;
+		callback(readyParam);
+	}
+
+	inPollTimer = false;
+}
+
+
+void SpiFlash::writeStatus(uint8_t status) {
+	waitForWriteComplete();
+
+	uint8_t txBuf[2];
+	txBuf[0] = 0x01; // WRSR
+	txBuf[1] = status;
+
+	writeEnable();
+
+	beginTransaction();
+	commandTransfer(txBuf, NULL, sizeof(txBuf));
+	endTransaction();
+
+	setBusy(BUSY_WRITE_STATUS);
+}
+
+void SpiFlash::setReadCache(SpiFlashReadCache *cache) {
+	readCache = cache;
+	if (readCache != NULL) {
+		readCache->invalidateAll();
+	}
+}
+
+void SpiFlash::readDataSync(size_t addr, void *buf, size_t bufLen) {
+	if (readCache != NULL && readCache->isCacheable(bufLen)) {
+		readDataCached(addr, buf, bufLen);
+	}
+	else {
+		readDataUncached(addr, buf, bufLen);
 	}
 }
 
+void SpiFlash::readDataCached(size_t addr, void *buf, size_t bufLen) {
+	uint8_t *curBuf = (uint8_t *)buf;
+
+	while(bufLen > 0) {
+		size_t pageOffset = addr % SpiFlash::PAGE_SIZE;
+		size_t pageStart = addr - pageOffset;
+
+		size_t count = SpiFlash::PAGE_SIZE - pageOffset;
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		uint8_t *lineData = readCache->find(pageStart);
+		if (lineData == NULL) {
+			lineData = readCache->allocate(pageStart);
+			readDataUncached(pageStart, lineData, SpiFlash::PAGE_SIZE);
+		}
+		memcpy(curBuf, &lineData[pageOffset], count);
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+	}
+}
+
+void SpiFlash::readDataUncached(size_t addr, void *buf, size_t bufLen) {
+	uint8_t *curBuf = (uint8_t *)buf;
+
+	if (bufLen == 0) {
+		return;
+	}
+
+	STATS_START(start);
+	STATS_ADD_BYTES(STATS_READ, bufLen);
+	readCommand(addr);
+
+	while(bufLen > 0) {
+		size_t count = bufLen;
+		if (count > MAX_DMA_TRANSFER) {
+			count = MAX_DMA_TRANSFER;
+		}
+		readTransfer(curBuf, count, NULL);
+
+		curBuf += count;
+		bufLen -= count;
+	}
+
+	endTransaction();
+	STATS_RECORD(STATS_READ, 0, start);
+}
+
+bool SpiFlash::readDataAsync(size_t addr, void *buf, size_t bufLen, CompletionCallback callback, void *param) {
+	return enqueue(OP_READ, addr, buf, bufLen, callback, param);
+}
+
+uint32_t SpiFlash::readDataSyncCrc(size_t addr, void *buf, size_t bufLen, uint32_t crc) {
+	if (bufLen == 0) {
+		return crc;
+	}
+
+	STATS_START(start);
+	readCommand(addr);
+	crc = readStreamCrc((uint8_t *)buf, bufLen, crc);
+	endTransaction();
+	STATS_RECORD(STATS_READ, bufLen, start);
+
+	return crc;
+}
+
+bool SpiFlash::readDataSyncCheckCrc(size_t addr, void *buf, size_t bufLen) {
+	uint8_t crcBuf[SpiFlashCrc32::CRC_SIZE];
+
+	STATS_START(start);
+	readCommand(addr);
+	uint32_t crc = readStreamCrc((uint8_t *)buf, bufLen, 0);
+	readTransfer(crcBuf, sizeof(crcBuf), NULL);
+	endTransaction();
+	STATS_RECORD(STATS_READ, bufLen + sizeof(crcBuf), start);
+
+	uint32_t stored = crcBuf[0] | (crcBuf[1] << 8) | (crcBuf[2] << 16) | ((uint32_t)crcBuf[3] << 24);
+	return crc == stored;
+}
+
+bool SpiFlash::readDataAsyncCrc(size_t addr, void *buf, size_t bufLen, uint32_t *crc, CompletionCallback callback, void *param) {
+	return enqueue(OP_READ, addr, buf, bufLen, callback, param, false, crc);
+}
+
+uint32_t SpiFlash::readStreamCrc(uint8_t *buf, size_t bufLen, uint32_t crc) {
+	uint8_t *prevBuf = NULL;
+	size_t prevLen = 0;
+
+	while(bufLen > 0 || prevLen > 0) {
+		size_t count = bufLen;
+		if (count > CRC_CHUNK_SIZE) {
+			count = CRC_CHUNK_SIZE;
+		}
+
+		if (count > 0) {
+			readChunkStart(buf, count);
+		}
+
+		// Overlaps with the transfer of the next chunk
+		if (prevLen > 0) {
+			crc = SpiFlashCrc32::update(crc, prevBuf, prevLen);
+		}
+
+		readChunkWait();
+
+		prevBuf = buf;
+		prevLen = count;
+		buf += count;
+		bufLen -= count;
+	}
+	return crc;
+}
+
+void SpiFlash::readChunkStart(uint8_t *buf, size_t bufLen) {
+	if (dmaCompletion != NULL) {
+		syncDmaBusy = true;
+		readTransfer(buf, bufLen, dmaCompletion);
+	}
+	else {
+		readTransfer(buf, bufLen, NULL);
+	}
+}
+
+void SpiFlash::readChunkWait() {
+	while(syncDmaBusy) {
+		SPIFLASH_BUSY_WAIT();
+	}
+}
+
+bool SpiFlash::isErased(size_t addr, size_t len) {
+	return compareStream(addr, NULL, len);
+}
+
+bool SpiFlash::verify(size_t addr, const void *buf, size_t bufLen) {
+	return compareStream(addr, (const uint8_t *)buf, bufLen);
+}
+
+bool SpiFlash::compareStream(size_t addr, const uint8_t *expected, size_t len) {
+	// Word aligned so erased chunks can be checked a word at a time
+	uint32_t scratch[2][COMPARE_CHUNK_SIZE / 4];
+	size_t cur = 0;
+	size_t prevLen = 0;
+	bool match = true;
+
+	if (len == 0) {
+		return true;
+	}
+
+	STATS_START(start);
+	STATS_ADD_BYTES(STATS_READ, len);
+	readCommand(addr);
+
+	while(len > 0 || prevLen > 0) {
+		size_t count = len;
+		if (count > COMPARE_CHUNK_SIZE) {
+			count = COMPARE_CHUNK_SIZE;
+		}
+
+		if (count > 0) {
+			readChunkStart((uint8_t *)scratch[cur], count);
+		}
+
+		// Check the previous chunk while this one transfers
+		if (prevLen > 0) {
+			const uint32_t *words = scratch[cur ^ 1];
+			if (expected != NULL) {
+				match = (memcmp(words, expected, prevLen) == 0);
+				expected += prevLen;
+			}
+			else {
+				size_t ii;
+				for(ii = 0; ii < prevLen / 4 && match; ii++) {
+					match = (words[ii] == 0xffffffff);
+				}
+				for(ii *= 4; ii < prevLen && match; ii++) {
+					match = (((const uint8_t *)words)[ii] == 0xff);
+				}
+			}
+		}
+
+		readChunkWait();
+
+		if (!match) {
+			// Stop at the first difference; CS high ends the read
+			break;
+		}
+
+		prevLen = count;
+		len -= count;
+		cur ^= 1;
+	}
+
+	endTransaction();
+	STATS_RECORD(STATS_READ, 0, start);
+
+	return match;
+}
+
+void SpiFlash::readvSync(size_t addr, const Segment *segs, size_t numSegs) {
+	bool started = false;
+	STATS_START(start);
+
+	for(size_t ii = 0; ii < numSegs; ii++) {
+		uint8_t *curBuf = (uint8_t *)segs[ii].buf;
+		size_t bufLen = segs[ii].len;
+
+		while(bufLen > 0) {
+			if (!started) {
+				readCommand(addr);
+				started = true;
+			}
+
+			size_t count = bufLen;
+			if (count > MAX_DMA_TRANSFER) {
+				count = MAX_DMA_TRANSFER;
+			}
+			readTransfer(curBuf, count, NULL);
+
+			curBuf += count;
+			bufLen -= count;
+		}
+	}
+
+	if (started) {
+		endTransaction();
+		STATS_RECORD(STATS_READ, segmentsLength(segs, numSegs), start);
+	}
+}
+
+bool SpiFlash::readvAsync(size_t addr, const Segment *segs, size_t numSegs, CompletionCallback callback, void *param) {
+	return enqueue(OP_READV, addr, const_cast<Segment *>(segs), numSegs, callback, param);
+}
+
+void SpiFlash::streamNextChunk() {
+	size_t count = streamRemaining;
+	size_t maxCount = (streamCrc != NULL) ? CRC_CHUNK_SIZE : MAX_DMA_TRANSFER;
+	if (count > maxCount) {
+		count = maxCount;
+	}
 
-void SpiFlash::writeStatus(uint8_t status) {
-	waitForWriteComplete();
+	uint8_t *chunkBuf = streamBuf;
+	streamBuf += count;
+	streamRemaining -= count;
 
-	uint8_t txBuf[2];
-	txBuf[0] = 0x01; // WRSR
-	txBuf[1] = status;
+	streamChunkBuf = chunkBuf;
+	streamChunkLen = count;
 
-	beginTransaction();
-	SPI.transfer(txBuf, NULL, sizeof(txBuf), NULL);
-	endTransaction();
+	if (streamWrite) {
+		spi.transfer(chunkBuf, NULL, count, dmaCompletion);
+	}
+	else {
+		readTransfer(chunkBuf, count, dmaCompletion);
+	}
 }
 
-void SpiFlash::readDataSync(size_t addr, void *buf, size_t bufLen) {
-	uint8_t *curBuf = (uint8_t *)buf;
-
-	while(bufLen > 0) {
-		size_t pageOffset = addr % SpiFlash::PAGE_SIZE;
-		size_t pageStart = addr - pageOffset;
+bool SpiFlash::streamNextSegment() {
+	while(streamSegsRemaining > 0) {
+		streamBuf = (uint8_t *)streamSegs->buf;
+		streamRemaining = streamSegs->len;
+		streamSegs++;
+		streamSegsRemaining--;
 
-		size_t count = (pageStart + SpiFlash::PAGE_SIZE) - addr;
-		if (count > bufLen) {
-			count = bufLen;
+		if (streamRemaining > 0) {
+			return true;
 		}
-		readPageSync(addr, curBuf, count);
+	}
+	return false;
+}
 
-		addr += count;
-		curBuf += count;
-		bufLen -= count;
+bool SpiFlash::streamSegments(const Segment *segs, size_t numSegs, bool write) {
+	streamSegs = segs;
+	streamSegsRemaining = numSegs;
+	streamWrite = write;
+	streamRemaining = 0;
+	streamCrc = NULL;
+
+	if (!streamNextSegment()) {
+		return false;
 	}
+	streamNextChunk();
+	return true;
 }
 
 void SpiFlash::readPageSync(size_t addr, void *buf, size_t bufLen) {
+	if (readCache != NULL) {
+		readDataCached(addr, buf, bufLen);
+		return;
+	}
+	STATS_START(start);
 	readPageCommon(addr, buf, bufLen, NULL);
 	endTransaction();
+	STATS_RECORD(STATS_READ, bufLen, start);
 }
 
-void SpiFlash::readPageAsync(size_t addr, void *buf, size_t bufLen, CompletionCallback callback, void *param) {
+bool SpiFlash::readPageAsync(size_t addr, void *buf, size_t bufLen, CompletionCallback callback, void *param) {
+	return enqueue(OP_READ, addr, buf, bufLen, callback, param);
+}
 
-	_spiFlash = this;
-	_callback = callback;
-	_callbackParam = param;
-	readPageCommon(addr, buf, bufLen, _completion);
+void SpiFlash::commandTransfer(const uint8_t *txBuf, uint8_t *rxBuf, size_t len) {
+	// Commands are only a few bytes, so this is faster than setting up a DMA transfer, and because it
+	// doesn't wait on a DMA interrupt it's safe to call from a DMA completion callback
+	for(size_t ii = 0; ii < len; ii++) {
+		uint8_t value = spi.transfer((txBuf != NULL) ? txBuf[ii] : 0);
+		if (rxBuf != NULL) {
+			rxBuf[ii] = value;
+		}
+	}
 }
 
 void SpiFlash::setInstWithAddr(uint8_t inst, size_t addr, uint8_t *buf) {
 	buf[0] = inst;
-	buf[1] = (uint8_t) (addr >> 16);
-	buf[2] = (uint8_t) (addr >> 8);
-	buf[3] = (uint8_t) addr;
+	for(size_t ii = 0; ii < ADDRESS_BYTES; ii++) {
+		buf[1 + ii] = (uint8_t) (addr >> (8 * (ADDRESS_BYTES - 1 - ii)));
+	}
 }
 
-void SpiFlash::readPageCommon(size_t addr, void *buf, size_t bufLen, wiring_spi_dma_transfercomplete_callback_t completion) {
-	uint8_t txBuf[4];
+void SpiFlash::readCommand(size_t addr) {
+	const ReadModeInfo &info = chipReadModeInfo[readMode];
+	uint8_t txBuf[INST_ADDR_SIZE + 1];
 
-	setInstWithAddr(0x03, addr, txBuf); // READ
+	setInstWithAddr(info.inst, addr, txBuf);
+
+	// Dummy cycles on a single line are clocked out as whole bytes (value is ignored by the chip)
+	size_t txLen = INST_ADDR_SIZE + info.dummyCycles / 8;
+	txBuf[INST_ADDR_SIZE] = 0;
 
 	beginTransaction();
-	SPI.transfer(txBuf, NULL, sizeof(txBuf), NULL);
-	SPI.transfer(NULL, buf, bufLen, completion);
+	commandTransfer(txBuf, NULL, txLen);
+}
+
+void SpiFlash::readTransfer(void *buf, size_t bufLen, wiring_spi_dma_transfercomplete_callback_t completion) {
+	spi.transfer(NULL, buf, bufLen, completion);
+}
+
+void SpiFlash::readPageCommon(size_t addr, void *buf, size_t bufLen, wiring_spi_dma_transfercomplete_callback_t completion) {
+	readCommand(addr);
+	readTransfer(buf, bufLen, completion);
+}
+
+void SpiFlash::setSmartWrite(bool enable, uint8_t *sectorBuf) {
+	smartWrite = enable;
+	smartSectorBuf = sectorBuf;
 }
 
 void SpiFlash::writeDataSync(size_t addr, const void *buf, size_t bufLen) {
 	uint8_t *curBuf = (uint8_t *)buf;
 
+	if (smartWrite) {
+		// Work a sector at a time since that's the erase unit
+		while(bufLen > 0) {
+			size_t count = SECTOR_SIZE - (addr % SECTOR_SIZE);
+			if (count > bufLen) {
+				count = bufLen;
+			}
+			writeSectorSmart(addr, curBuf, count);
+
+			addr += count;
+			curBuf += count;
+			bufLen -= count;
+		}
+		return;
+	}
+
 	while(bufLen > 0) {
 		size_t pageOffset = addr % SpiFlash::PAGE_SIZE;
 		size_t pageStart = addr - pageOffset;
@@ -160,6 +1254,7 @@ void SpiFlash::writeDataSync(size_t addr, const void *buf, size_t bufLen) {
 		if (count > bufLen) {
 			count = bufLen;
 		}
+		// Each page ends with WIP seen clear, so the next one starts with its WREN right away
 		writePageSync(addr, curBuf, count);
 
 		addr += count;
@@ -169,85 +1264,359 @@ void SpiFlash::writeDataSync(size_t addr, const void *buf, size_t bufLen) {
 
 }
 
+void SpiFlash::writeSectorSmart(size_t addr, const uint8_t *buf, size_t bufLen) {
+	if (smartSectorBuf == NULL) {
+		while(bufLen > 0) {
+			size_t count = PAGE_SIZE - (addr % PAGE_SIZE);
+			if (count > bufLen) {
+				count = bufLen;
+			}
+			writePageSmart(addr, buf, count);
+
+			addr += count;
+			buf += count;
+			bufLen -= count;
+		}
+		return;
+	}
+
+	size_t sectorStart = addr - (addr % SECTOR_SIZE);
+	size_t offset = addr - sectorStart;
+
+	waitForWriteComplete();
+	readDataUncached(sectorStart, smartSectorBuf, SECTOR_SIZE);
+
+	bool same = true;
+	bool needErase = false;
+	for(size_t ii = 0; ii < bufLen; ii++) {
+		uint8_t oldValue = smartSectorBuf[offset + ii];
+		if (oldValue != buf[ii]) {
+			same = false;
+			if ((oldValue & buf[ii]) != buf[ii]) {
+				// Programming can only change 1 bits to 0
+				needErase = true;
+				break;
+			}
+		}
+	}
+	if (same) {
+		return;
+	}
+
+	if (!needErase) {
+		// Only program the pages that change
+		size_t end = offset + bufLen;
+		while(offset < end) {
+			size_t count = PAGE_SIZE - (offset % PAGE_SIZE);
+			if (count > end - offset) {
+				count = end - offset;
+			}
+			if (memcmp(&smartSectorBuf[offset], buf, count) != 0) {
+				writePageSync(sectorStart + offset, buf, count);
+			}
+			offset += count;
+			buf += count;
+		}
+		return;
+	}
+
+	memcpy(&smartSectorBuf[offset], buf, bufLen);
+	sectorErase(sectorStart);
+
+	// Reprogram the merged sector, skipping pages that are still blank
+	for(size_t pageOffset = 0; pageOffset < SECTOR_SIZE; pageOffset += PAGE_SIZE) {
+		const uint8_t *page = &smartSectorBuf[pageOffset];
+		for(size_t ii = 0; ii < PAGE_SIZE; ii++) {
+			if (page[ii] != 0xff) {
+				writePageSync(sectorStart + pageOffset, page, PAGE_SIZE);
+				break;
+			}
+		}
+	}
+}
+
+void SpiFlash::writePageSmart(size_t addr, const uint8_t *buf, size_t bufLen) {
+	uint8_t oldData[PAGE_SIZE];
+
+	waitForWriteComplete();
+	readDataUncached(addr, oldData, bufLen);
+
+	if (memcmp(oldData, buf, bufLen) != 0) {
+		writePageSync(addr, buf, bufLen);
+	}
+}
+
 void SpiFlash::writePageSync(size_t addr, const void *buf, size_t bufLen) {
+	writePageStart(addr, buf, bufLen);
+	waitForWriteComplete();
+}
+
+void SpiFlash::writePageStart(size_t addr, const void *buf, size_t bufLen) {
 	waitForWriteComplete();
 
 	writePageCommon(addr, buf, bufLen, NULL);
 	endTransaction();
+}
 
-	waitForWriteComplete();
+bool SpiFlash::writePageAsync(size_t addr, const void *buf, size_t bufLen, CompletionCallback callback, void *param) {
+	return enqueue(OP_PROGRAM, addr, const_cast<void *>(buf), bufLen, callback, param);
 }
 
-void SpiFlash::writePageAsync(size_t addr, const void *buf, size_t bufLen, CompletionCallback callback, void *param) {
-	// There is no good way to asynchronously wait for pending writes to complete because it requires polling
-	// the status register - there's no interrupt pin for it.
+void SpiFlash::writevPageSync(size_t addr, const Segment *segs, size_t numSegs) {
+	waitForWriteComplete();
+
+	writePageCommand(addr);
+	for(size_t ii = 0; ii < numSegs; ii++) {
+		if (segs[ii].len > 0) {
+			spi.transfer(segs[ii].buf, NULL, segs[ii].len, NULL);
+		}
+	}
+	endTransaction();
+	setBusy(BUSY_PAGE_PROGRAM);
+	STATS_ADD_BYTES(STATS_PAGE_PROGRAM, segmentsLength(segs, numSegs));
+
 	waitForWriteComplete();
+}
 
-	_spiFlash = this;
-	_callback = callback;
-	_callbackParam = param;
-	writePageCommon(addr, buf, bufLen, _completion);
+bool SpiFlash::writevPageAsync(size_t addr, const Segment *segs, size_t numSegs, CompletionCallback callback, void *param) {
+	return enqueue(OP_PROGRAMV, addr, const_cast<Segment *>(segs), numSegs, callback, param);
 }
 
-void SpiFlash::writePageCommon(size_t addr, const void *buf, size_t bufLen, wiring_spi_dma_transfercomplete_callback_t completion) {
-	uint8_t txBuf[4];
+void SpiFlash::writePageCommand(size_t addr) {
+	uint8_t txBuf[INST_ADDR_SIZE];
 
-	setInstWithAddr(0x02, addr, txBuf); // PAGE_PROG
+	setInstWithAddr(Device::OPCODE_PAGE_PROGRAM, addr, txBuf); // PAGE_PROG
+
+	if (readCache != NULL) {
+		// Programs wrap around within the page
+		readCache->invalidate(addr - (addr % SpiFlash::PAGE_SIZE), SpiFlash::PAGE_SIZE);
+	}
 
 	writeEnable();
 
 	beginTransaction();
-	SPI.transfer(txBuf, NULL, sizeof(txBuf), NULL);
-	SPI.transfer(const_cast<void *>(buf), NULL, bufLen, completion);
+	commandTransfer(txBuf, NULL, sizeof(txBuf));
+}
+
+void SpiFlash::writePageCommon(size_t addr, const void *buf, size_t bufLen, wiring_spi_dma_transfercomplete_callback_t completion) {
+	writePageCommand(addr);
+
+	// Busy before the transfer starts, since an async completion can run before this returns
+	setBusy(BUSY_PAGE_PROGRAM);
+	STATS_ADD_BYTES(STATS_PAGE_PROGRAM, bufLen);
+
+	spi.transfer(const_cast<void *>(buf), NULL, bufLen, completion);
+	if (completion == NULL) {
+		// The program starts when the caller sets CS high, just after this
+		busyStartMicros = micros();
+	}
 }
 
 void SpiFlash::sectorErase(size_t addr) {
 	waitForWriteComplete();
+	eraseCommand(BUSY_SECTOR_ERASE, addr);
+	waitForWriteComplete();
+}
 
-	uint8_t txBuf[4];
-
-	setInstWithAddr(0xD7, addr, txBuf); // SECTOR_ER
+bool SpiFlash::sectorEraseAsync(size_t addr, CompletionCallback callback, void *param) {
+	return enqueue(OP_SECTOR_ERASE, addr, NULL, 0, callback, param);
+}
 
-	writeEnable();
+void SpiFlash::blockErase(size_t addr) {
+	waitForWriteComplete();
+	eraseCommand(BUSY_BLOCK_ERASE, addr);
+	waitForWriteComplete();
+}
 
-	beginTransaction();
-	SPI.transfer(txBuf, NULL, sizeof(txBuf), NULL);
-	endTransaction();
+bool SpiFlash::blockEraseAsync(size_t addr, CompletionCallback callback, void *param) {
+	return enqueue(OP_BLOCK_ERASE, addr, NULL, 0, callback, param);
+}
 
+void SpiFlash::block32Erase(size_t addr) {
+	waitForWriteComplete();
+	eraseCommand(BUSY_BLOCK32_ERASE, addr);
 	waitForWriteComplete();
 }
 
-void SpiFlash::blockErase(size_t addr) {
+bool SpiFlash::block32EraseAsync(size_t addr, CompletionCallback callback, void *param) {
+	return enqueue(OP_BLOCK32_ERASE, addr, NULL, 0, callback, param);
+}
+
+void SpiFlash::chipErase() {
+	waitForWriteComplete();
+	eraseCommand(BUSY_CHIP_ERASE, 0);
 	waitForWriteComplete();
+}
+
+bool SpiFlash::chipEraseAsync(CompletionCallback callback, void *param) {
+	return enqueue(OP_CHIP_ERASE, 0, NULL, 0, callback, param);
+}
+
+void SpiFlash::eraseCommand(BusyOp op, size_t addr) {
+	uint8_t txBuf[INST_ADDR_SIZE];
+	size_t txLen = sizeof(txBuf);
+
+	switch(op) {
+	case BUSY_SECTOR_ERASE:
+		setInstWithAddr(eraseInst[BUSY_SECTOR_ERASE], addr, txBuf); // SECTOR_ER
+		STATS_ADD_BYTES(STATS_SECTOR_ERASE, SpiFlash::SECTOR_SIZE);
+		if (readCache != NULL) {
+			readCache->invalidate(addr - (addr % SpiFlash::SECTOR_SIZE), SpiFlash::SECTOR_SIZE);
+		}
+		break;
 
-	uint8_t txBuf[4];
+	case BUSY_BLOCK32_ERASE:
+		setInstWithAddr(eraseInst[BUSY_BLOCK32_ERASE], addr, txBuf); // BLOCK_ER32
+		STATS_ADD_BYTES(STATS_BLOCK32_ERASE, SpiFlash::BLOCK32_SIZE);
+		if (readCache != NULL) {
+			readCache->invalidate(addr - (addr % SpiFlash::BLOCK32_SIZE), SpiFlash::BLOCK32_SIZE);
+		}
+		break;
 
-	setInstWithAddr(0xD8, addr, txBuf); // BLOCK_ER
+	case BUSY_BLOCK_ERASE:
+		setInstWithAddr(eraseInst[BUSY_BLOCK_ERASE], addr, txBuf); // BLOCK_ER
+		STATS_ADD_BYTES(STATS_BLOCK_ERASE, SpiFlash::BLOCK_SIZE);
+		if (readCache != NULL) {
+			readCache->invalidate(addr - (addr % SpiFlash::BLOCK_SIZE), SpiFlash::BLOCK_SIZE);
+		}
+		break;
+
+	default:
+		txBuf[0] = 0xC7; // CHIP_ER
+		txLen = 1;
+		STATS_ADD_BYTES(STATS_CHIP_ERASE, SpiFlash::NUM_SECTORS * SpiFlash::SECTOR_SIZE);
+		if (readCache != NULL) {
+			readCache->invalidateAll();
+		}
+		break;
+	}
 
 	writeEnable();
 
 	beginTransaction();
-	SPI.transfer(txBuf, NULL, sizeof(txBuf), NULL);
+	commandTransfer(txBuf, NULL, txLen);
 	endTransaction();
 
-	waitForWriteComplete();
+	setBusy(op);
+}
 
+SpiFlash::BusyOp SpiFlash::planErase(size_t addr, size_t end, size_t &size) const {
+	if (eraseInst[BUSY_BLOCK_ERASE] != 0 && (addr % BLOCK_SIZE) == 0 && addr + BLOCK_SIZE <= end) {
+		size = BLOCK_SIZE;
+		return BUSY_BLOCK_ERASE;
+	}
+	if (eraseInst[BUSY_BLOCK32_ERASE] != 0 && (addr % BLOCK32_SIZE) == 0 && addr + BLOCK32_SIZE <= end) {
+		size = BLOCK32_SIZE;
+		return BUSY_BLOCK32_ERASE;
+	}
+	size = SECTOR_SIZE;
+	return BUSY_SECTOR_ERASE;
 }
 
-void SpiFlash::chipErase() {
+void SpiFlash::eraseRange(size_t addr, size_t len) {
+	size_t end = addr + len;
+
+	if (len == 0) {
+		return;
+	}
+
+	addr -= addr % SECTOR_SIZE;
+	while(addr < end) {
+		size_t size;
+		BusyOp op = planErase(addr, end, size);
+
+		waitForWriteComplete();
+		eraseCommand(op, addr);
+
+		addr += size;
+	}
 	waitForWriteComplete();
+}
 
-	uint8_t txBuf[1];
+bool SpiFlash::eraseRangeAsync(size_t addr, size_t len, CompletionCallback callback, void *param) {
+	return startRangeJob(addr, len, NULL, 0, callback, param);
+}
 
-	txBuf[0] = 0xC7; // CHIP_ER
+void SpiFlash::eraseAndWrite(size_t addr, const void *buf, size_t bufLen) {
+	eraseRange(addr, bufLen);
+	writeDataSync(addr, buf, bufLen);
+}
 
-	writeEnable();
+bool SpiFlash::eraseAndWriteAsync(size_t addr, const void *buf, size_t bufLen, CompletionCallback callback, void *param) {
+	return startRangeJob(addr, bufLen, buf, bufLen, callback, param);
+}
 
-	beginTransaction();
-	SPI.transfer(txBuf, NULL, sizeof(txBuf), NULL);
-	endTransaction();
+bool SpiFlash::startRangeJob(size_t addr, size_t eraseLen, const void *buf, size_t bufLen, CompletionCallback callback, void *param) {
+	if (rangeJobActive || dmaCompletion == NULL) {
+		return false;
+	}
+	rangeJobActive = true;
+
+	// The end is rounded up by planErase() always erasing a whole sector
+	rangeEraseAddr = addr - (addr % SECTOR_SIZE);
+	rangeEraseEnd = (eraseLen > 0) ? (addr + eraseLen) : rangeEraseAddr;
+	rangeWriteAddr = addr;
+	rangeWriteBuf = (const uint8_t *)buf;
+	rangeWriteRemaining = bufLen;
+	rangeCallback = callback;
+	rangeParam = param;
+
+	rangeJobStep();
+	return true;
+}
 
-	waitForWriteComplete();
+void SpiFlash::rangeJobStep() {
+	if (rangeEraseAddr < rangeEraseEnd) {
+		size_t size;
+		BusyOp op = planErase(rangeEraseAddr, rangeEraseEnd, size);
+
+		QueueOpType type = OP_SECTOR_ERASE;
+		if (op == BUSY_BLOCK_ERASE) {
+			type = OP_BLOCK_ERASE;
+		}
+		else if (op == BUSY_BLOCK32_ERASE) {
+			type = OP_BLOCK32_ERASE;
+		}
+
+		if (enqueue(type, rangeEraseAddr, NULL, 0, _rangeJobStep, this)) {
+			rangeEraseAddr += size;
+		}
+		else {
+			rangeJobRetry = true;
+		}
+		return;
+	}
+
+	if (rangeWriteRemaining > 0) {
+		size_t count = PAGE_SIZE - (rangeWriteAddr % PAGE_SIZE);
+		if (count > rangeWriteRemaining) {
+			count = rangeWriteRemaining;
+		}
+
+		if (enqueue(OP_PROGRAM, rangeWriteAddr, const_cast<uint8_t *>(rangeWriteBuf), count, _rangeJobStep, this)) {
+			rangeWriteAddr += count;
+			rangeWriteBuf += count;
+			rangeWriteRemaining -= count;
+		}
+		else {
+			rangeJobRetry = true;
+		}
+		return;
+	}
+
+	rangeJobActive = false;
+	if (rangeCallback != NULL) {
+		rangeCallback(rangeParam);
+	}
+}
+
+// [static]
+void SpiFlash::_rangeJobStep(void *param) {
+	((SpiFlash *)param)->rangeJobStep();
+}
+
+size_t SpiFlash::getRangeEraseQueued() const {
+	return rangeEraseAddr;
 }
 
 
@@ -256,26 +1625,377 @@ void SpiFlash::writeEnable() {
 
 	beginTransaction();
 	txBuf[0] = 0x06; // WREN
-	SPI.transfer(txBuf, NULL, sizeof(txBuf), NULL);
+	commandTransfer(txBuf, NULL, sizeof(txBuf));
 	endTransaction();
+	STATS_INCREMENT(writeEnables);
 
 	// Write enable is always followed by a write, but CE must go high for a tres for it
 	// to take effect. tres = 3 us
 	delayMicroseconds(3);
 }
 
+size_t SpiFlash::getQueueCount() const {
+	return queueCount;
+}
+
+bool SpiFlash::isAsyncAvailable() const {
+	return dmaCompletion != NULL;
+}
+
+bool SpiFlash::readDataPriorityAsync(size_t addr, void *buf, size_t bufLen, CompletionCallback callback, void *param) {
+	return enqueue(OP_READ, addr, buf, bufLen, callback, param, true);
+}
+
+bool SpiFlash::enqueue(QueueOpType type, size_t addr, void *buf, size_t bufLen, CompletionCallback callback, void *param, bool priority, uint32_t *crc) {
+	bool queued = false;
+	bool start = false;
+	bool suspend = false;
+
+	if (dmaCompletion == NULL) {
+		// More than MAX_INSTANCES objects were created, so this one can't do DMA completions
+		return false;
+	}
+
+	ATOMIC_BLOCK() {
+		if (queueCount < QUEUE_SIZE) {
+			// Priority operations go after the one in progress and the priority operations already
+			// queued, so they run in the order they were queued
+			size_t pos = queueCount;
+			if (priority && pos > 1) {
+				pos = 1;
+				while(pos < queueCount && queue[(queueHead + pos) % QUEUE_SIZE].priority) {
+					pos++;
+				}
+				for(size_t ii = queueCount; ii > pos; ii--) {
+					queue[(queueHead + ii) % QUEUE_SIZE] = queue[(queueHead + ii - 1) % QUEUE_SIZE];
+				}
+			}
+
+			QueueOp &op = queue[(queueHead + pos) % QUEUE_SIZE];
+			op.type = type;
+			op.suspended = false;
+			op.addr = addr;
+			op.buf = (uint8_t *)buf;
+			op.bufLen = bufLen;
+			op.callback = callback;
+			op.param = param;
+			op.crc = crc;
+			op.priority = priority;
+			queueCount++;
+			queued = true;
+
+			if (!queueRunning) {
+				queueRunning = true;
+				start = true;
+			}
+			else if (priority && isSuspendable(queue[queueHead].type) && !queue[queueHead].suspended) {
+				suspend = true;
+			}
+		}
+	}
+
+	if (start) {
+		// Reads, programs, and erases all need the previous write or erase to be done
+		whenReady(_startQueueHead, this);
+	}
+	if (suspend) {
+		// The erase in progress is suspended from the poll timer, which is the only thing that touches
+		// the bus while an erase is running. Make it fire right away instead of at the next sparse poll.
+		suspendRequested = true;
+		if (HAL_IsISR()) {
+			pollTimer.changePeriodFromISR(1);
+		}
+		else {
+			pollTimer.changePeriod(1);
+		}
+	}
+	return queued;
+}
 
 // [static]
-void SpiFlash::_completion() {
-	_spiFlash->endTransaction();
-	_spiFlash = NULL;
+bool SpiFlash::isSuspendable(QueueOpType type) {
+	// Chip erase cannot be suspended
+	return type == OP_SECTOR_ERASE || type == OP_BLOCK32_ERASE || type == OP_BLOCK_ERASE;
+}
+
+bool SpiFlash::suspendHeadErase() {
+	QueueOp &head = queue[queueHead];
+
+	if (queueCount < 2 || !isSuspendable(head.type) || head.suspended || busyOp == BUSY_NONE) {
+		// The erase isn't running any more (or hasn't started)
+		return false;
+	}
+	if (!isWriteInProgress()) {
+		// The erase has finished but hasn't been polled yet. Suspending would leave the chip idle
+		// and the later PERRSM with nothing to resume, so let the caller complete it normally.
+		return false;
+	}
+
+	uint8_t txBuf[1];
+	txBuf[0] = 0x75; // PERSUS
+
+	beginTransaction();
+	commandTransfer(txBuf, NULL, sizeof(txBuf));
+	endTransaction();
+
+	// WIP clears once the erase is suspended, within tSUS (100 us max)
+	for(int tries = 0; tries < 100 && isWriteInProgress(); tries++) {
+		delayMicroseconds(10);
+	}
+
+	// Move the erase after the priority operations queued right after it, so they all run, in order,
+	// before it's resumed
+	suspendedBusyOp = busyOp;
+	suspendedStartMicros = busyStartMicros;
+	busyOp = BUSY_NONE;
+	readyCallback = NULL;
+
+	QueueOp erase = head;
+	erase.suspended = true;
+	ATOMIC_BLOCK() {
+		size_t last = 1;
+		while(last + 1 < queueCount && queue[(queueHead + last + 1) % QUEUE_SIZE].priority) {
+			last++;
+		}
+		for(size_t ii = 0; ii < last; ii++) {
+			queue[(queueHead + ii) % QUEUE_SIZE] = queue[(queueHead + ii + 1) % QUEUE_SIZE];
+		}
+		queue[(queueHead + last) % QUEUE_SIZE] = erase;
+	}
+
+	startQueueHead();
+	return true;
+}
+
+void SpiFlash::resumeHeadErase() {
+	uint8_t txBuf[1];
+	txBuf[0] = 0x7A; // PERRSM
+
+	beginTransaction();
+	commandTransfer(txBuf, NULL, sizeof(txBuf));
+	endTransaction();
+
+	queue[queueHead].suspended = false;
+	busyOp = suspendedBusyOp;
+	busyStartMicros = suspendedStartMicros;
+	writeIdle = false;
+	_queueHeadSent(this);
+}
+
+void SpiFlash::startQueueHead() {
+	// Only completeQueueHead() removes entries and suspendHeadErase() only swaps the head while
+	// it's being polled, so the head is stable until then
+	QueueOp &op = queue[queueHead];
+
+	if (op.suspended) {
+		resumeHeadErase();
+		return;
+	}
+
+#if SPIFLASH_STATS
+	opStartMicros = micros();
+#endif
+
+	switch(op.type) {
+	case OP_READ:
+		if (op.bufLen == 0) {
+			if (op.crc != NULL) {
+				*op.crc = 0;
+			}
+			completeQueueHead();
+			break;
+		}
+		dmaCallback = _queueHeadDone;
+
+		streamBuf = op.buf;
+		streamRemaining = op.bufLen;
+		streamSegsRemaining = 0;
+		streamWrite = false;
+		streamCrc = op.crc;
+		streamCrcValue = 0;
+
+		readCommand(op.addr);
+		streamNextChunk();
+		break;
+
+	case OP_READV:
+		dmaCallback = _queueHeadDone;
+
+		readCommand(op.addr);
+		if (!streamSegments((const Segment *)op.buf, op.bufLen, false)) {
+			dmaCallback = NULL;
+			endTransaction();
+			completeQueueHead();
+		}
+		break;
+
+	case OP_PROGRAM:
+		dmaCallback = _programSent;
+		writePageCommon(op.addr, op.buf, op.bufLen, dmaCompletion);
+		break;
+
+	case OP_PROGRAMV:
+		if (segmentsLength((const Segment *)op.buf, op.bufLen) == 0) {
+			// Nothing to program
+			completeQueueHead();
+			break;
+		}
+		dmaCallback = _programSent;
+
+		writePageCommand(op.addr);
+
+		// Busy before the transfer starts, since its completion can run first
+		setBusy(BUSY_PAGE_PROGRAM);
+		STATS_ADD_BYTES(STATS_PAGE_PROGRAM, segmentsLength((const Segment *)op.buf, op.bufLen));
+
+		streamSegments((const Segment *)op.buf, op.bufLen, true);
+		break;
+
+	case OP_SECTOR_ERASE:
+		eraseCommand(BUSY_SECTOR_ERASE, op.addr);
+		_queueHeadSent(this);
+		break;
+
+	case OP_BLOCK32_ERASE:
+		eraseCommand(BUSY_BLOCK32_ERASE, op.addr);
+		_queueHeadSent(this);
+		break;
+
+	case OP_BLOCK_ERASE:
+		eraseCommand(BUSY_BLOCK_ERASE, op.addr);
+		_queueHeadSent(this);
+		break;
+
+	case OP_CHIP_ERASE:
+		eraseCommand(BUSY_CHIP_ERASE, op.addr);
+		_queueHeadSent(this);
+		break;
+
+	case OP_WAIT:
+		// Only started once the chip is ready, so there's nothing to do
+		completeQueueHead();
+		break;
+	}
+}
+
+void SpiFlash::completeQueueHead() {
+	QueueOp op = queue[queueHead];
+	bool more = false;
+
+#if SPIFLASH_STATS
+	if (op.type == OP_READ) {
+		STATS_RECORD(STATS_READ, op.bufLen, opStartMicros);
+	}
+	else
+	if (op.type == OP_READV) {
+		STATS_RECORD(STATS_READ, segmentsLength((const Segment *)op.buf, op.bufLen), opStartMicros);
+	}
+#endif
+
+	ATOMIC_BLOCK() {
+		queueHead = (queueHead + 1) % QUEUE_SIZE;
+		queueCount--;
+		if (queueCount > 0) {
+			more = true;
+		}
+		else {
+			queueRunning = false;
+		}
+	}
+
+	// Start the next operation before calling the callback so the bus doesn't sit idle while
+	// the application handles the result
+	if (more) {
+		whenReady(_startQueueHead, this);
+	}
+
+	if (op.callback != NULL) {
+		op.callback(op.param);
+	}
 
-	if (_callback != NULL) {
-		_callback(_callbackParam);
-		_callback = NULL;
-		_callbackParam = NULL;
+	if (rangeJobRetry) {
+		// The range job couldn't queue its next operation because the queue was full
+		rangeJobRetry = false;
+		rangeJobStep();
 	}
 }
 
+// [static]
+void SpiFlash::_startQueueHead(void *param) {
+	((SpiFlash *)param)->startQueueHead();
+}
+
+// [static]
+void SpiFlash::_queueHeadSent(void *param) {
+	SpiFlash *flash = (SpiFlash *)param;
+
+	// The program or erase has just started; WIP won't clear for a while, so poll from the timer.
+	// For a program this is called from the DMA completion interrupt.
+	flash->readyCallback = _queueHeadDone;
+	flash->readyParam = flash;
+	flash->schedulePoll(true);
+}
+
+// [static]
+void SpiFlash::_programSent(void *param) {
+	SpiFlash *flash = (SpiFlash *)param;
+
+	flash->busyStartMicros = micros();
+	_queueHeadSent(flash);
+}
+
+// [static]
+void SpiFlash::_queueHeadDone(void *param) {
+	((SpiFlash *)param)->completeQueueHead();
+}
+
+void SpiFlash::dmaComplete() {
+	if (syncDmaBusy) {
+		// Chunk of readDataSyncCrc(); the caller handles the rest
+		syncDmaBusy = false;
+		return;
+	}
+
+	uint8_t *doneBuf = streamChunkBuf;
+	size_t doneLen = streamChunkLen;
+	streamChunkLen = 0;
 
+	bool more = (streamRemaining > 0 || streamNextSegment());
+	if (more) {
+		// More data; CS is still low and the chip continues from the next address
+		streamNextChunk();
+	}
+
+	if (streamCrc != NULL) {
+		// Overlaps with the transfer of the next chunk
+		streamCrcValue = SpiFlashCrc32::update(streamCrcValue, doneBuf, doneLen);
+		if (!more) {
+			*streamCrc = streamCrcValue;
+			streamCrc = NULL;
+		}
+	}
+
+	if (more) {
+		return;
+	}
+
+	endTransaction();
+
+	// The callback may start another async operation, so clear the state first
+	CompletionCallback callback = dmaCallback;
+	dmaCallback = NULL;
+
+	if (callback != NULL) {
+		callback(this);
+	}
+}
+
+// [static]
+template<size_t SLOT>
+void SpiFlash::_dmaTrampoline() {
+	SpiFlash *flash = _instances[SLOT];
+	if (flash != NULL) {
+		flash->dmaComplete();
+	}
+}
 
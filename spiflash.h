@@ -3,24 +3,278 @@
 
 // Class for interfacing with a 25LQ080 8 Mbit (1 Mbyte x 8 bit) SPI NAND flash chip
 
+#include "spiflashdevices.h"
+
 typedef void (*CompletionCallback)(void *);
 
+class SpiFlashReadCache;
+
+#ifndef SPIFLASH_DEVICE
+// Traits of the chip the driver is built for, from spiflashdevices.h, for example
+// -DSPIFLASH_DEVICE=SpiFlashIS25LP128. Geometry, instructions, and timing are compile-time constants.
+#define SPIFLASH_DEVICE SpiFlashIS25LQ080
+#endif
+
+#ifndef SPIFLASH_QUEUE_SIZE
+// Maximum number of outstanding async operations per SpiFlash object
+#define SPIFLASH_QUEUE_SIZE 8
+#endif
+
+#ifdef SPIFLASH_HOST
+// Host builds have no interrupts or system threads, so busy-waits run the simulated event loop
+// (host/Particle.h)
+#define SPIFLASH_BUSY_WAIT()	SpiFlashHost::poll()
+#else
+#define SPIFLASH_BUSY_WAIT()
+#endif
+
+#ifndef SPIFLASH_STATS
+// Set to 1 to collect operation counts and latencies, see SpiFlash::getStats(). When 0 the
+// instrumentation is not compiled in at all.
+#define SPIFLASH_STATS 0
+#endif
+
 /**
  * Object for interfacing with a 25LQ080 8 Mbit (1 Mbyte x 8 bit) SPI NAND flash chip
  *
  * Typically you create one of these as a global object. The first object to the constructor
  * is typically SPI or SPI1, and the second is the pin for the slave select/chip select for
  * the flash SPI device.
+ *
+ * The async functions (readPageAsync, readDataAsync, writePageAsync, the async erases, and
+ * waitForWriteCompleteAsync) add an operation to a fixed-size queue per object and return false if
+ * it is full. Queued operations are run in order, each started as soon as the previous one finishes,
+ * and the callback for each is called as it completes. Don't call the synchronous functions while
+ * getQueueCount() is non-zero.
+ *
+ * Each object uses the SPI object passed to the constructor, and objects on different SPI buses can
+ * run DMA transfers at the same time. Objects sharing a bus must not have async operations in progress
+ * at the same time. Up to MAX_INSTANCES objects can do async operations.
  */
 class SpiFlash {
 public:
+	/**
+	 * Instruction used to read data from the flash array
+	 *
+	 * The dual and quad modes require a host SPI peripheral that can clock data on multiple lines.
+	 * The Particle SPIClass only does single-line transfers, so setReadMode() falls back to
+	 * READ_MODE_FAST for those unless a subclass overrides isReadModeSupported(). The instruction
+	 * codes below are the 3-byte address ones; with 4-byte addresses the device traits supply the
+	 * 4-byte variants.
+	 */
+	enum ReadMode {
+		READ_MODE_NORMAL = 0,	//!< READ (0x03), no dummy cycles, up to 33 MHz
+		READ_MODE_FAST,			//!< FAST_READ (0x0B), 8 dummy cycles, up to 104 MHz
+		READ_MODE_DUAL_OUTPUT,	//!< FRDO (0x3B), data on 2 lines, 8 dummy cycles
+		READ_MODE_QUAD_OUTPUT,	//!< FRQO (0x6B), data on 4 lines, 8 dummy cycles
+		READ_MODE_DUAL_IO,		//!< FRDIO (0xBB), address and data on 2 lines, 4 dummy cycles
+		READ_MODE_QUAD_IO		//!< FRQIO (0xEB), address and data on 4 lines, 6 dummy cycles
+	};
+
+	/**
+	 * Parameters for a read mode: instruction, dummy cycles, and bus widths
+	 */
+	struct ReadModeInfo {
+		uint8_t inst;			//!< Instruction code
+		uint8_t dummyCycles;	//!< Dummy clock cycles between the address and the first data byte
+		uint8_t addrLines;		//!< Number of lines used for the address (and dummy cycles)
+		uint8_t dataLines;		//!< Number of lines used for the data
+		unsigned maxClockMHz;	//!< Maximum SPI clock for this instruction
+	};
+
+	// Number of ReadMode values
+	static const size_t NUM_READ_MODES = 6;
+
+	/**
+	 * Parameters read from the chip's SFDP table (JESD216), see readSfdp()
+	 *
+	 * Times are typical times in microseconds, and 0 if the table doesn't give them. Erase
+	 * instructions are 0 if the chip doesn't support that size.
+	 */
+	struct SfdpInfo {
+		uint8_t majorRev;						//!< SFDP revision
+		uint8_t minorRev;
+		size_t size;							//!< Size of the array in bytes
+		size_t pageSize;						//!< Program page size in bytes, 0 if not given
+		uint8_t readModes;						//!< Bit n set if ReadMode n is supported
+		ReadModeInfo readModeInfo[NUM_READ_MODES];	//!< Instruction and dummy cycles for each supported mode
+		uint8_t sectorEraseInst;				//!< 4K erase
+		uint8_t block32EraseInst;				//!< 32K erase
+		uint8_t blockEraseInst;					//!< 64K erase
+		uint32_t sectorEraseUs;
+		uint32_t block32EraseUs;
+		uint32_t blockEraseUs;
+		uint32_t chipEraseUs;
+		uint32_t pageProgramUs;
+	};
+
+	/**
+	 * One buffer of a scatter/gather operation (readvSync(), writevPageSync(), and their async versions)
+	 */
+	struct Segment {
+		void *buf;				//!< Buffer to read into or data to write; not modified by writes
+		size_t len;				//!< Number of bytes, may be 0
+	};
+
+	/**
+	 * Kind of operation in the instrumentation statistics (SPIFLASH_STATS)
+	 */
+	enum StatsOp {
+		STATS_READ = 0,			//!< Reads, from the start of the instruction to the last byte
+		STATS_PAGE_PROGRAM,		//!< Page programs, from the instruction until WIP is seen to clear
+		STATS_SECTOR_ERASE,		//!< Sector erases, from the instruction until WIP is seen to clear
+		STATS_BLOCK32_ERASE,	//!< 32K block erases
+		STATS_BLOCK_ERASE,		//!< 64K block erases
+		STATS_CHIP_ERASE,		//!< Chip erases
+		STATS_WAIT,				//!< Calls to waitForWriteComplete()
+		STATS_NUM_OPS
+	};
+
+	// Number of latency histogram buckets. Bucket n counts latencies of 2^n to 2^(n+1) - 1
+	// microseconds (bucket 0 includes 0); the last bucket includes everything longer.
+	static const size_t STATS_NUM_BUCKETS = 24;
+
+	/**
+	 * Statistics for one kind of operation
+	 */
+	struct OpStats {
+		uint32_t count;							//!< Number of operations
+		uint32_t bytes;							//!< Number of bytes read, programmed, or erased
+		uint32_t minMicros;						//!< Shortest latency (0xffffffff if count is 0)
+		uint32_t maxMicros;						//!< Longest latency
+		uint32_t totalMicros;					//!< Total latency, divide by count for the average
+		uint32_t histogram[STATS_NUM_BUCKETS];	//!< log2 latency histogram
+	};
+
+	/**
+	 * Instrumentation statistics, see getStats()
+	 */
+	struct Stats {
+		OpStats ops[STATS_NUM_OPS];			//!< Indexed by StatsOp
+		uint32_t statusPolls;				//!< Status register reads to check WIP, sync and async
+		uint32_t writeEnables;				//!< WREN instructions sent
+	};
+
+	/**
+	 * Deep power-down statistics, see getPowerStats()
+	 */
+	struct PowerStats {
+		uint32_t powerDownCount;		//!< Number of times deep power-down was entered
+		uint32_t wakeCount;				//!< Number of times the chip was released from deep power-down
+		uint32_t lastWakeMicros;		//!< Time taken by the last release, including tRES1
+		uint32_t maxWakeMicros;			//!< Longest time taken by a release
+		uint32_t totalWakeMicros;		//!< Total time taken by releases, divide by wakeCount for the average
+		uint32_t poweredDownMillis;		//!< Total time spent in deep power-down
+		uint32_t totalMillis;			//!< Time since the statistics were reset
+	};
+
 	SpiFlash(SPIClass &spi, int cs);
 	virtual ~SpiFlash();
 
 	/**
 	 * Call begin, probably from setup(). The initializes the SPI object.
+	 *
+	 * useSfdp If true, reads the chip's SFDP table and uses its read instructions, dummy cycles, erase
+	 * instructions, and typical times instead of the ones from the device traits, then selects the
+	 * fastest read mode (see applySfdp()). Chips without a valid table keep the traits.
+	 */
+	void begin(bool useSfdp = false);
+
+	/**
+	 * Reads and decodes the JEDEC basic flash parameter table from the SFDP area (instruction 0x5A)
+	 *
+	 * SFDP reads are specified up to 50 MHz, which is above the READ_MODE_NORMAL clock used until the
+	 * read mode is changed.
+	 *
+	 * Returns false if the chip doesn't have an SFDP table.
+	 */
+	bool readSfdp(SfdpInfo &info);
+
+	/**
+	 * Uses the parameters from readSfdp(): polling of programs and erases starts after the chip's
+	 * typical times, eraseRange() only uses the erase sizes the chip supports and that are faster than
+	 * the smaller ones, and reads use the chip's dummy cycles. Then selects the fastest read mode.
+	 * With 4-byte addresses the traits' 4-byte instructions are kept, since SFDP lists 3-byte ones.
+	 *
+	 * Returns false, and changes nothing, if the table describes a chip of a different size than
+	 * the device traits.
+	 */
+	bool applySfdp(const SfdpInfo &info);
+
+	/**
+	 * Selects the read mode with the highest throughput that both the chip and the host support, at
+	 * the maximum clock speed set with setMaxClockSpeed()
+	 */
+	void selectFastestReadMode();
+
+	/**
+	 * Sets whether other devices share the SPI bus. Default: false. Call before begin().
+	 *
+	 * On a dedicated bus the SPI settings are set once and left that way. On a shared bus each
+	 * transaction uses SPI.beginTransaction() with this object's settings, which waits for other
+	 * users of the bus and restores the settings if another device changed them.
+	 *
+	 * On a shared bus async operations are started from the software timer thread rather than
+	 * directly from enqueue or a DMA completion interrupt, so each one adds up to a millisecond of latency.
+	 */
+	void setSharedBus(bool shared);
+
+	/**
+	 * Returns true if the bus is shared (see setSharedBus())
+	 */
+	bool isSharedBus() const { return sharedBus; }
+
+	/**
+	 * Enables automatic deep power-down. Disabled by default.
+	 *
+	 * When the chip has not been accessed for idleMs milliseconds and no async operations are queued,
+	 * the Deep Power Down instruction (DP, 0xB9) is sent from a software timer. The next access sends
+	 * Release from Deep Power Down (RDP, 0xAB) and waits tRES1 first, so nothing else changes for the
+	 * caller; the first access after a power down takes a few microseconds longer.
+	 *
+	 * idleMs Idle time before powering down, or 0 to disable
+	 */
+	void setAutoPowerDown(unsigned long idleMs);
+
+	/**
+	 * Waits for any write in progress and puts the chip in deep power-down now. The next access
+	 * releases it. Don't call while async operations are queued.
+	 */
+	void powerDown();
+
+	/**
+	 * Releases the chip from deep power-down, if it's powered down. This is done automatically on the
+	 * next access, so calling it is only useful to take the wake latency ahead of time.
+	 */
+	void wakeUp();
+
+	/**
+	 * Returns true if the chip is in deep power-down
+	 */
+	bool isPoweredDown() const { return poweredDown; }
+
+	/**
+	 * Gets the deep power-down statistics. The fraction of time spent powered down is
+	 * stats.poweredDownMillis / stats.totalMillis.
+	 */
+	void getPowerStats(PowerStats &stats) const;
+
+	/**
+	 * Clears the deep power-down statistics
+	 */
+	void resetPowerStats();
+
+#if SPIFLASH_STATS
+	/**
+	 * Gets a copy of the instrumentation statistics. Only available when SPIFLASH_STATS is 1.
 	 */
-	void begin();
+	void getStats(Stats &stats) const;
+
+	/**
+	 * Clears the instrumentation statistics
+	 */
+	void resetStats();
+#endif
 
 	/**
 	 * Returns true if there appears to be a valid flash RAM chip on the specified SPI bus at with the
@@ -43,27 +297,217 @@ public:
 	 */
 	bool isWriteInProgress();
 
+	/**
+	 * Checks once, without waiting, whether the last sync write or erase is done. Unlike
+	 * isWriteInProgress(), seeing WIP clear marks it done, so the next operation starts without
+	 * polling again. Doesn't read the status register if it's already known to be done.
+	 *
+	 * Only for writes started with the sync API; the async queue polls its own operations.
+	 *
+	 * Returns true if no write is in progress.
+	 */
+	bool pollWriteComplete();
+
 	/**
 	 * Waits for any pending write operations to complete.
 	 *
-	 * Calls delay(1) internally, so the cloud connection will be serviced in non-threaded mode.
+	 * Waits for the typical duration of the operation in progress, then polls the status register.
+	 * Page programs and status writes are then polled by reading the status register continuously
+	 * with CS held low, for up to their typical duration again, so their end is seen within a few
+	 * microseconds. Erases, and programs that take longer, are polled every 50 microseconds or less
+	 * often and use delay(), so the cloud connection will be serviced in non-threaded mode.
+	 *
+	 * Returns immediately, without reading the status register, if WIP has already been seen to
+	 * clear since the last program, erase, or status write.
 	 */
 	void waitForWriteComplete();
 
+	/**
+	 * Calls the callback once all previously queued operations are done and no write operation is in
+	 * progress, without blocking.
+	 *
+	 * The status register is polled from a software timer, so the callback may be called from the
+	 * timer thread, or before this returns if nothing is in progress.
+	 *
+	 * callback The function to call when done. It has the prototype:
+	 * 		void callbackFn(void *param);
+	 * param This is passed to the callback and is not interpeted by the SpiFlash module
+	 *
+	 * Returns false if the queue is full.
+	 */
+	bool waitForWriteCompleteAsync(CompletionCallback callback, void *param);
+
+	/**
+	 * Returns the number of queued async operations, including the one in progress
+	 */
+	size_t getQueueCount() const;
+
+	/**
+	 * Returns true if this object can do async operations. Only MAX_INSTANCES objects can; the
+	 * async calls of any others always return false.
+	 */
+	bool isAsyncAvailable() const;
+
 	/**
 	 * Writes the status register.
 	 */
 	void writeStatus(uint8_t status);
 
+	/**
+	 * Sets the instruction used for reads. The default is READ_MODE_NORMAL.
+	 *
+	 * If the host SPI peripheral cannot do the multi-line transfers the mode requires, READ_MODE_FAST
+	 * is used instead; use getReadMode() to see which mode is in effect. The quad modes also set the
+	 * QE bit in the status register.
+	 *
+	 * The SPI clock is the lower of the mode's maximum clock and the value set using setMaxClockSpeed().
+	 */
+	void setReadMode(ReadMode mode);
+
+	/**
+	 * Returns the read mode in effect, which may be READ_MODE_FAST if the requested mode is not supported
+	 */
+	ReadMode getReadMode() const { return readMode; }
+
+	/**
+	 * Sets the maximum SPI clock speed in MHz that the host and board wiring allow. Default: 30 MHz.
+	 */
+	void setMaxClockSpeed(unsigned mhz);
+
+	/**
+	 * Returns the parameters for a read mode from the device traits
+	 */
+	static const ReadModeInfo &getReadModeInfo(ReadMode mode);
+
+	/**
+	 * Returns the parameters for a read mode used with this chip, which are the ones from SFDP if
+	 * applySfdp() was used
+	 */
+	const ReadModeInfo &getChipReadModeInfo(ReadMode mode) const { return chipReadModeInfo[mode]; }
+
+	/**
+	 * Returns true if the chip supports a read mode, according to the device traits or SFDP
+	 */
+	bool isChipReadMode(ReadMode mode) const { return (chipReadModes & (1 << mode)) != 0; }
+
+	/**
+	 * Attaches a read cache, or detaches it if cache is NULL. See SpiFlashReadCache.
+	 *
+	 * When attached, readDataSync() and readPageSync() are served from the cache where possible, and
+	 * page programs and erases invalidate the affected lines. Async reads always read the flash.
+	 */
+	void setReadCache(SpiFlashReadCache *cache);
+
 	/**
 	 * Reads data synchronously. Reads data correctly across page boundaries.
 	 *
+	 * The chip increments the address internally across page, sector, and block boundaries, so
+	 * this issues a single READ instruction for the whole range and streams the data in DMA
+	 * transfers of up to MAX_DMA_TRANSFER bytes while CS stays low.
+	 *
 	 * addr The address to read from
 	 * buf The buffer to store data in
 	 * bufLen The number of bytes to read
 	 */
 	void readDataSync(size_t addr, void *buf, size_t bufLen);
 
+	/**
+	 * Reads data asynchronously and calls the callback when done. Reads data correctly across page
+	 * boundaries and is not limited to a single page like readPageAsync().
+	 *
+	 * addr The address to read from
+	 * buf The buffer to store data in
+	 * bufLen The number of bytes to read
+	 * callback The function to call when done. It has the prototype:
+	 * 		void callbackFn(void *param);
+	 * param This is passed to the callback and is not interpeted by the SpiFlash module
+	 *
+	 * Returns false if the queue is full.
+	 */
+	bool readDataAsync(size_t addr, void *buf, size_t bufLen, CompletionCallback callback, void *param);
+
+	/**
+	 * Reads data asynchronously ahead of anything else in the queue except earlier priority reads,
+	 * which run first, in the order they were queued.
+	 *
+	 * The read is run as soon as the operation in progress is done. If that is a sector or block
+	 * erase, the erase is suspended (PERSUS, 0x75), the read is done, then the erase is resumed
+	 * (PERRSM, 0x7A), so latency-sensitive reads are not stalled behind long erases. Chip erase can't be
+	 * suspended. Don't read from the sector or block being erased; its contents are undefined.
+	 *
+	 * The parameters are the same as readDataAsync(). Returns false if the queue is full.
+	 */
+	bool readDataPriorityAsync(size_t addr, void *buf, size_t bufLen, CompletionCallback callback, void *param);
+
+	/**
+	 * Reads data synchronously like readDataSync() and computes the CRC-32 of the data as it's read.
+	 *
+	 * The data is read in DMA transfers of CRC_CHUNK_SIZE bytes within a single READ instruction,
+	 * and the CRC of each chunk is computed while the next one is being transferred, so this takes
+	 * about the same time as readDataSync() alone. The read cache is not used.
+	 *
+	 * addr The address to read from
+	 * buf The buffer to store data in
+	 * bufLen The number of bytes to read
+	 * crc 0, or the CRC of preceding data to continue from (see SpiFlashCrc32)
+	 *
+	 * Returns the CRC-32 of the data.
+	 */
+	uint32_t readDataSyncCrc(size_t addr, void *buf, size_t bufLen, uint32_t crc = 0);
+
+	/**
+	 * Reads bufLen bytes and the 4-byte little endian CRC-32 stored after them, as written by
+	 * SpiFlashWriteCache::writeDataSyncCrc(), in a single streaming read.
+	 *
+	 * Returns true if the CRC matches the data.
+	 */
+	bool readDataSyncCheckCrc(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * Does readDataSyncCrc() asynchronously. The CRC is stored in *crc before the callback is called.
+	 *
+	 * The CRC of each chunk is computed in the DMA completion interrupt after starting the next one.
+	 *
+	 * Returns false if the queue is full.
+	 */
+	bool readDataAsyncCrc(size_t addr, void *buf, size_t bufLen, uint32_t *crc, CompletionCallback callback, void *param);
+
+	/**
+	 * Returns true if every byte in [addr, addr + len) is 0xFF
+	 *
+	 * The range is read with a single READ instruction into two COMPARE_CHUNK_SIZE stack buffers,
+	 * checking each chunk a word at a time while the next one transfers, and stops at the first
+	 * byte that isn't erased. No buffer for the whole range is needed.
+	 */
+	bool isErased(size_t addr, size_t len);
+
+	/**
+	 * Returns true if the flash at addr contains the bufLen bytes in buf. Works like isErased(),
+	 * including stopping at the first difference.
+	 */
+	bool verify(size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * Reads consecutive data from the flash into several buffers (scatter read) synchronously
+	 *
+	 * This works like readDataSync() for the total length of the segments: a single READ instruction
+	 * is sent and the data is streamed into each segment in turn while CS stays low. The read cache
+	 * is not used.
+	 *
+	 * addr The address to read from
+	 * segs Array of buffers to fill, in order
+	 * numSegs Number of entries in segs
+	 */
+	void readvSync(size_t addr, const Segment *segs, size_t numSegs);
+
+	/**
+	 * Does readvSync() asynchronously and calls the callback when done. The segs array and the
+	 * buffers must remain valid until then.
+	 *
+	 * Returns false if the queue is full.
+	 */
+	bool readvAsync(size_t addr, const Segment *segs, size_t numSegs, CompletionCallback callback, void *param);
+
 	/**
 	 * Reads data synchronously.
 	 *
@@ -82,18 +526,40 @@ public:
 	 * callback The function to call when done. It has the prototype:
 	 * 		void callbackFn(void *param);
 	 * param This is passed to the callback and is not interpeted by the SpiFlash module
+	 *
+	 * Returns false if the queue is full.
 	 */
-	void readPageAsync(size_t addr, void *buf, size_t bufLen, CompletionCallback callback, void *param);
+	bool readPageAsync(size_t addr, void *buf, size_t bufLen, CompletionCallback callback, void *param);
 
 	/**
 	 * Writes data synchronously. Can write data across page boundaries.
 	 *
+	 * If smart write is enabled (see setSmartWrite()), the existing contents are read first and pages
+	 * that already contain the data are not programmed.
+	 *
 	 * addr The address to read from
 	 * buf The buffer to store data in
 	 * bufLen The number of bytes to write
 	 */
 	void writeDataSync(size_t addr, const void *buf, size_t bufLen);
 
+	/**
+	 * Enables or disables smart write mode for writeDataSync(). Disabled by default.
+	 *
+	 * In smart write mode each target sector is read back first (a single streaming read) and:
+	 * - if it already contains the data, nothing is programmed
+	 * - if the new data only clears bits, only the pages that differ are programmed, without erasing
+	 * - otherwise the sector is erased and reprogrammed with the new data merged into the old contents
+	 *
+	 * The erase case requires sectorBuf, a SECTOR_SIZE (4096) byte buffer that must remain valid while
+	 * smart write is enabled. Without it, writes are compared a page at a time using a stack buffer and
+	 * pages that would need an erase are programmed as in normal mode.
+	 *
+	 * enable true to enable smart write mode
+	 * sectorBuf NULL or a SECTOR_SIZE byte scratch buffer
+	 */
+	void setSmartWrite(bool enable, uint8_t *sectorBuf = NULL);
+
 	/**
 	 * Writes data synchronously.
 	 *
@@ -109,6 +575,19 @@ public:
 	 */
 	void writePageSync(size_t addr, const void *buf, size_t bufLen);
 
+	/**
+	 * Starts a page program as writePageSync() does, but returns as soon as the data has been sent
+	 * instead of waiting for the program to finish
+	 *
+	 * Use pollWriteComplete() to check for the end, which lets programs on several chips overlap
+	 * without going through the async queue. Any sync operation also waits for it first.
+	 *
+	 * addr The address to write to
+	 * buf The data to write. It's sent before this returns, so it can be reused.
+	 * bufLen The number of bytes to write; should be 1 <= bufLen <= 256.
+	 */
+	void writePageStart(size_t addr, const void *buf, size_t bufLen);
+
 	/**
 	 * Writes data asynchronously.
 	 *
@@ -118,17 +597,39 @@ public:
 	 * of these same page, not the next page! This is not the way read works, and this is probably not
 	 * what you intended to do!
 	 *
-	 * When the completion callback is called you can recycle buf, but the write might not actually be
-	 * finished. You need to check isWriteInProgress() or use waitForWriteComplete() to know when the
-	 * write is fully complete. This is done internally for the synchronous write, but because it requires
-	 * polling the status register, it's not part of the async write call since it would require a timer
-	 * and often you don't care if the write is still in progress.
+	 * This does not block. If a previous write or erase is still in progress, the program is started
+	 * once it completes. The completion callback is called from the software timer thread when the
+	 * program is fully complete (WIP has cleared). buf must remain valid until then.
 	 *
 	 * addr The address to read from
 	 * buf The buffer to store data in
 	 * bufLen The number of bytes to read; should be 1 <= bufLen <= 256.
+	 *
+	 * Returns false if the queue is full.
+	 */
+	bool writePageAsync(size_t addr, const void *buf, size_t bufLen, CompletionCallback callback, void *param);
+
+	/**
+	 * Programs data gathered from several buffers (gather write) synchronously
+	 *
+	 * The segments are sent one after another in a single page program, so a record made of a
+	 * header and a payload in separate buffers can be written without copying it into a staging
+	 * buffer first. As with writePageSync(), the data wraps around within the page, so the total
+	 * length of the segments should be 1 to 256 bytes and not cross a page boundary.
+	 *
+	 * addr The address to write to
+	 * segs Array of data buffers, in order
+	 * numSegs Number of entries in segs
 	 */
-	void writePageAsync(size_t addr, const void *buf, size_t bufLen, CompletionCallback callback, void *param);
+	void writevPageSync(size_t addr, const Segment *segs, size_t numSegs);
+
+	/**
+	 * Does writevPageSync() asynchronously. The callback is called from the software timer thread when
+	 * the program is complete. The segs array and the data must remain valid until then.
+	 *
+	 * Returns false if the queue is full.
+	 */
+	bool writevPageAsync(size_t addr, const Segment *segs, size_t numSegs, CompletionCallback callback, void *param);
 
 	/**
 	 * Erases a sector. Sectors are 4K (4096 bytes) and the smallest unit that can be erased.
@@ -140,6 +641,18 @@ public:
 	 */
 	void sectorErase(size_t addr);
 
+	/**
+	 * Erases a sector asynchronously. The callback is called from the software timer thread when the
+	 * erase is complete.
+	 *
+	 * addr Address of the beginning of the sector
+	 * callback The function to call when done
+	 * param This is passed to the callback and is not interpeted by the SpiFlash module
+	 *
+	 * Returns false if the queue is full.
+	 */
+	bool sectorEraseAsync(size_t addr, CompletionCallback callback, void *param);
+
 	/**
 	 * Erases a block. Blocks are 64K (65536 bytes) or 16 sectors. There are 16 blocks on the device.
 	 *
@@ -150,6 +663,85 @@ public:
 	 */
 	void blockErase(size_t addr);
 
+	/**
+	 * Erases a block asynchronously. The callback is called from the software timer thread when the
+	 * erase is complete.
+	 *
+	 * addr Address of the beginning of the block
+	 * callback The function to call when done
+	 * param This is passed to the callback and is not interpeted by the SpiFlash module
+	 *
+	 * Returns false if the queue is full.
+	 */
+	bool blockEraseAsync(size_t addr, CompletionCallback callback, void *param);
+
+	/**
+	 * Erases a 32K (32768 byte) half block.
+	 *
+	 * This call blocks (calling delay(), so the cloud will be handled when the system thread is not used)
+	 * until the erase is complete.
+	 *
+	 * addr Address of the beginning of the half block
+	 */
+	void block32Erase(size_t addr);
+
+	/**
+	 * Erases a 32K half block asynchronously. The callback is called from the software timer thread when
+	 * the erase is complete.
+	 *
+	 * addr Address of the beginning of the half block
+	 * callback The function to call when done
+	 * param This is passed to the callback and is not interpeted by the SpiFlash module
+	 *
+	 * Returns false if the queue is full.
+	 */
+	bool block32EraseAsync(size_t addr, CompletionCallback callback, void *param);
+
+	/**
+	 * Erases every sector that overlaps [addr, addr + len) using the fewest erase operations: 64K
+	 * blocks where possible, then 32K half blocks, then 4K sectors.
+	 *
+	 * This call blocks until the erases are complete.
+	 */
+	void eraseRange(size_t addr, size_t len);
+
+	/**
+	 * Does eraseRange() asynchronously. The callback is called from the software timer thread when
+	 * everything has been erased.
+	 *
+	 * Only one of eraseRangeAsync() and eraseAndWriteAsync() can be in progress at a time per object.
+	 * The operations are queued one at a time, so this only needs one free queue entry.
+	 *
+	 * Returns false if another range operation is in progress.
+	 */
+	bool eraseRangeAsync(size_t addr, size_t len, CompletionCallback callback, void *param);
+
+	/**
+	 * Erases the sectors covering [addr, addr + bufLen) as eraseRange() does, then writes buf.
+	 *
+	 * Data in the erased sectors outside of the range being written is lost.
+	 *
+	 * This call blocks until the erases and writes are complete.
+	 */
+	void eraseAndWrite(size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * Does eraseAndWrite() asynchronously. The callback is called from the software timer thread when
+	 * the last page has been programmed. buf must remain valid until then.
+	 *
+	 * Returns false if another range operation is in progress.
+	 */
+	bool eraseAndWriteAsync(size_t addr, const void *buf, size_t bufLen, CompletionCallback callback, void *param);
+
+	/**
+	 * Returns the end of the erases queued so far by the range operation in progress, or the last one.
+	 *
+	 * The queue runs in order, so an operation queued after this returns runs after the erase of any
+	 * address below the value returned. This lets a page be programmed as soon as its erase is queued,
+	 * without waiting for the rest of the range.
+	 */
+	size_t getRangeEraseQueued() const;
+
 	/**
 	 * Erases the entire chip.
 	 *
@@ -158,18 +750,119 @@ public:
 	 */
 	void chipErase();
 
+	/**
+	 * Erases the entire chip asynchronously. The callback is called from the software timer thread when
+	 * the erase is complete.
+	 *
+	 * callback The function to call when done
+	 * param This is passed to the callback and is not interpeted by the SpiFlash module
+	 *
+	 * Returns false if the queue is full.
+	 */
+	bool chipEraseAsync(CompletionCallback callback, void *param);
+
 	// Flags for the status register
 	static const uint8_t STATUS_WIP 	= 0x01;
 	static const uint8_t STATUS_WEL 	= 0x02;
+	static const uint8_t STATUS_QE 		= 0x40;
 	static const uint8_t STATUS_SRWD 	= 0x80;
 
-	static const size_t PAGE_SIZE = 256;
-	static const size_t SECTOR_SIZE = 4096;
-	static const size_t NUM_SECTORS = 256;
-	static const size_t BLOCK_SIZE = 65536;
-	static const size_t NUM_BLOCKS = 16;
+	// The chip the driver is built for (SPIFLASH_DEVICE)
+	typedef SPIFLASH_DEVICE Device;
+
+	static const size_t PAGE_SIZE = Device::PAGE_SIZE;
+	static const size_t SECTOR_SIZE = Device::SECTOR_SIZE;
+	static const size_t NUM_SECTORS = Device::NUM_SECTORS;
+	static const size_t BLOCK_SIZE = Device::BLOCK_SIZE;
+	static const size_t BLOCK32_SIZE = Device::BLOCK32_SIZE;
+	static const size_t NUM_BLOCKS = Device::NUM_BLOCKS;
+
+	// Number of address bytes sent with an instruction, 3 or 4
+	static const size_t ADDRESS_BYTES = Device::ADDRESS_BYTES;
+
+	// Largest single DMA transfer; longer streaming reads are split into chunks of this size
+	static const size_t MAX_DMA_TRANSFER = 65535;
+
+	// DMA transfer size for reads that compute a CRC
+	static const size_t CRC_CHUNK_SIZE = 512;
+
+	// DMA transfer size for isErased() and verify(); two buffers of this size are used on the stack
+	static const size_t COMPARE_CHUNK_SIZE = 256;
+
+	static const size_t QUEUE_SIZE = SPIFLASH_QUEUE_SIZE;
+
+	// Maximum number of SpiFlash objects that can do async operations at the same time
+	static const size_t MAX_INSTANCES = 4;
+
+protected:
+	/**
+	 * Returns true if the host SPI peripheral can do the transfers required by mode
+	 *
+	 * The default implementation supports the single-line modes only. A subclass for a dual or quad
+	 * capable peripheral overrides this along with readCommand() and readTransfer().
+	 */
+	virtual bool isReadModeSupported(ReadMode mode) const;
+
+	/**
+	 * Begins a transaction and sends the read instruction, address, and dummy cycles for the current
+	 * read mode. CS is left LOW so the caller can clock in as much data as it wants.
+	 */
+	virtual void readCommand(size_t addr);
+
+	/**
+	 * Clocks in read data after readCommand(). If completion is NULL the transfer is synchronous.
+	 */
+	virtual void readTransfer(void *buf, size_t bufLen, wiring_spi_dma_transfercomplete_callback_t completion);
+
+	/**
+	 * Returns the SPI clock speed in MHz for the current read mode and clock limit
+	 */
+	unsigned getClockSpeedMHz() const;
 
 private:
+	/**
+	 * Operation that sets the WIP bit, used to pick how long to wait and how often to poll
+	 */
+	enum BusyOp {
+		BUSY_NONE = 0,
+		BUSY_PAGE_PROGRAM,
+		BUSY_WRITE_STATUS,
+		BUSY_SECTOR_ERASE,
+		BUSY_BLOCK32_ERASE,
+		BUSY_BLOCK_ERASE,
+		BUSY_CHIP_ERASE
+	};
+
+	/**
+	 * Type of an operation in the async queue
+	 */
+	enum QueueOpType {
+		OP_READ = 0,
+		OP_READV,
+		OP_PROGRAM,
+		OP_PROGRAMV,
+		OP_SECTOR_ERASE,
+		OP_BLOCK32_ERASE,
+		OP_BLOCK_ERASE,
+		OP_CHIP_ERASE,
+		OP_WAIT
+	};
+
+	/**
+	 * An operation in the async queue
+	 */
+	struct QueueOp {
+		QueueOpType type;
+		size_t addr;
+		uint8_t *buf;		//!< Data, or the Segment array for OP_READV and OP_PROGRAMV
+		size_t bufLen;		//!< Number of bytes, or the number of segments
+		CompletionCallback callback;
+		void *param;
+		uint32_t *crc;		//!< Where to store the CRC of the data read, or NULL
+		bool priority;		//!< Queued with readDataPriorityAsync()
+		bool suspended;		//!< Erase that was suspended to run a priority operation
+	};
+
 	/**
 	 * Enables writes to the status register, flash writes, and erases.
 	 *
@@ -179,50 +872,336 @@ private:
 
 	/**
 	 * Begins an SPI transaction, setting the CS line LOW.
-	 * Also sets the SPI speed and mode settings if sharedBus == true
+	 * Also acquires the bus with spiSettings if sharedBus == true
 	 */
 	void beginTransaction();
 
 	/**
-	 * Ends an SPI transaction, basically just setting the CS line high.
+	 * Ends an SPI transaction, setting the CS line high and releasing the bus if sharedBus == true.
 	 */
 	void endTransaction();
 
 	/**
-	 * Sets the SPI bus speed, mode and byte order
-	 *
-	 * This is done in begin() normally or in beginTransaction() if sharedBus == true.
+	 * Updates spiSettings for the current clock speed, and if the bus is not shared, sets the SPI
+	 * bus speed, mode and byte order.
 	 *
-	 * The issue is that changing the bus speed and settings requires a delay for things to
-	 * sync back up. If the SPI flash is the only thing on that bus, the delay is unnecessary
-	 * because the speed and mode can be set during begin() instead and just left that way.
+	 * If the SPI flash is the only thing on that bus, the speed and mode can be set during begin()
+	 * and when the read mode changes instead of on every transaction, and just left that way.
 	 */
 	void setSpiSettings();
 
 	/**
-	 * Sets a instruction code and an address (3-byte, 24-bit, big endian value).
+	 * Software timer callback that powers down the chip once it has been idle long enough
+	 */
+	void idleTimerCallback();
+
+	/**
+	 * Sends DP if no write is in progress. The caller must own the bus and have interrupts disabled.
+	 */
+	void powerDownCommand();
+
+	/**
+	 * Sends RDP and waits tRES1, updating the statistics. Called with the bus owned.
+	 */
+	void releasePowerDown();
+
+	/**
+	 * Transfers a short command synchronously, a byte at a time. txBuf or rxBuf may be NULL.
+	 */
+	void commandTransfer(const uint8_t *txBuf, uint8_t *rxBuf, size_t len);
+
+	/**
+	 * Sets a instruction code and an address (ADDRESS_BYTES, big endian value). buf must have room for
+	 * INST_ADDR_SIZE bytes.
 	 *
 	 */
 	void setInstWithAddr(uint8_t inst, size_t addr, uint8_t *buf);
 
+	// Length of an instruction code with an address
+	static const size_t INST_ADDR_SIZE = 1 + ADDRESS_BYTES;
+
+	/**
+	 * Used internally by readDataSync() and readPageSync() when there is a read cache
+	 */
+	void readDataCached(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * Used internally by readDataSync() to read directly from the flash
+	 */
+	void readDataUncached(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * Used internally by writeDataSync() in smart write mode for the part of a write within one sector
+	 */
+	void writeSectorSmart(size_t addr, const uint8_t *buf, size_t bufLen);
+
+	/**
+	 * Used internally by writeDataSync() in smart write mode when there is no sector buffer
+	 */
+	void writePageSmart(size_t addr, const uint8_t *buf, size_t bufLen);
+
+	/**
+	 * Used internally by queued reads and programs to start the DMA transfer for the next chunk
+	 */
+	void streamNextChunk();
+
+	/**
+	 * Starts a read DMA transfer within a synchronous streaming read. Transfers synchronously if
+	 * this object has no DMA completion slot.
+	 */
+	void readChunkStart(uint8_t *buf, size_t bufLen);
+
+	/**
+	 * Waits for the transfer started by readChunkStart()
+	 */
+	void readChunkWait();
+
+	/**
+	 * Used internally by isErased() (expected == NULL) and verify()
+	 */
+	bool compareStream(size_t addr, const uint8_t *expected, size_t len);
+
+	/**
+	 * Clocks in bufLen bytes after readCommand(), computing their CRC one chunk behind the DMA
+	 */
+	uint32_t readStreamCrc(uint8_t *buf, size_t bufLen, uint32_t crc);
+
+	/**
+	 * Moves the stream on to the next non-empty segment. Returns false if there are none left.
+	 */
+	bool streamNextSegment();
+
+	/**
+	 * Starts streaming the segments of segs, either into the flash (write is true) or from it.
+	 * The command must have been sent already. Returns false if there is no data.
+	 */
+	bool streamSegments(const Segment *segs, size_t numSegs, bool write);
+
 	/**
-	 * Used internally by readPageSync() and readPageAsync()
+	 * Used internally by readPageSync()
 	 */
 	void readPageCommon(size_t addr, void *buf, size_t bufLen, wiring_spi_dma_transfercomplete_callback_t completion);
 
+	/**
+	 * Sends WREN and the PAGE_PROG instruction and address, leaving CS low for the data
+	 */
+	void writePageCommand(size_t addr);
+
 	/**
 	 * Used internally by writePageSync() and writePageAsync()
 	 */
 	void writePageCommon(size_t addr, const void *buf, size_t bufLen, wiring_spi_dma_transfercomplete_callback_t completion);
 
 	/**
-	 * Used internally by readPageAsync() and writePageAsync()
+	 * Sends an erase instruction (with WREN first) for a sector, block, or the whole chip. Does not wait.
+	 */
+	void eraseCommand(BusyOp op, size_t addr);
+
+	/**
+	 * Returns the largest erase operation that starts at addr and doesn't go past end, and sets
+	 * size to the number of bytes it erases. Block erases are only used if the chip supports them
+	 * and they're faster than erasing the same range in smaller units. addr must be sector aligned.
+	 */
+	BusyOp planErase(size_t addr, size_t end, size_t &size) const;
+
+	/**
+	 * Reads from the SFDP area. SFDP addresses are always 3 bytes.
+	 */
+	void readSfdpData(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * Sets up the state for eraseRangeAsync() and eraseAndWriteAsync()
+	 */
+	bool startRangeJob(size_t addr, size_t eraseLen, const void *buf, size_t bufLen, CompletionCallback callback, void *param);
+
+	/**
+	 * Queues the next erase or program of the range job, or calls its callback if done
+	 */
+	void rangeJobStep();
+
+	/**
+	 * Calls rangeJobStep() on the SpiFlash object passed as param
+	 */
+	static void _rangeJobStep(void *param);
+
+	/**
+	 * Records that op has just been started, so WIP is expected to be set
+	 */
+	void setBusy(BusyOp op);
+
+	/**
+	 * Records that WIP has been seen to clear after the operation in progress
+	 */
+	void busyDone();
+
+	/**
+	 * Reads the status register continuously in one transaction until WIP clears or maxUs have
+	 * elapsed. Returns true if WIP cleared.
+	 */
+	bool waitForWipContinuous(unsigned long maxUs);
+
+#if SPIFLASH_STATS
+	/**
+	 * Adds an operation to the instrumentation statistics
+	 */
+	void recordStats(StatsOp op, size_t bytes, unsigned long micros);
+#endif
+
+	/**
+	 * Returns the total length of a list of segments
+	 */
+	static size_t segmentsLength(const Segment *segs, size_t numSegs);
+
+	/**
+	 * Starts the poll timer. The first poll is at the typical completion time for the operation in
+	 * progress; later polls use the operation's poll interval. Can be called from an ISR.
+	 */
+	void schedulePoll(bool first);
+
+	/**
+	 * Calls callback as soon as no write operation is in progress: immediately if possible, otherwise
+	 * from the poll timer. Can be called from an ISR.
+	 */
+	void whenReady(CompletionCallback callback, void *param);
+
+	/**
+	 * Software timer callback that polls WIP and calls readyCallback when it clears
+	 */
+	void pollTimerCallback();
+
+	/**
+	 * Adds an operation to the async queue and starts it if the queue was idle
+	 */
+	bool enqueue(QueueOpType type, size_t addr, void *buf, size_t bufLen, CompletionCallback callback, void *param, bool priority = false, uint32_t *crc = NULL);
+
+	/**
+	 * Returns true if an operation of this type can be suspended for a priority operation
+	 */
+	static bool isSuspendable(QueueOpType type);
+
+	/**
+	 * Called from the poll timer to suspend the erase at the head of the queue, move it after the
+	 * priority operations queued behind it, and start the first of them. Returns false if the erase
+	 * is not in progress, including when it has just finished and WIP is already clear.
+	 */
+	bool suspendHeadErase();
+
+	/**
+	 * Resumes the suspended erase at the head of the queue and goes back to polling for it to finish
+	 */
+	void resumeHeadErase();
+
+	/**
+	 * Starts the operation at the head of the queue. The chip must be ready.
+	 */
+	void startQueueHead();
+
+	/**
+	 * Removes the operation at the head of the queue, starts the next one, and calls the callback
+	 */
+	void completeQueueHead();
+
+	/**
+	 * Calls startQueueHead() on the SpiFlash object passed as param
+	 */
+	static void _startQueueHead(void *param);
+
+	/**
+	 * Called once a queued program or erase has been sent to start polling for it to finish
+	 */
+	static void _queueHeadSent(void *param);
+
+	/**
+	 * DMA completion for a queued program: CS has just gone high, which is when the chip starts
+	 * programming, so the busy time starts now. Then does _queueHeadSent().
+	 */
+	static void _programSent(void *param);
+
+	/**
+	 * Calls completeQueueHead() on the SpiFlash object passed as param
+	 */
+	static void _queueHeadDone(void *param);
+
+	/**
+	 * Called when an async DMA transfer for this object completes. Chains the next chunk of a read,
+	 * or ends the transaction and calls dmaCallback.
+	 */
+	void dmaComplete();
+
+	/**
+	 * DMA completion callback for the object in slot SLOT of the instance table
 	 */
-	static void _completion();
+	template<size_t SLOT>
+	static void _dmaTrampoline();
 
 	SPIClass &spi;
 	int cs;
 	bool sharedBus = false;
+	SPISettings spiSettings;
+	volatile bool busReleasePending = false;
+	bool inPollTimer = false;
+
+	ReadMode readMode = READ_MODE_NORMAL;
+	ReadModeInfo chipReadModeInfo[NUM_READ_MODES];
+	uint8_t chipReadModes = Device::READ_MODES;
+	SpiFlashReadCache *readCache = NULL;
+	bool smartWrite = false;
+	uint8_t *smartSectorBuf = NULL;
+	unsigned maxClockMHz = 30;
+
+	Timer pollTimer;
+	unsigned long busyTypicalUs[BUSY_CHIP_ERASE + 1];
+	uint8_t eraseInst[BUSY_CHIP_ERASE + 1];
+	BusyOp busyOp = BUSY_NONE;
+	bool writeIdle = false;		// WIP seen clear since the last setBusy(); unknown after reset
+	unsigned long busyStartMicros = 0;
+	CompletionCallback readyCallback = NULL;
+	void *readyParam = NULL;
+
+	QueueOp queue[QUEUE_SIZE];
+	size_t queueHead = 0;
+	volatile size_t queueCount = 0;
+	volatile bool queueRunning = false;
+	volatile bool suspendRequested = false;
+	BusyOp suspendedBusyOp = BUSY_NONE;
+	unsigned long suspendedStartMicros = 0;
+
+	bool rangeJobActive = false;
+	bool rangeJobRetry = false;
+	volatile size_t rangeEraseAddr = 0;
+	size_t rangeEraseEnd = 0;
+	size_t rangeWriteAddr = 0;
+	const uint8_t *rangeWriteBuf = NULL;
+	size_t rangeWriteRemaining = 0;
+	CompletionCallback rangeCallback = NULL;
+	void *rangeParam = NULL;
+	wiring_spi_dma_transfercomplete_callback_t dmaCompletion = NULL;
+	CompletionCallback dmaCallback = NULL;
+	uint8_t *streamBuf = NULL;
+	size_t streamRemaining = 0;
+	const Segment *streamSegs = NULL;
+	size_t streamSegsRemaining = 0;
+	bool streamWrite = false;
+	uint8_t *streamChunkBuf = NULL;
+	size_t streamChunkLen = 0;
+	uint32_t *streamCrc = NULL;
+	uint32_t streamCrcValue = 0;
+	volatile bool syncDmaBusy = false;
+
+	Timer idleTimer;
+	unsigned long autoPowerDownMs = 0;
+	volatile bool inTransaction = false;
+	volatile bool poweredDown = false;
+	volatile unsigned long lastActivityMillis = 0;
+	unsigned long powerDownStartMicros = 0;
+	unsigned long powerDownStartMillis = 0;
+	unsigned long powerStatsStartMillis = 0;
+	PowerStats powerStats = {};
+
+#if SPIFLASH_STATS
+	Stats stats;
+	unsigned long opStartMicros = 0;
+#endif
 };
 
 #endif /* __SPIFLASH_H */
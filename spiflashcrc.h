@@ -0,0 +1,30 @@
+#ifndef __SPIFLASHCRC_H
+#define __SPIFLASHCRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Table-driven CRC-32 (IEEE 802.3, the same as zlib's crc32())
+ *
+ * The CRC can be computed incrementally: pass 0 for the first block and the previous result for
+ * each following block. The table is 1K of const data, so it stays in flash.
+ */
+class SpiFlashCrc32 {
+public:
+	/**
+	 * Updates a CRC with more data
+	 *
+	 * crc The CRC of the data so far, or 0 to start
+	 * buf The data
+	 * bufLen The number of bytes of data
+	 *
+	 * Returns the CRC of all of the data.
+	 */
+	static uint32_t update(uint32_t crc, const void *buf, size_t bufLen);
+
+	// Size of the CRC stored after data, little endian
+	static const size_t CRC_SIZE = 4;
+};
+
+#endif /* __SPIFLASHCRC_H */
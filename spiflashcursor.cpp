@@ -0,0 +1,204 @@
+
+#include "Particle.h"
+
+#include "spiflashcursor.h"
+
+SpiFlashCursor::SpiFlashCursor(SpiFlash &flash, uint8_t *data, size_t windowSize) : flash(flash), windowSize(windowSize) {
+	for(size_t ii = 0; ii < 2; ii++) {
+		windows[ii].cursor = this;
+		windows[ii].data = &data[ii * windowSize];
+		windows[ii].addr = 0;
+		windows[ii].len = 0;
+		windows[ii].reading = false;
+	}
+}
+
+SpiFlashCursor::~SpiFlashCursor() {
+	close();
+}
+
+void SpiFlashCursor::open(size_t addr, size_t len) {
+	close();
+
+	for(size_t ii = 0; ii < 2; ii++) {
+		windows[ii].len = 0;
+	}
+	current = NULL;
+	curData = NULL;
+	curAddr = fastEnd = 0;
+
+	viewStart = pos = addr;
+	viewEnd = addr + len;
+}
+
+void SpiFlashCursor::close() {
+	for(size_t ii = 0; ii < 2; ii++) {
+		waitForWindow(&windows[ii]);
+	}
+}
+
+bool SpiFlashCursor::seek(size_t offset) {
+	// Makes the next read() take the slow path, which finds the window for the new position
+	fastEnd = 0;
+
+	if (offset > viewEnd - viewStart) {
+		pos = viewEnd;
+		return false;
+	}
+	pos = viewStart + offset;
+	return true;
+}
+
+int SpiFlashCursor::peek() {
+	if (!prepare()) {
+		return -1;
+	}
+	return curData[pos - curAddr];
+}
+
+size_t SpiFlashCursor::read(void *buf, size_t len) {
+	uint8_t *curBuf = (uint8_t *)buf;
+	size_t result = 0;
+
+	while(len > 0 && prepare()) {
+		size_t count = curAddr + current->len - pos;
+		if (count > len) {
+			count = len;
+		}
+		memcpy(curBuf, &curData[pos - curAddr], count);
+
+		pos += count;
+		curBuf += count;
+		len -= count;
+		result += count;
+	}
+	return result;
+}
+
+const uint8_t *SpiFlashCursor::map(size_t len) {
+	if (len == 0 || len > windowSize || len > available() || !prepare()) {
+		return NULL;
+	}
+	if (pos + len > curAddr + current->len) {
+		// Straddles two windows; reload so the whole range is in one
+		load();
+		prepare();
+	}
+	return &curData[pos - curAddr];
+}
+
+bool SpiFlashCursor::readUint16(uint16_t &value) {
+	uint8_t buf[2];
+
+	if (available() < sizeof(buf)) {
+		return false;
+	}
+	read(buf, sizeof(buf));
+	value = (uint16_t) (buf[0] | (buf[1] << 8));
+	return true;
+}
+
+bool SpiFlashCursor::readUint32(uint32_t &value) {
+	uint8_t buf[4];
+
+	if (available() < sizeof(buf)) {
+		return false;
+	}
+	read(buf, sizeof(buf));
+	value = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+	return true;
+}
+
+int SpiFlashCursor::readSlow() {
+	if (!prepare()) {
+		return -1;
+	}
+	return curData[pos++ - curAddr];
+}
+
+bool SpiFlashCursor::prepare() {
+	if (pos >= viewEnd) {
+		return false;
+	}
+
+	Window *other = (current == &windows[0]) ? &windows[1] : &windows[0];
+	if (current == NULL || !windowContains(current, pos)) {
+		if (windowContains(other, pos)) {
+			// Normally the read-ahead, finished by now
+			waitForWindow(other);
+			setCurrent(other);
+		}
+		else {
+			load();
+		}
+		other = (current == &windows[0]) ? &windows[1] : &windows[0];
+	}
+
+	size_t end = curAddr + current->len;
+	size_t half = curAddr + current->len / 2;
+	if (pos < half) {
+		fastEnd = half;
+		return true;
+	}
+	fastEnd = end;
+
+	if (end < viewEnd && !windowContains(other, end) && !other->reading) {
+		other->addr = end;
+		other->len = windowLen(end);
+		other->reading = true;
+		if (!flash.readDataAsync(other->addr, other->data, other->len, _readDone, other)) {
+			// Queue is full; the window is loaded synchronously when the cursor gets there
+			other->len = 0;
+			other->reading = false;
+		}
+	}
+	return true;
+}
+
+void SpiFlashCursor::setCurrent(Window *w) {
+	current = w;
+	curData = w->data;
+	curAddr = w->addr;
+	fastEnd = 0;
+}
+
+void SpiFlashCursor::load() {
+	Window *w = (current == &windows[0]) ? &windows[1] : &windows[0];
+	volatile bool busy = true;
+
+	waitForWindow(w);
+	w->addr = pos;
+	w->len = windowLen(pos);
+
+	// In order with the rest of the queue, so writes and erases queued before this are in the data.
+	// A priority read would jump ahead of them, and unlike SpiFlashLog::readSync() there's nothing
+	// here to merge the queued data back in.
+	while(!flash.readDataAsync(w->addr, w->data, w->len, _clearFlag, (void *)&busy)) {
+		delay(1);
+	}
+	while(busy) {
+		SPIFLASH_BUSY_WAIT();
+	}
+
+	setCurrent(w);
+}
+
+void SpiFlashCursor::waitForWindow(Window *w) {
+	while(w->reading) {
+		SPIFLASH_BUSY_WAIT();
+	}
+}
+
+size_t SpiFlashCursor::windowLen(size_t addr) const {
+	return (viewEnd - addr < windowSize) ? (viewEnd - addr) : windowSize;
+}
+
+// [static]
+void SpiFlashCursor::_readDone(void *param) {
+	((Window *)param)->reading = false;
+}
+
+// [static]
+void SpiFlashCursor::_clearFlag(void *param) {
+	*(volatile bool *)param = false;
+}
@@ -0,0 +1,210 @@
+#ifndef __SPIFLASHCURSOR_H
+#define __SPIFLASHCURSOR_H
+
+#include "spiflash.h"
+
+/**
+ * Reads a range of the flash (the view) one byte or one field at a time, as if it were memory
+ *
+ * The cursor keeps two windows of the view in RAM. Reads are served from the current window, and once
+ * the cursor is past the middle of it the other window is filled with the data that follows using an
+ * async read, so a parser that walks the view in order rarely waits for the flash and runs at
+ * streaming read speed. Seeking backwards or far ahead reloads the window at the new position.
+ *
+ * Windows are loaded in order with the other operations in the flash queue, so they include writes
+ * and erases queued before the load, even async ones that haven't run yet; loading waits for them.
+ * After that the windows are a snapshot: data written to the flash later is not seen until the
+ * window is reloaded, for example by calling open() again.
+ *
+ * Use the SpiFlashCursorStatic template to allocate the windows, for example:
+ *
+ * SpiFlash spiFlash(SPI, A2);
+ * SpiFlashCursorStatic<512> cursor(spiFlash);
+ *
+ * cursor.open(addr, len);
+ * while(!cursor.isEnd()) {
+ *     int c = cursor.read();
+ *     ...
+ * }
+ */
+class SpiFlashCursor {
+public:
+	/**
+	 * One of the two RAM windows
+	 */
+	struct Window {
+		SpiFlashCursor *cursor;		//!< The cursor the window belongs to
+		uint8_t *data;				//!< windowSize bytes
+		size_t addr;				//!< Flash address of data[0]
+		size_t len;					//!< Number of bytes loaded, 0 if none
+		volatile bool reading;		//!< An async read into data is queued or in progress
+	};
+
+	/**
+	 * Constructs the cursor. You normally use SpiFlashCursorStatic instead.
+	 *
+	 * flash The flash chip to read from
+	 * data 2 * windowSize bytes of window memory
+	 * windowSize Size of each window
+	 */
+	SpiFlashCursor(SpiFlash &flash, uint8_t *data, size_t windowSize);
+	virtual ~SpiFlashCursor();
+
+	/**
+	 * Sets the view to [addr, addr + len) and moves the cursor to addr. Nothing is read until the
+	 * first access.
+	 */
+	void open(size_t addr, size_t len);
+
+	/**
+	 * Waits for the read-ahead in progress, if any. Call before reusing the window memory, or before
+	 * writing the range of the view if the cursor might be reading ahead into it.
+	 */
+	void close();
+
+	/**
+	 * Moves the cursor to offset bytes from the start of the view. Returns false, and moves to the
+	 * end, if offset is past the end.
+	 */
+	bool seek(size_t offset);
+
+	/**
+	 * Moves the cursor ahead by len bytes without reading them. Returns false, and moves to the end,
+	 * if that would go past the end.
+	 */
+	bool skip(size_t len) { return seek(tell() + len); }
+
+	/**
+	 * Returns the cursor position as an offset from the start of the view
+	 */
+	size_t tell() const { return pos - viewStart; }
+
+	/**
+	 * Returns the flash address of the cursor
+	 */
+	size_t getAddr() const { return pos; }
+
+	/**
+	 * Returns the number of bytes from the cursor to the end of the view
+	 */
+	size_t available() const { return viewEnd - pos; }
+
+	/**
+	 * Returns true if the cursor is at the end of the view
+	 */
+	bool isEnd() const { return pos >= viewEnd; }
+
+	/**
+	 * Reads the byte at the cursor and advances. Returns -1 at the end of the view.
+	 */
+	int read() {
+		if (pos < fastEnd) {
+			return curData[pos++ - curAddr];
+		}
+		return readSlow();
+	}
+
+	/**
+	 * Returns the byte at the cursor without advancing, or -1 at the end of the view
+	 */
+	int peek();
+
+	/**
+	 * Copies up to len bytes from the cursor and advances past them
+	 *
+	 * Returns the number of bytes copied, which is less than len only at the end of the view.
+	 */
+	size_t read(void *buf, size_t len);
+
+	/**
+	 * Returns a pointer to len contiguous bytes at the cursor without advancing, reloading the
+	 * window at the cursor if they straddle two windows
+	 *
+	 * The pointer is valid until the cursor is next moved or read. Returns NULL if len is larger
+	 * than the window size or goes past the end of the view.
+	 */
+	const uint8_t *map(size_t len);
+
+	/**
+	 * Reads a little endian value and advances. Returns false, without advancing, if the view
+	 * doesn't have enough bytes left.
+	 */
+	bool readUint16(uint16_t &value);
+	bool readUint32(uint32_t &value);
+
+protected:
+	/**
+	 * read() when the cursor isn't in the part of the current window that needs no checks
+	 */
+	int readSlow();
+
+	/**
+	 * Makes the window containing pos current and starts the read-ahead once pos is in the second
+	 * half of it. Returns false at the end of the view.
+	 */
+	bool prepare();
+
+	/**
+	 * Makes w the current window
+	 */
+	void setCurrent(Window *w);
+
+	/**
+	 * Loads the window that isn't current with the data at pos and makes it current
+	 */
+	void load();
+
+	/**
+	 * Waits until the async read into w, if any, has finished
+	 */
+	void waitForWindow(Window *w);
+
+	/**
+	 * Returns the number of bytes of the view a window starting at addr holds
+	 */
+	size_t windowLen(size_t addr) const;
+
+	/**
+	 * Returns true if w has been loaded, or is being loaded, with the data at addr
+	 */
+	static bool windowContains(const Window *w, size_t addr) { return w->len != 0 && addr >= w->addr && addr < w->addr + w->len; }
+
+	/**
+	 * Read-ahead completion callback; param is the Window
+	 */
+	static void _readDone(void *param);
+
+	/**
+	 * Sync read completion callback; param is a volatile bool to clear
+	 */
+	static void _clearFlag(void *param);
+
+	SpiFlash &flash;
+	size_t windowSize;
+	Window windows[2];
+	Window *current = NULL;
+	size_t viewStart = 0;
+	size_t viewEnd = 0;
+	size_t pos = 0;
+
+	// Cached from current, so read() is a compare and a copy
+	const uint8_t *curData = NULL;
+	size_t curAddr = 0;
+	size_t fastEnd = 0;				// read() needs no checks below this
+};
+
+/**
+ * Cursor with two statically allocated windows of WINDOW_SIZE bytes
+ *
+ * A window of a few hundred bytes is enough for the read-ahead to finish before the parser reaches it.
+ */
+template<size_t WINDOW_SIZE>
+class SpiFlashCursorStatic : public SpiFlashCursor {
+public:
+	explicit SpiFlashCursorStatic(SpiFlash &flash) : SpiFlashCursor(flash, staticData, WINDOW_SIZE) {}
+
+protected:
+	uint8_t staticData[2 * WINDOW_SIZE];
+};
+
+#endif /* __SPIFLASHCURSOR_H */
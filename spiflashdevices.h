@@ -0,0 +1,103 @@
+#ifndef __SPIFLASHDEVICES_H
+#define __SPIFLASHDEVICES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Geometry and instruction set of a 25-series SPI NOR flash, by size and address width
+ *
+ * All of the supported parts have 256 byte pages, 4K sectors, and 32K and 64K blocks, so only the
+ * number of sectors varies. Parts larger than 16 Mbyte need 4-byte addresses; smaller parts that
+ * support the 4-byte instructions can use them too by setting ADDRESS_BYTES_ to 4. The 4-byte
+ * instructions take the address width from the opcode, so no address mode needs to be entered.
+ */
+template<size_t NUM_SECTORS_, size_t ADDRESS_BYTES_>
+struct SpiFlashGeometry {
+	static constexpr size_t PAGE_SIZE = 256;
+	static constexpr size_t SECTOR_SIZE = 4096;
+	static constexpr size_t BLOCK32_SIZE = 32768;
+	static constexpr size_t BLOCK_SIZE = 65536;
+	static constexpr size_t NUM_SECTORS = NUM_SECTORS_;
+	static constexpr size_t NUM_BLOCKS = NUM_SECTORS_ * SECTOR_SIZE / BLOCK_SIZE;
+	static constexpr size_t ADDRESS_BYTES = ADDRESS_BYTES_;
+
+	static_assert(ADDRESS_BYTES == 3 || ADDRESS_BYTES == 4, "addresses are 3 or 4 bytes");
+	static_assert(ADDRESS_BYTES == 4 || NUM_SECTORS_ <= 4096, "parts over 16 Mbyte need 4-byte addresses");
+	static_assert(NUM_SECTORS_ * SECTOR_SIZE % BLOCK_SIZE == 0, "size must be a whole number of 64K blocks");
+
+	// Instructions with an address
+	static constexpr uint8_t OPCODE_READ = (ADDRESS_BYTES == 4) ? 0x13 : 0x03;
+	static constexpr uint8_t OPCODE_FAST_READ = (ADDRESS_BYTES == 4) ? 0x0C : 0x0B;
+	static constexpr uint8_t OPCODE_DUAL_OUTPUT_READ = (ADDRESS_BYTES == 4) ? 0x3C : 0x3B;
+	static constexpr uint8_t OPCODE_QUAD_OUTPUT_READ = (ADDRESS_BYTES == 4) ? 0x6C : 0x6B;
+	static constexpr uint8_t OPCODE_DUAL_IO_READ = (ADDRESS_BYTES == 4) ? 0xBC : 0xBB;
+	static constexpr uint8_t OPCODE_QUAD_IO_READ = (ADDRESS_BYTES == 4) ? 0xEC : 0xEB;
+	static constexpr uint8_t OPCODE_PAGE_PROGRAM = (ADDRESS_BYTES == 4) ? 0x12 : 0x02;
+	static constexpr uint8_t OPCODE_BLOCK32_ERASE = (ADDRESS_BYTES == 4) ? 0x5C : 0x52;
+	static constexpr uint8_t OPCODE_BLOCK_ERASE = (ADDRESS_BYTES == 4) ? 0xDC : 0xD8;
+};
+
+/**
+ * ISSI 25LQ series, 2.3 to 3.6 V, up to 104 MHz. Only 3-byte addresses.
+ *
+ * The datasheets only give typical erase times for some sizes; the others are scaled from the
+ * 25LQ080. The times only decide when the driver starts polling, so they don't need to be exact.
+ */
+template<uint8_t MEMORY_TYPE_, uint8_t CAPACITY_, size_t NUM_SECTORS_>
+struct SpiFlashIssiLq : public SpiFlashGeometry<NUM_SECTORS_, 3> {
+	static constexpr uint8_t JEDEC_MANUFACTURER = 0x9d;
+	static constexpr uint8_t JEDEC_MEMORY_TYPE = MEMORY_TYPE_;
+	static constexpr uint8_t JEDEC_CAPACITY = CAPACITY_;
+
+	static constexpr uint8_t OPCODE_SECTOR_ERASE = 0xD7;
+
+	static constexpr unsigned READ_MAX_MHZ = 33;			// READ (no dummy cycles)
+	static constexpr unsigned MAX_CLOCK_MHZ = 104;			// Every other instruction
+	static constexpr uint8_t READ_MODES = 0x3f;				// Bit n set if SpiFlash::ReadMode n is supported
+
+	// Typical times in microseconds
+	static constexpr uint32_t PAGE_PROGRAM_US = 700;
+	static constexpr uint32_t WRITE_STATUS_US = 2000;
+	static constexpr uint32_t SECTOR_ERASE_US = 70000;
+	static constexpr uint32_t BLOCK32_ERASE_US = 300000;
+	static constexpr uint32_t BLOCK_ERASE_US = 500000;
+	static constexpr uint32_t CHIP_ERASE_US = 4000000 / 256 * NUM_SECTORS_;
+};
+
+/**
+ * ISSI 25LP series, 2.3 to 3.6 V, up to 133 MHz
+ */
+template<uint8_t MEMORY_TYPE_, uint8_t CAPACITY_, size_t NUM_SECTORS_, size_t ADDRESS_BYTES_ = (NUM_SECTORS_ > 4096) ? 4 : 3>
+struct SpiFlashIssiLp : public SpiFlashGeometry<NUM_SECTORS_, ADDRESS_BYTES_> {
+	static constexpr uint8_t JEDEC_MANUFACTURER = 0x9d;
+	static constexpr uint8_t JEDEC_MEMORY_TYPE = MEMORY_TYPE_;
+	static constexpr uint8_t JEDEC_CAPACITY = CAPACITY_;
+
+	static constexpr uint8_t OPCODE_SECTOR_ERASE = (ADDRESS_BYTES_ == 4) ? 0x21 : 0x20;
+
+	static constexpr unsigned READ_MAX_MHZ = 50;
+	static constexpr unsigned MAX_CLOCK_MHZ = 133;
+	static constexpr uint8_t READ_MODES = 0x3f;
+
+	static constexpr uint32_t PAGE_PROGRAM_US = 200;
+	static constexpr uint32_t WRITE_STATUS_US = 2000;
+	static constexpr uint32_t SECTOR_ERASE_US = 70000;
+	static constexpr uint32_t BLOCK32_ERASE_US = 100000;
+	static constexpr uint32_t BLOCK_ERASE_US = 150000;
+	static constexpr uint32_t CHIP_ERASE_US = 45000000 / 4096 * NUM_SECTORS_;
+};
+
+// 8 Mbit (1 Mbyte), the part the library was written for
+typedef SpiFlashIssiLq<0x13, 0x44, 256> SpiFlashIS25LQ080;
+
+// 16 Mbit (2 Mbyte)
+typedef SpiFlashIssiLq<0x40, 0x15, 512> SpiFlashIS25LQ016;
+
+// 32 Mbit (4 Mbyte)
+typedef SpiFlashIssiLq<0x40, 0x16, 1024> SpiFlashIS25LQ032;
+
+// 128 Mbit (16 Mbyte). Use SpiFlashIssiLp<0x60, 0x18, 4096, 4> for 4-byte addresses.
+typedef SpiFlashIssiLp<0x60, 0x18, 4096> SpiFlashIS25LP128;
+
+#endif /* __SPIFLASHDEVICES_H */
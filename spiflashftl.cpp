@@ -0,0 +1,287 @@
+
+#include "Particle.h"
+
+#include "spiflashftl.h"
+
+// Header at the start of each physical sector. magic and eraseCount are programmed right after the
+// sector is erased; the rest is programmed when the sector is allocated to a logical sector.
+typedef struct {
+	uint32_t magic;
+	uint32_t eraseCount;
+	uint16_t logical;
+	uint8_t state;
+	uint8_t reserved;
+	uint32_t seq;
+} FtlSectorHeader;
+
+static const uint16_t UNMAPPED = 0xffff;
+
+SpiFlashFtl::SpiFlashFtl(SpiFlash &flash, size_t firstSector, size_t numSectors, size_t spareSectors) :
+	flash(flash), firstSector(firstSector), numSectors(numSectors), spareSectors(spareSectors) {
+
+	if (this->numSectors > MAX_SECTORS) {
+		this->numSectors = MAX_SECTORS;
+	}
+	if (this->spareSectors < 1) {
+		this->spareSectors = 1;
+	}
+	for(size_t ii = 0; ii < MAX_SECTORS; ii++) {
+		logicalMap[ii] = UNMAPPED;
+		eraseCounts[ii] = 0;
+		sectorStates[ii] = SECTOR_OBSOLETE;
+	}
+}
+
+SpiFlashFtl::~SpiFlashFtl() {
+
+}
+
+void SpiFlashFtl::begin() {
+	uint32_t seqs[MAX_SECTORS];
+
+	for(size_t ii = 0; ii < MAX_SECTORS; ii++) {
+		logicalMap[ii] = UNMAPPED;
+	}
+
+	for(size_t physical = 0; physical < numSectors; physical++) {
+		FtlSectorHeader hdr;
+		readSync(sectorAddr(physical), &hdr, sizeof(hdr));
+
+		sectorStates[physical] = SECTOR_OBSOLETE;
+		if (hdr.magic != SECTOR_MAGIC) {
+			// Never formatted, or reset during an erase; the erase count is unknown
+			eraseCounts[physical] = 0;
+			continue;
+		}
+		eraseCounts[physical] = hdr.eraseCount;
+
+		if (hdr.state == HEADER_STATE_FREE && hdr.logical == UNMAPPED) {
+			sectorStates[physical] = SECTOR_FREE;
+			continue;
+		}
+		if (hdr.state != HEADER_STATE_VALID || hdr.logical >= getNumLogicalSectors()) {
+			// Obsolete, or reset before the data was completely written
+			continue;
+		}
+		if ((int32_t)(hdr.seq - sequence) > 0) {
+			sequence = hdr.seq;
+		}
+
+		uint16_t other = logicalMap[hdr.logical];
+		if (other != UNMAPPED) {
+			// Reset after the new copy was written but before the old one was marked obsolete
+			if ((int32_t)(hdr.seq - seqs[other]) < 0) {
+				continue;
+			}
+			sectorStates[other] = SECTOR_OBSOLETE;
+		}
+		logicalMap[hdr.logical] = physical;
+		sectorStates[physical] = SECTOR_USED;
+		seqs[physical] = hdr.seq;
+	}
+
+	startBackgroundErase();
+}
+
+void SpiFlashFtl::format() {
+	// Keep the background erase from starting on anything else, then let it finish
+	for(size_t physical = 0; physical < numSectors; physical++) {
+		sectorStates[physical] = SECTOR_ERASING;
+	}
+	while(erasing || flash.getQueueCount() > 0) {
+		delay(1);
+	}
+
+	ATOMIC_BLOCK() {
+		pendingOps++;
+	}
+	while(!flash.eraseRangeAsync(sectorAddr(0), numSectors * SpiFlash::SECTOR_SIZE, _opDone, this)) {
+		// Another range operation is in progress
+		delay(1);
+	}
+	while(pendingOps > 0) {
+		delay(1);
+	}
+
+	for(size_t physical = 0; physical < numSectors; physical++) {
+		FtlSectorHeader hdr;
+		hdr.magic = SECTOR_MAGIC;
+		hdr.eraseCount = ++eraseCounts[physical];
+		programSync(sectorAddr(physical), &hdr, 8);
+
+		logicalMap[physical] = UNMAPPED;
+		sectorStates[physical] = SECTOR_FREE;
+	}
+}
+
+bool SpiFlashFtl::writeSector(size_t logical, const void *buf) {
+	if (logical >= getNumLogicalSectors()) {
+		return false;
+	}
+
+	size_t physical = allocate();
+	size_t addr = sectorAddr(physical);
+
+	// Claim the sector first, write the data, then mark it valid, so a reset part way through leaves
+	// a sector that begin() treats as obsolete
+	FtlSectorHeader hdr;
+	memset(&hdr, 0xff, sizeof(hdr));
+	hdr.logical = (uint16_t) logical;
+	hdr.state = HEADER_STATE_ALLOCATED;
+	hdr.seq = ++sequence;
+	programSync(addr + offsetof(FtlSectorHeader, logical), &hdr.logical, sizeof(hdr) - offsetof(FtlSectorHeader, logical));
+
+	programSync(addr + HEADER_SIZE, buf, LOGICAL_SECTOR_SIZE);
+
+	uint8_t state = HEADER_STATE_VALID;
+	programSync(addr + offsetof(FtlSectorHeader, state), &state, sizeof(state));
+
+	uint16_t old = logicalMap[logical];
+	logicalMap[logical] = physical;
+
+	if (old != UNMAPPED) {
+		state = HEADER_STATE_OBSOLETE;
+		programSync(sectorAddr(old) + offsetof(FtlSectorHeader, state), &state, sizeof(state));
+		sectorStates[old] = SECTOR_OBSOLETE;
+		startBackgroundErase();
+	}
+	return true;
+}
+
+bool SpiFlashFtl::readData(size_t logical, size_t offset, void *buf, size_t bufLen) {
+	if (logical >= getNumLogicalSectors() || offset + bufLen > LOGICAL_SECTOR_SIZE) {
+		return false;
+	}
+
+	uint16_t physical = logicalMap[logical];
+	if (physical == UNMAPPED) {
+		memset(buf, 0xff, bufLen);
+	}
+	else {
+		readSync(sectorAddr(physical) + HEADER_SIZE + offset, buf, bufLen);
+	}
+	return true;
+}
+
+size_t SpiFlashFtl::allocate() {
+	while(true) {
+		size_t best = numSectors;
+
+		for(size_t physical = 0; physical < numSectors; physical++) {
+			if (sectorStates[physical] == SECTOR_FREE && (best == numSectors || eraseCounts[physical] < eraseCounts[best])) {
+				best = physical;
+			}
+		}
+		if (best < numSectors) {
+			sectorStates[best] = SECTOR_USED;
+			return best;
+		}
+
+		// Everything free is still being erased
+		startBackgroundErase();
+		delay(1);
+	}
+}
+
+void SpiFlashFtl::startBackgroundErase() {
+	size_t physical;
+
+	ATOMIC_BLOCK() {
+		if (!erasing) {
+			for(physical = 0; physical < numSectors; physical++) {
+				if (sectorStates[physical] == SECTOR_OBSOLETE) {
+					sectorStates[physical] = SECTOR_ERASING;
+					erasingSector = physical;
+					erasing = true;
+					break;
+				}
+			}
+		}
+		else {
+			physical = numSectors;
+		}
+	}
+
+	if (physical < numSectors) {
+		while(!flash.sectorEraseAsync(sectorAddr(physical), _eraseDone, this)) {
+			delay(1);
+		}
+	}
+}
+
+// [static]
+void SpiFlashFtl::_eraseDone(void *param) {
+	SpiFlashFtl *ftl = (SpiFlashFtl *)param;
+	size_t physical = ftl->erasingSector;
+
+	uint32_t magic = SECTOR_MAGIC;
+	uint32_t eraseCount = ++ftl->eraseCounts[physical];
+	memcpy(&ftl->eraseHeader[0], &magic, sizeof(magic));
+	memcpy(&ftl->eraseHeader[4], &eraseCount, sizeof(eraseCount));
+
+	if (!ftl->flash.writePageAsync(ftl->sectorAddr(physical), ftl->eraseHeader, sizeof(ftl->eraseHeader), _headerDone, ftl)) {
+		// Queue is full; leave the sector obsolete without a header and it will be erased again
+		ftl->sectorStates[physical] = SECTOR_OBSOLETE;
+		ftl->erasing = false;
+	}
+}
+
+// [static]
+void SpiFlashFtl::_headerDone(void *param) {
+	SpiFlashFtl *ftl = (SpiFlashFtl *)param;
+
+	ftl->sectorStates[ftl->erasingSector] = SECTOR_FREE;
+	ftl->erasing = false;
+
+	// Queue the next obsolete sector, if any
+	ftl->startBackgroundErase();
+}
+
+void SpiFlashFtl::programSync(size_t addr, const void *buf, size_t bufLen) {
+	const uint8_t *curBuf = (const uint8_t *)buf;
+
+	while(bufLen > 0) {
+		size_t count = SpiFlash::PAGE_SIZE - (addr % SpiFlash::PAGE_SIZE);
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		ATOMIC_BLOCK() {
+			pendingOps++;
+		}
+		while(!flash.writePageAsync(addr, curBuf, count, _opDone, this)) {
+			delay(1);
+		}
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+	}
+
+	while(pendingOps > 0) {
+		delay(1);
+	}
+}
+
+void SpiFlashFtl::readSync(size_t addr, void *buf, size_t bufLen) {
+	ATOMIC_BLOCK() {
+		pendingOps++;
+	}
+	while(!flash.readDataPriorityAsync(addr, buf, bufLen, _opDone, this)) {
+		delay(1);
+	}
+	while(pendingOps > 0) {
+		// Normally only waits for the transfer, or for the erase in progress to be suspended
+		SPIFLASH_BUSY_WAIT();
+	}
+}
+
+// [static]
+void SpiFlashFtl::_opDone(void *param) {
+	SpiFlashFtl *ftl = (SpiFlashFtl *)param;
+
+	ATOMIC_BLOCK() {
+		ftl->pendingOps--;
+	}
+}
+
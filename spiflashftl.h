@@ -0,0 +1,162 @@
+#ifndef __SPIFLASHFTL_H
+#define __SPIFLASHFTL_H
+
+#include "spiflash.h"
+
+/**
+ * Lightweight flash translation layer with wear leveling
+ *
+ * Maps logical sectors to physical 4K sectors. Rewriting a logical sector programs a free physical
+ * sector (the one with the lowest erase count) and erases the old one in the background using the
+ * async erase, so a rewrite never waits on an erase of the sector it replaces, and repeated rewrites of
+ * the same logical sector are spread over the whole region.
+ *
+ * Each physical sector starts with a HEADER_SIZE byte header holding its erase count and, once used,
+ * the logical sector number, a state, and a sequence number, so a logical sector holds
+ * LOGICAL_SECTOR_SIZE (4080) bytes. The mapping table and erase counts are kept in RAM (about 7 bytes
+ * per physical sector) and rebuilt from the headers by begin().
+ *
+ * numSectors - spareSectors logical sectors are available. More spare sectors make it less likely
+ * that a write waits for a background erase to free a sector.
+ *
+ * All flash access goes through the SpiFlash async queue. Don't use the synchronous SpiFlash functions
+ * on the same chip while the FTL is in use.
+ */
+class SpiFlashFtl {
+public:
+	/**
+	 * Constructs the FTL object
+	 *
+	 * flash The flash chip
+	 * firstSector Sector number of the first sector used
+	 * numSectors Number of physical sectors used, up to SpiFlash::NUM_SECTORS
+	 * spareSectors Number of physical sectors not available as logical sectors, at least 1
+	 */
+	SpiFlashFtl(SpiFlash &flash, size_t firstSector = 0, size_t numSectors = SpiFlash::NUM_SECTORS, size_t spareSectors = 4);
+	virtual ~SpiFlashFtl();
+
+	/**
+	 * Rebuilds the mapping table from the sector headers and starts erasing obsolete sectors in the
+	 * background. Call after flash.begin(), probably from setup().
+	 */
+	void begin();
+
+	/**
+	 * Erases all of the physical sectors, discarding all logical sectors. Erase counts are preserved.
+	 */
+	void format();
+
+	/**
+	 * Writes a whole logical sector
+	 *
+	 * logical Logical sector number, 0 <= logical < getNumLogicalSectors()
+	 * buf LOGICAL_SECTOR_SIZE bytes of data
+	 *
+	 * Returns false if logical is out of range.
+	 */
+	bool writeSector(size_t logical, const void *buf);
+
+	/**
+	 * Reads data from a logical sector. A logical sector that has never been written reads as 0xFF.
+	 *
+	 * logical Logical sector number
+	 * offset Offset within the logical sector
+	 * buf Buffer to store data in
+	 * bufLen Number of bytes to read; offset + bufLen <= LOGICAL_SECTOR_SIZE
+	 *
+	 * Returns false if the arguments are out of range.
+	 */
+	bool readData(size_t logical, size_t offset, void *buf, size_t bufLen);
+
+	/**
+	 * Returns the number of logical sectors
+	 */
+	size_t getNumLogicalSectors() const { return numSectors - spareSectors; }
+
+	/**
+	 * Returns the erase count of a physical sector (index relative to firstSector)
+	 */
+	uint32_t getEraseCount(size_t physical) const { return eraseCounts[physical]; }
+
+	static const uint32_t SECTOR_MAGIC = 0x314c5446; // "FTL1" little endian
+
+	static const size_t HEADER_SIZE = 16;
+
+	static const size_t LOGICAL_SECTOR_SIZE = SpiFlash::SECTOR_SIZE - HEADER_SIZE;
+
+	static const size_t MAX_SECTORS = SpiFlash::NUM_SECTORS;
+
+	// Values of the state byte in the sector header. Each step only clears bits, so it can be
+	// programmed over the previous value.
+	static const uint8_t HEADER_STATE_FREE		= 0xff;
+	static const uint8_t HEADER_STATE_ALLOCATED	= 0x7f;
+	static const uint8_t HEADER_STATE_VALID		= 0x3f;
+	static const uint8_t HEADER_STATE_OBSOLETE	= 0x1f;
+
+protected:
+	/**
+	 * State of a physical sector in RAM
+	 */
+	enum SectorState {
+		SECTOR_FREE = 0,		//!< Erased, header with erase count programmed
+		SECTOR_USED,			//!< Holds a logical sector
+		SECTOR_OBSOLETE,		//!< Needs to be erased
+		SECTOR_ERASING			//!< Background erase in progress
+	};
+
+	/**
+	 * Returns the address of a physical sector
+	 */
+	size_t sectorAddr(size_t physical) const { return (firstSector + physical) * SpiFlash::SECTOR_SIZE; }
+
+	/**
+	 * Returns the free physical sector with the lowest erase count, waiting for a background erase if
+	 * there are none
+	 */
+	size_t allocate();
+
+	/**
+	 * Starts erasing the next obsolete sector in the background, if not already erasing one
+	 */
+	void startBackgroundErase();
+
+	/**
+	 * Called when a background erase completes, to program the erase count header
+	 */
+	static void _eraseDone(void *param);
+
+	/**
+	 * Called when the erase count header of an erased sector has been programmed
+	 */
+	static void _headerDone(void *param);
+
+	/**
+	 * Programs data (splitting at page boundaries) through the queue and waits for it to complete
+	 */
+	void programSync(size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * Reads from the flash ahead of anything queued and waits for the read to complete
+	 */
+	void readSync(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * Completion callback for programSync() and readSync()
+	 */
+	static void _opDone(void *param);
+
+	SpiFlash &flash;
+	size_t firstSector;
+	size_t numSectors;
+	size_t spareSectors;
+	uint32_t sequence = 0;
+	volatile size_t pendingOps = 0;
+	volatile bool erasing = false;
+	size_t erasingSector = 0;
+	uint8_t eraseHeader[8];
+	uint16_t logicalMap[MAX_SECTORS];
+	uint32_t eraseCounts[MAX_SECTORS];
+	volatile uint8_t sectorStates[MAX_SECTORS];
+};
+
+#endif /* __SPIFLASHFTL_H */
@@ -0,0 +1,213 @@
+
+#include "Particle.h"
+
+#include "spiflashimage.h"
+#include "spiflashcrc.h"
+
+SpiFlashImageWriter::SpiFlashImageWriter(SpiFlash &flash, Buffer *buffers, size_t numBuffers, uint8_t *data) :
+	flash(flash), buffers(buffers), numBuffers(numBuffers), data(data) {
+	for(size_t ii = 0; ii < numBuffers; ii++) {
+		buffers[ii].writer = this;
+		buffers[ii].data = &data[ii * SpiFlash::PAGE_SIZE];
+		buffers[ii].addr = 0;
+		buffers[ii].len = 0;
+		buffers[ii].state = BUFFER_FREE;
+	}
+	memset(&stats, 0, sizeof(stats));
+}
+
+SpiFlashImageWriter::~SpiFlashImageWriter() {
+
+}
+
+bool SpiFlashImageWriter::begin(size_t addr, size_t maxLen) {
+	if (active || (addr % SpiFlash::SECTOR_SIZE) != 0) {
+		return false;
+	}
+
+	eraseDone = false;
+	if (!flash.eraseRangeAsync(addr, maxLen, _eraseDone, this)) {
+		eraseDone = true;
+		return false;
+	}
+
+	for(size_t ii = 0; ii < numBuffers; ii++) {
+		buffers[ii].state = BUFFER_FREE;
+	}
+	fillIndex = 0;
+	imageAddr = nextAddr = addr;
+	eraseEnd = addr + maxLen;
+	remaining = maxLen;
+	length = 0;
+	crc = 0;
+	memset(&stats, 0, sizeof(stats));
+	active = true;
+	return true;
+}
+
+size_t SpiFlashImageWriter::write(const void *buf, size_t bufLen) {
+	const uint8_t *src = (const uint8_t *)buf;
+	size_t written = 0;
+
+	if (!active) {
+		return 0;
+	}
+	if (bufLen > remaining) {
+		bufLen = remaining;
+	}
+	crc = SpiFlashCrc32::update(crc, src, bufLen);
+
+	while(written < bufLen) {
+		Buffer *page = &buffers[fillIndex];
+
+		if (page->state == BUFFER_FREE) {
+			page->addr = nextAddr;
+			page->len = 0;
+			page->state = BUFFER_FILLING;
+		}
+		else
+		if (page->state != BUFFER_FILLING) {
+			// Every buffer is waiting for its erase or its program
+			fill();
+			delay(1);
+			stats.waitMs++;
+			continue;
+		}
+
+		size_t count = SpiFlash::PAGE_SIZE - page->len;
+		if (count > bufLen - written) {
+			count = bufLen - written;
+		}
+		memcpy(&page->data[page->len], &src[written], count);
+		page->len += count;
+		nextAddr += count;
+		written += count;
+
+		if (page->len == SpiFlash::PAGE_SIZE) {
+			page->state = BUFFER_PENDING;
+			fillIndex = (fillIndex + 1) % numBuffers;
+			stats.pagePrograms++;
+			fill();
+		}
+	}
+
+	remaining -= written;
+	length += written;
+	return written;
+}
+
+bool SpiFlashImageWriter::finish() {
+	if (!active) {
+		return false;
+	}
+
+	Buffer *page = &buffers[fillIndex];
+	if (page->state == BUFFER_FILLING) {
+		page->state = BUFFER_PENDING;
+		fillIndex = (fillIndex + 1) % numBuffers;
+		stats.pagePrograms++;
+	}
+	waitIdle();
+	active = false;
+
+	// The page buffers are all free now, so read back through all of them at once
+	unsigned long start = millis();
+	size_t chunkSize = numBuffers * SpiFlash::PAGE_SIZE;
+	uint32_t readCrc = 0;
+	for(size_t offset = 0; offset < length; offset += chunkSize) {
+		size_t count = (length - offset < chunkSize) ? (length - offset) : chunkSize;
+		readCrc = flash.readDataSyncCrc(imageAddr + offset, data, count, readCrc);
+	}
+	stats.verifyMs = millis() - start;
+
+	return readCrc == crc;
+}
+
+void SpiFlashImageWriter::abort() {
+	if (!active) {
+		return;
+	}
+
+	// Programs already queued can't be removed from the flash queue, so let them finish
+	ATOMIC_BLOCK() {
+		for(size_t ii = 0; ii < numBuffers; ii++) {
+			if (buffers[ii].state == BUFFER_FILLING || buffers[ii].state == BUFFER_PENDING) {
+				buffers[ii].state = BUFFER_FREE;
+			}
+		}
+	}
+	waitIdle();
+	active = false;
+}
+
+void SpiFlashImageWriter::fill() {
+	size_t erasedEnd = getErasedEnd();
+
+	// Oldest first, starting from the buffer that will be filled next. This can be called from both
+	// the application and the completion callbacks, so each buffer is claimed before it's queued.
+	for(size_t ii = 0; ii < numBuffers; ii++) {
+		Buffer *page = &buffers[(fillIndex + ii) % numBuffers];
+		bool claimed = false;
+
+		ATOMIC_BLOCK() {
+			if (page->state == BUFFER_PENDING && page->addr + page->len <= erasedEnd) {
+				page->state = BUFFER_PROGRAMMING;
+				claimed = true;
+			}
+		}
+		if (!claimed) {
+			continue;
+		}
+
+		if (!flash.writePageAsync(page->addr, page->data, page->len, _programDone, page)) {
+			// Queue is full; retried on the next completion or write()
+			page->state = BUFFER_PENDING;
+			break;
+		}
+	}
+}
+
+void SpiFlashImageWriter::waitIdle() {
+	while(true) {
+		fill();
+
+		bool idle = eraseDone;
+		for(size_t ii = 0; ii < numBuffers && idle; ii++) {
+			if (buffers[ii].state != BUFFER_FREE) {
+				idle = false;
+			}
+		}
+		if (idle) {
+			break;
+		}
+		delay(1);
+		stats.waitMs++;
+	}
+}
+
+size_t SpiFlashImageWriter::getErasedEnd() const {
+	if (eraseDone) {
+		return eraseEnd;
+	}
+
+	// Still this writer's range operation, since only one can be in progress
+	return flash.getRangeEraseQueued();
+}
+
+// [static]
+void SpiFlashImageWriter::_eraseDone(void *param) {
+	SpiFlashImageWriter *writer = (SpiFlashImageWriter *)param;
+
+	writer->eraseDone = true;
+	writer->fill();
+}
+
+// [static]
+void SpiFlashImageWriter::_programDone(void *param) {
+	Buffer *page = (Buffer *)param;
+
+	page->state = BUFFER_FREE;
+
+	// Keep the queue full while write() is waiting for a buffer or the application is downloading
+	page->writer->fill();
+}
@@ -0,0 +1,194 @@
+#ifndef __SPIFLASHIMAGE_H
+#define __SPIFLASHIMAGE_H
+
+#include "spiflash.h"
+
+/**
+ * Stages an image, such as a firmware update, into the flash as it arrives from the network
+ *
+ * begin() starts erasing the whole region with eraseRangeAsync(), which uses the largest erases
+ * the chip supports. write() copies each chunk into a ring of page buffers and keeps a running
+ * CRC-32 of the image. Each full page is queued with writePageAsync() as soon as the erase covering
+ * it has been queued. The flash queue runs in order, so the program runs right after that erase.
+ * The erases, the programs and the download of the next chunk all overlap. write() only blocks
+ * when every page buffer is still waiting to be programmed.
+ *
+ * finish() programs the last partial page and waits for the flash. It then reads the image back
+ * in one streaming pass, computing the CRC as it reads, and compares it with the CRC of the data
+ * that was written. To check against a CRC supplied with the image, compare it with getCrc().
+ *
+ * Use the SpiFlashImageWriterStatic template to allocate the buffers, for example:
+ *
+ * SpiFlash spiFlash(SPI, A2);
+ * SpiFlashImageWriterStatic<8> imageWriter(spiFlash);
+ *
+ * imageWriter.begin(IMAGE_ADDR, imageSize);
+ * // For each chunk received
+ * imageWriter.write(chunk, chunkLen);
+ * // After the last chunk
+ * if (imageWriter.finish() && imageWriter.getCrc() == expectedCrc) {
+ *     ...
+ * }
+ */
+class SpiFlashImageWriter {
+public:
+	/**
+	 * State of a page buffer in the ring
+	 */
+	enum BufferState {
+		BUFFER_FREE = 0,	//!< Available for the next page
+		BUFFER_FILLING,		//!< Receiving data from write()
+		BUFFER_PENDING,		//!< Complete, waiting for its erase to be queued or for room in the flash queue
+		BUFFER_PROGRAMMING	//!< Program queued or in progress
+	};
+
+	/**
+	 * One page buffer in the ring
+	 */
+	struct Buffer {
+		SpiFlashImageWriter *writer;	//!< The writer the buffer belongs to, for the program callback
+		uint8_t *data;					//!< PAGE_SIZE bytes
+		size_t addr;					//!< Flash address of the page
+		size_t len;						//!< Number of bytes of data
+		volatile uint8_t state;			//!< BufferState
+	};
+
+	/**
+	 * Usage counters, see getStats()
+	 */
+	struct Stats {
+		uint32_t pagePrograms;			//!< Pages of the image, including a partial last page
+		uint32_t waitMs;				//!< Milliseconds write() and finish() waited for page buffers and the flash
+		uint32_t verifyMs;				//!< Milliseconds the read back in finish() took
+	};
+
+	/**
+	 * Constructs the writer. You normally use SpiFlashImageWriterStatic instead.
+	 *
+	 * flash The flash chip to write to
+	 * buffers Array of numBuffers Buffer structures
+	 * numBuffers Number of page buffers, at least 2
+	 * data numBuffers * SpiFlash::PAGE_SIZE bytes of buffer memory
+	 */
+	SpiFlashImageWriter(SpiFlash &flash, Buffer *buffers, size_t numBuffers, uint8_t *data);
+	virtual ~SpiFlashImageWriter();
+
+	/**
+	 * Starts staging an image and starts erasing the region it goes in
+	 *
+	 * addr The address of the image. Must be at the start of a sector.
+	 * maxLen The size of the region to erase. Use the image size if it's known, since the whole
+	 * region is erased even if the image is shorter.
+	 *
+	 * Returns false if addr isn't at the start of a sector, an image is already being written, or
+	 * another range operation is in progress.
+	 */
+	bool begin(size_t addr, size_t maxLen);
+
+	/**
+	 * Adds the next chunk of the image
+	 *
+	 * buf The data. It's copied, so buf can be reused after this returns.
+	 * bufLen The number of bytes of data
+	 *
+	 * Returns the number of bytes accepted. This is bufLen unless begin() hasn't been called or
+	 * the data goes past maxLen.
+	 */
+	size_t write(const void *buf, size_t bufLen);
+
+	/**
+	 * Programs the rest of the image, waits for the erases and programs to finish, and reads the
+	 * image back
+	 *
+	 * Returns true if the CRC of the data read back matches getCrc(). The writer can be used for
+	 * another image after this returns.
+	 */
+	bool finish();
+
+	/**
+	 * Stops writing the image. Waits for the operations already queued to finish, including the
+	 * rest of the erase.
+	 */
+	void abort();
+
+	/**
+	 * Returns true between begin() and finish() or abort()
+	 */
+	bool isActive() const { return active; }
+
+	/**
+	 * Returns the CRC-32 of the data passed to write() so far (see SpiFlashCrc32)
+	 */
+	uint32_t getCrc() const { return crc; }
+
+	/**
+	 * Returns the number of bytes passed to write() so far
+	 */
+	size_t getLength() const { return length; }
+
+	/**
+	 * Returns the counters for the last image
+	 */
+	const Stats &getStats() const { return stats; }
+
+protected:
+	/**
+	 * Queues programs for the pending buffers, oldest first, whose erases have been queued
+	 */
+	void fill();
+
+	/**
+	 * Waits for all of the buffers to be programmed and the erase to finish
+	 */
+	void waitIdle();
+
+	/**
+	 * Returns the end of the region it's safe to queue programs for
+	 */
+	size_t getErasedEnd() const;
+
+	/**
+	 * Erase range completion callback; param is the SpiFlashImageWriter
+	 */
+	static void _eraseDone(void *param);
+
+	/**
+	 * Page program completion callback; param is the Buffer
+	 */
+	static void _programDone(void *param);
+
+	SpiFlash &flash;
+	Buffer *buffers;
+	size_t numBuffers;
+	uint8_t *data;
+	bool active = false;
+	volatile bool eraseDone = true;
+	size_t imageAddr = 0;
+	size_t eraseEnd = 0;
+	size_t nextAddr = 0;
+	size_t remaining = 0;
+	size_t fillIndex = 0;			// Buffer write() fills next; the oldest one that isn't free
+	size_t length = 0;
+	uint32_t crc = 0;
+	Stats stats;
+};
+
+/**
+ * Image writer with NUM_BUFFERS statically allocated page buffers
+ *
+ * Use enough buffers for a chunk from the network plus a few pages, so write() can return while
+ * the pages of the previous chunk are still being programmed.
+ */
+template<size_t NUM_BUFFERS>
+class SpiFlashImageWriterStatic : public SpiFlashImageWriter {
+public:
+	explicit SpiFlashImageWriterStatic(SpiFlash &flash) : SpiFlashImageWriter(flash, staticBuffers, NUM_BUFFERS, staticData) {}
+
+	static_assert(NUM_BUFFERS >= 2, "needs at least 2 page buffers");
+
+protected:
+	Buffer staticBuffers[NUM_BUFFERS];
+	uint8_t staticData[NUM_BUFFERS * SpiFlash::PAGE_SIZE];
+};
+
+#endif /* __SPIFLASHIMAGE_H */
@@ -0,0 +1,298 @@
+
+#include "Particle.h"
+
+#include "spiflashkv.h"
+
+SpiFlashKv::SpiFlashKv(SpiFlashLog &log, IndexEntry *entries, size_t numEntries) : log(log), entries(entries), numEntries(numEntries) {
+	for(size_t ii = 0; ii < numEntries; ii++) {
+		entries[ii].index = ENTRY_EMPTY;
+	}
+}
+
+SpiFlashKv::~SpiFlashKv() {
+
+}
+
+void SpiFlashKv::begin() {
+	for(size_t ii = 0; ii < numEntries; ii++) {
+		entries[ii].index = ENTRY_EMPTY;
+	}
+	count = 0;
+
+	// Replay the log from the oldest record, so the newest record for each key wins
+	SpiFlashLog::Position pos, recordPos;
+	log.getOldest(pos);
+	while(true) {
+		int len = log.readNext(pos, recordBuf, sizeof(recordBuf), &recordPos);
+		if (len < 0) {
+			break;
+		}
+		if ((size_t)len > sizeof(recordBuf) || (size_t)len < RECORD_KEY_OFFSET + recordBuf[1]) {
+			continue;
+		}
+
+		// findKey() overwrites recordBuf
+		uint8_t type = recordBuf[0];
+		size_t keyLen = recordBuf[1];
+		uint8_t key[MAX_KEY_SIZE];
+		if (keyLen == 0 || keyLen > MAX_KEY_SIZE) {
+			continue;
+		}
+		memcpy(key, &recordBuf[RECORD_KEY_OFFSET], keyLen);
+
+		uint32_t hash = hashKey(key, keyLen);
+		size_t freeSlot;
+		size_t slot = findKey(hash, key, keyLen, freeSlot);
+
+		if (type == RECORD_PUT) {
+			if (slot == numEntries) {
+				if (freeSlot == numEntries) {
+					// Index is too small for the log contents
+					continue;
+				}
+				slot = freeSlot;
+				count++;
+			}
+			entries[slot].hash = hash;
+			entries[slot].index = (uint16_t) recordPos.index;
+			entries[slot].offset = (uint16_t) recordPos.offset;
+		}
+		else
+		if (type == RECORD_REMOVE && slot != numEntries) {
+			entries[slot].index = ENTRY_DELETED;
+			count--;
+		}
+	}
+}
+
+bool SpiFlashKv::put(const char *key, const void *value, size_t valueLen) {
+	size_t keyLen = strlen(key);
+	if (keyLen == 0 || keyLen > MAX_KEY_SIZE || valueLen > MAX_VALUE_SIZE) {
+		return false;
+	}
+
+	uint32_t hash = hashKey((const uint8_t *)key, keyLen);
+	size_t freeSlot;
+	size_t slot = findKey(hash, (const uint8_t *)key, keyLen, freeSlot);
+	if (slot == numEntries && freeSlot == numEntries) {
+		return false;
+	}
+
+	// Compaction moves records, but not index entries, so slot stays valid
+	if (!ensureSpace()) {
+		return false;
+	}
+
+	recordBuf[0] = RECORD_PUT;
+	recordBuf[1] = (uint8_t) keyLen;
+	memcpy(&recordBuf[RECORD_KEY_OFFSET], key, keyLen);
+	memcpy(&recordBuf[RECORD_KEY_OFFSET + keyLen], value, valueLen);
+
+	SpiFlashLog::Position pos;
+	log.append(recordBuf, RECORD_KEY_OFFSET + keyLen + valueLen, &pos);
+
+	if (slot == numEntries) {
+		slot = freeSlot;
+		count++;
+	}
+	entries[slot].hash = hash;
+	entries[slot].index = (uint16_t) pos.index;
+	entries[slot].offset = (uint16_t) pos.offset;
+
+	return true;
+}
+
+int SpiFlashKv::get(const char *key, void *buf, size_t bufLen) {
+	size_t keyLen = strlen(key);
+	if (keyLen == 0 || keyLen > MAX_KEY_SIZE) {
+		return -1;
+	}
+
+	size_t freeSlot;
+	if (findKey(hashKey((const uint8_t *)key, keyLen), (const uint8_t *)key, keyLen, freeSlot) == numEntries) {
+		return -1;
+	}
+
+	size_t valueLen = recordLen - RECORD_KEY_OFFSET - keyLen;
+	if (bufLen > valueLen) {
+		bufLen = valueLen;
+	}
+	memcpy(buf, &recordBuf[RECORD_KEY_OFFSET + keyLen], bufLen);
+
+	return (int) valueLen;
+}
+
+bool SpiFlashKv::remove(const char *key) {
+	size_t keyLen = strlen(key);
+	if (keyLen == 0 || keyLen > MAX_KEY_SIZE) {
+		return false;
+	}
+
+	size_t freeSlot;
+	size_t slot = findKey(hashKey((const uint8_t *)key, keyLen), (const uint8_t *)key, keyLen, freeSlot);
+	if (slot == numEntries) {
+		return false;
+	}
+
+	if (!ensureSpace()) {
+		return false;
+	}
+
+	recordBuf[0] = RECORD_REMOVE;
+	recordBuf[1] = (uint8_t) keyLen;
+	memcpy(&recordBuf[RECORD_KEY_OFFSET], key, keyLen);
+
+	log.append(recordBuf, RECORD_KEY_OFFSET + keyLen);
+
+	entries[slot].index = ENTRY_DELETED;
+	count--;
+
+	return true;
+}
+
+// [static]
+uint32_t SpiFlashKv::hashKey(const uint8_t *key, size_t keyLen) {
+	uint32_t hash = 2166136261UL;
+
+	for(size_t ii = 0; ii < keyLen; ii++) {
+		hash ^= key[ii];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+size_t SpiFlashKv::findKey(uint32_t hash, const uint8_t *key, size_t keyLen, size_t &freeSlot) {
+	size_t slot = hash % numEntries;
+
+	freeSlot = numEntries;
+
+	for(size_t ii = 0; ii < numEntries; ii++) {
+		IndexEntry *entry = &entries[slot];
+
+		if (entry->index == ENTRY_EMPTY) {
+			if (freeSlot == numEntries) {
+				freeSlot = slot;
+			}
+			break;
+		}
+		if (entry->index == ENTRY_DELETED) {
+			if (freeSlot == numEntries) {
+				freeSlot = slot;
+			}
+		}
+		else
+		if (entry->hash == hash) {
+			// Only keys with the same hash are read from the flash
+			SpiFlashLog::Position pos;
+			pos.index = entry->index;
+			pos.offset = entry->offset;
+
+			int len = log.readNext(pos, recordBuf, sizeof(recordBuf));
+			if (len >= (int)(RECORD_KEY_OFFSET + keyLen) && (size_t)len <= sizeof(recordBuf) &&
+				recordBuf[1] == keyLen && memcmp(&recordBuf[RECORD_KEY_OFFSET], key, keyLen) == 0) {
+				recordLen = (size_t) len;
+				return slot;
+			}
+		}
+
+		slot = (slot + 1) % numEntries;
+	}
+
+	return numEntries;
+}
+
+SpiFlashKv::IndexEntry *SpiFlashKv::findPosition(uint32_t hash, const SpiFlashLog::Position &pos) {
+	size_t slot = hash % numEntries;
+
+	for(size_t ii = 0; ii < numEntries; ii++) {
+		IndexEntry *entry = &entries[slot];
+
+		if (entry->index == ENTRY_EMPTY) {
+			break;
+		}
+		if (entry->hash == hash && entry->index == pos.index && entry->offset == pos.offset) {
+			return entry;
+		}
+
+		slot = (slot + 1) % numEntries;
+	}
+
+	return NULL;
+}
+
+bool SpiFlashKv::ensureSpace() {
+	// Each compaction frees the oldest sector and at most refills one; stop when a full pass
+	// over the log doesn't free anything
+	for(size_t ii = 0; ii < log.getNumSectors() && log.getFreeSectors() <= COMPACT_FREE_SECTORS; ii++) {
+		compactOldest();
+	}
+	return log.getFreeSectors() >= MIN_FREE_SECTORS;
+}
+
+void SpiFlashKv::compactOldest() {
+	if (log.getUsedSectors() < 2 || log.getFreeSectors() < MIN_FREE_SECTORS) {
+		return;
+	}
+
+	SpiFlashLog::Position recordPos;
+	log.getOldest(recordPos);
+
+	// The sector is read a window at a time, rather than a record at a time
+	size_t offset = recordPos.offset;
+	size_t windowStart = offset, windowEnd = offset;
+	while(loadWindow(recordPos.index, offset, SpiFlashLog::RECORD_HEADER_SIZE, windowStart, windowEnd)) {
+		const uint8_t *header = &compactWindow[offset - windowStart];
+		size_t len = header[0] | (header[1] << 8);
+		if (len == 0xffff) {
+			// End of the records
+			break;
+		}
+
+		recordPos.offset = offset;
+		offset += SpiFlashLog::RECORD_HEADER_SIZE + len;
+		if (len < RECORD_KEY_OFFSET || len > MAX_KV_RECORD_SIZE ||
+			!loadWindow(recordPos.index, recordPos.offset, SpiFlashLog::RECORD_HEADER_SIZE + len, windowStart, windowEnd)) {
+			continue;
+		}
+
+		// Remove records can be dropped, since there's nothing older for them to hide
+		const uint8_t *record = &compactWindow[recordPos.offset - windowStart + SpiFlashLog::RECORD_HEADER_SIZE];
+		size_t keyLen = record[1];
+		if (record[0] != RECORD_PUT || len < RECORD_KEY_OFFSET + keyLen) {
+			continue;
+		}
+
+		IndexEntry *entry = findPosition(hashKey(&record[RECORD_KEY_OFFSET], keyLen), recordPos);
+		if (entry != NULL) {
+			SpiFlashLog::Position newPos;
+			log.append(record, len, &newPos);
+			entry->index = (uint16_t) newPos.index;
+			entry->offset = (uint16_t) newPos.offset;
+		}
+	}
+
+	log.discardOldest();
+}
+
+bool SpiFlashKv::loadWindow(size_t index, size_t offset, size_t len, size_t &windowStart, size_t &windowEnd) {
+	if (offset + len > SpiFlash::SECTOR_SIZE) {
+		return false;
+	}
+	if (offset >= windowStart && offset + len <= windowEnd) {
+		return true;
+	}
+
+	// Move the part of the record that's already been read to the start of the window
+	size_t kept = 0;
+	if (offset >= windowStart && offset < windowEnd) {
+		kept = windowEnd - offset;
+		memmove(compactWindow, &compactWindow[offset - windowStart], kept);
+	}
+
+	size_t readLen = log.readSector(index, offset + kept, &compactWindow[kept], sizeof(compactWindow) - kept);
+	windowStart = offset;
+	windowEnd = offset + kept + readLen;
+
+	return offset + len <= windowEnd;
+}
+
@@ -0,0 +1,196 @@
+#ifndef __SPIFLASHKV_H
+#define __SPIFLASHKV_H
+
+#include "spiflashlog.h"
+
+/**
+ * Key/value store kept in a SpiFlashLog, with a hash index in RAM
+ *
+ * Each put() or remove() appends one record to the log: a type byte, the key length, the key, and
+ * the value. The index is a fixed-size open addressing hash table that maps the hash of each key to
+ * the position of its newest record, so get() normally costs a single record read, and only keys with
+ * the same 32-bit hash need to be compared in the flash. A record of up to
+ * SpiFlashLog::READ_AHEAD_SIZE bytes is read in one flash transfer. begin() rebuilds the index by reading the
+ * whole log.
+ *
+ * When the log is close to full, the records in the oldest sector that are still current are appended
+ * to the head again and the oldest sector is discarded. The sector is read COMPACT_WINDOW_SIZE bytes
+ * at a time, each in one streaming read, and its records are walked in RAM. The copies go through the
+ * log's page buffers, so they're programmed a full page at a time. The log should only be used by this object, and must have
+ * at least 4 sectors. The total size of the current records must stay below about
+ * (numSectors - 4) sectors, otherwise put() will start to fail.
+ *
+ * Use the SpiFlashKvStatic template to allocate the index, for example:
+ *
+ * SpiFlash spiFlash(SPI, A2);
+ * SpiFlashLog kvLog(spiFlash, 0, 64);
+ * SpiFlashKvStatic<2048> kv(kvLog);
+ */
+class SpiFlashKv {
+public:
+	/**
+	 * An entry in the hash index
+	 */
+	struct IndexEntry {
+		uint32_t hash;					//!< Hash of the key
+		uint16_t index;					//!< Log sector index of the record, or ENTRY_EMPTY or ENTRY_DELETED
+		uint16_t offset;				//!< Offset of the record within the sector
+	};
+
+	/**
+	 * Constructs the store. You normally use SpiFlashKvStatic instead.
+	 *
+	 * log The log to store records in
+	 * entries Array of index entries
+	 * numEntries Number of entries in entries. This is the maximum number of keys; lookups stay fast
+	 * as long as no more than about 3/4 of the entries are used.
+	 */
+	SpiFlashKv(SpiFlashLog &log, IndexEntry *entries, size_t numEntries);
+	virtual ~SpiFlashKv();
+
+	/**
+	 * Rebuilds the index by reading all of the records in the log. Call after log.begin().
+	 */
+	void begin();
+
+	/**
+	 * Stores a value, replacing the previous value of the key, if any
+	 *
+	 * key The key, a c-string of 1 to MAX_KEY_SIZE characters
+	 * value The value to store
+	 * valueLen The number of bytes of value, 0 <= valueLen <= MAX_VALUE_SIZE
+	 *
+	 * Returns false if the arguments are out of range, the index is full, or there is no
+	 * room left in the log.
+	 *
+	 * The record may stay in a RAM page buffer; call flush() on the log to make sure it's stored in the flash.
+	 */
+	bool put(const char *key, const void *value, size_t valueLen);
+
+	/**
+	 * Gets the value of a key
+	 *
+	 * key The key to look up
+	 * buf Buffer to store the value in. If the value is larger than bufLen, it's truncated.
+	 * bufLen Size of buf
+	 *
+	 * Returns the length of the value, or -1 if the key is not found.
+	 */
+	int get(const char *key, void *buf, size_t bufLen);
+
+	/**
+	 * Removes a key
+	 *
+	 * Returns false if the key was not found or there is no room left in the log.
+	 */
+	bool remove(const char *key);
+
+	/**
+	 * Returns the number of keys stored
+	 */
+	size_t getCount() const { return count; }
+
+	/**
+	 * Returns the number of index entries, the maximum number of keys
+	 */
+	size_t getIndexSize() const { return numEntries; }
+
+	static const size_t MAX_KEY_SIZE = 32;
+
+	static const size_t MAX_VALUE_SIZE = 256;
+
+	static const uint16_t ENTRY_EMPTY = 0xffff;
+
+	static const uint16_t ENTRY_DELETED = 0xfffe;
+
+	// Values of the type byte at the start of each record
+	static const uint8_t RECORD_PUT = 0x01;
+	static const uint8_t RECORD_REMOVE = 0x02;
+
+	// Offset of the key in a record, after the type and key length bytes
+	static const size_t RECORD_KEY_OFFSET = 2;
+
+	static const size_t MAX_KV_RECORD_SIZE = RECORD_KEY_OFFSET + MAX_KEY_SIZE + MAX_VALUE_SIZE;
+
+	// Bytes of the oldest sector compaction reads at once. A quarter of a sector, and more than the
+	// largest record.
+	static const size_t COMPACT_WINDOW_SIZE = SpiFlash::SECTOR_SIZE / 4;
+
+protected:
+	/**
+	 * Returns the FNV-1a hash of a key
+	 */
+	static uint32_t hashKey(const uint8_t *key, size_t keyLen);
+
+	/**
+	 * Finds the index entry for a key, reading candidate records into recordBuf
+	 *
+	 * freeSlot Set to the first empty or deleted entry in the probe sequence, or numEntries if there
+	 * is none
+	 *
+	 * Returns the index of the entry, or numEntries if the key is not in the index. If found, recordBuf
+	 * holds the record and recordLen its length.
+	 */
+	size_t findKey(uint32_t hash, const uint8_t *key, size_t keyLen, size_t &freeSlot);
+
+	/**
+	 * Finds the index entry that points to the record at pos, or returns NULL if the record is not
+	 * the current one for its key
+	 */
+	IndexEntry *findPosition(uint32_t hash, const SpiFlashLog::Position &pos);
+
+	/**
+	 * Compacts the log if it's close to full
+	 *
+	 * Returns false if there is no room in the log for another record.
+	 */
+	bool ensureSpace();
+
+	/**
+	 * Copies the current records in the oldest log sector to the head, then discards the sector
+	 */
+	void compactOldest();
+
+	/**
+	 * Makes sure len bytes of a sector starting at offset are in compactWindow, keeping any that are
+	 * there already and filling the rest of the window from the flash
+	 *
+	 * index The log sector index
+	 * windowStart Sector offset of compactWindow[0], updated if the window moves
+	 * windowEnd Sector offset just past the last byte in the window, updated if the window moves
+	 *
+	 * Returns false if the bytes go past the end of the sector.
+	 */
+	bool loadWindow(size_t index, size_t offset, size_t len, size_t &windowStart, size_t &windowEnd);
+
+	// Compaction starts when the log has this many free sectors left
+	static const size_t COMPACT_FREE_SECTORS = 3;
+
+	// Neither compaction nor appending more than a sector is safe with fewer free sectors than
+	// this, because moving to a new sector would discard the oldest one
+	static const size_t MIN_FREE_SECTORS = 2;
+
+	SpiFlashLog &log;
+	IndexEntry *entries;
+	size_t numEntries;
+	size_t count = 0;
+	size_t recordLen = 0;
+	uint8_t recordBuf[MAX_KV_RECORD_SIZE];
+	uint8_t compactWindow[COMPACT_WINDOW_SIZE];
+};
+
+/**
+ * Key/value store with a statically allocated index of NUM_ENTRIES entries
+ *
+ * Each entry uses 8 bytes of RAM.
+ */
+template<size_t NUM_ENTRIES>
+class SpiFlashKvStatic : public SpiFlashKv {
+public:
+	explicit SpiFlashKvStatic(SpiFlashLog &log) : SpiFlashKv(log, staticEntries, NUM_ENTRIES) {}
+
+protected:
+	IndexEntry staticEntries[NUM_ENTRIES];
+};
+
+#endif /* __SPIFLASHKV_H */
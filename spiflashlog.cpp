@@ -0,0 +1,355 @@
+
+#include "Particle.h"
+
+#include "spiflashlog.h"
+
+// Sector header, stored at the start of each log sector
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t seqInverted;	// ~seq, so a header that was partially programmed isn't valid
+} LogSectorHeader;
+
+SpiFlashLog::SpiFlashLog(SpiFlash &flash, size_t firstSector, size_t numSectors) : flash(flash), firstSector(firstSector), numSectors(numSectors) {
+	for(size_t ii = 0; ii < 2; ii++) {
+		pageBuffers[ii].addr = (size_t)-1;
+		pageBuffers[ii].dirtyStart = pageBuffers[ii].dirtyEnd = 0;
+		pageBuffers[ii].busy = false;
+	}
+	curPage = &pageBuffers[0];
+}
+
+SpiFlashLog::~SpiFlashLog() {
+
+}
+
+void SpiFlashLog::begin() {
+	bool found = false;
+	uint32_t minSeq = 0, maxSeq = 0;
+
+	// Only the headers are read, so this is O(numSectors)
+	for(size_t index = 0; index < numSectors; index++) {
+		LogSectorHeader hdr;
+		readSync(sectorAddr(index), &hdr, sizeof(hdr));
+
+		if (hdr.magic != SECTOR_MAGIC || hdr.seq != ~hdr.seqInverted) {
+			continue;
+		}
+		if (!found || (int32_t)(hdr.seq - maxSeq) > 0) {
+			maxSeq = hdr.seq;
+			headIndex = index;
+		}
+		if (!found || (int32_t)(hdr.seq - minSeq) < 0) {
+			minSeq = hdr.seq;
+			tailIndex = index;
+		}
+		found = true;
+	}
+
+	if (!found) {
+		startLog(0, 0);
+		return;
+	}
+	headSeq = maxSeq;
+
+	// Walk the records in the head sector to find the append position
+	writeOffset = HEADER_SIZE;
+	while(writeOffset + RECORD_HEADER_SIZE <= SpiFlash::SECTOR_SIZE) {
+		uint8_t lenBuf[RECORD_HEADER_SIZE];
+		readSync(sectorAddr(headIndex) + writeOffset, lenBuf, sizeof(lenBuf));
+
+		size_t len = lenBuf[0] | (lenBuf[1] << 8);
+		if (len == 0xffff) {
+			break;
+		}
+		writeOffset += RECORD_HEADER_SIZE + len;
+	}
+	if (writeOffset > SpiFlash::SECTOR_SIZE) {
+		// Length was corrupted by a reset during programming; start over in the next sector
+		writeOffset = SpiFlash::SECTOR_SIZE;
+	}
+
+	// The sector after the head may have been partially erased when the reset occurred
+	eraseAhead();
+}
+
+void SpiFlashLog::format() {
+	flush();
+	while(eraseBusy) {
+		delay(1);
+	}
+
+	flash.eraseRange(sectorAddr(0), numSectors * SpiFlash::SECTOR_SIZE);
+	startLog(0, headSeq + 1, true);
+}
+
+void SpiFlashLog::startLog(size_t index, uint32_t seq, bool erased) {
+	headIndex = tailIndex = index;
+	headSeq = seq;
+
+	if (!erased) {
+		flash.sectorErase(sectorAddr(headIndex));
+	}
+
+	LogSectorHeader hdr;
+	hdr.magic = SECTOR_MAGIC;
+	hdr.seq = headSeq;
+	hdr.seqInverted = ~headSeq;
+
+	writeOffset = 0;
+	curPage->addr = (size_t)-1;
+	appendBytes((const uint8_t *)&hdr, sizeof(hdr));
+
+	if (!erased) {
+		eraseAhead();
+	}
+}
+
+bool SpiFlashLog::append(const void *buf, size_t bufLen, Position *pos) {
+	if (bufLen == 0 || bufLen > MAX_RECORD_SIZE) {
+		return false;
+	}
+
+	if (writeOffset + RECORD_HEADER_SIZE + bufLen > SpiFlash::SECTOR_SIZE) {
+		advanceSector();
+	}
+
+	if (pos != NULL) {
+		pos->index = headIndex;
+		pos->offset = writeOffset;
+	}
+
+	uint8_t lenBuf[RECORD_HEADER_SIZE];
+	lenBuf[0] = (uint8_t) bufLen;
+	lenBuf[1] = (uint8_t) (bufLen >> 8);
+
+	appendBytes(lenBuf, sizeof(lenBuf));
+	appendBytes((const uint8_t *)buf, bufLen);
+
+	return true;
+}
+
+void SpiFlashLog::flush() {
+	programCurrent();
+
+	for(size_t ii = 0; ii < 2; ii++) {
+		while(pageBuffers[ii].busy) {
+			// Programs can be queued behind the background erase
+			delay(1);
+		}
+	}
+}
+
+void SpiFlashLog::getOldest(Position &pos) const {
+	pos.index = tailIndex;
+	pos.offset = HEADER_SIZE;
+}
+
+int SpiFlashLog::readNext(Position &pos, void *buf, size_t bufLen, Position *recordPos) {
+	while(true) {
+		if (pos.offset + RECORD_HEADER_SIZE <= SpiFlash::SECTOR_SIZE) {
+			// The start of the record comes with the length; bytes past the end of the record or the
+			// written data are read but not used
+			uint8_t headBuf[RECORD_HEADER_SIZE + READ_AHEAD_SIZE];
+			size_t headLen = SpiFlash::SECTOR_SIZE - pos.offset;
+			if (headLen > sizeof(headBuf)) {
+				headLen = sizeof(headBuf);
+			}
+			readSync(sectorAddr(pos.index) + pos.offset, headBuf, headLen);
+
+			size_t len = headBuf[0] | (headBuf[1] << 8);
+			if (len != 0xffff) {
+				if (bufLen > len) {
+					bufLen = len;
+				}
+				size_t count = headLen - RECORD_HEADER_SIZE;
+				if (count > bufLen) {
+					count = bufLen;
+				}
+				memcpy(buf, &headBuf[RECORD_HEADER_SIZE], count);
+				if (count < bufLen) {
+					readSync(sectorAddr(pos.index) + pos.offset + RECORD_HEADER_SIZE + count, (uint8_t *)buf + count, bufLen - count);
+				}
+
+				if (recordPos != NULL) {
+					*recordPos = pos;
+				}
+				pos.offset += RECORD_HEADER_SIZE + len;
+				return (int) len;
+			}
+		}
+
+		// End of the sector
+		if (pos.index == headIndex) {
+			return -1;
+		}
+		pos.index = (pos.index + 1) % numSectors;
+		pos.offset = HEADER_SIZE;
+	}
+}
+
+size_t SpiFlashLog::readSector(size_t index, size_t offset, void *buf, size_t bufLen) {
+	if (index >= numSectors || offset >= SpiFlash::SECTOR_SIZE) {
+		return 0;
+	}
+	if (bufLen > SpiFlash::SECTOR_SIZE - offset) {
+		bufLen = SpiFlash::SECTOR_SIZE - offset;
+	}
+	readSync(sectorAddr(index) + offset, buf, bufLen);
+	return bufLen;
+}
+
+void SpiFlashLog::discardOldest() {
+	if (tailIndex == headIndex) {
+		return;
+	}
+
+	// Programming zeros over the magic only clears bits, so no erase is needed
+	static const uint8_t zeros[4] = { 0, 0, 0, 0 };
+	volatile bool busy = true;
+
+	while(!flash.writePageAsync(sectorAddr(tailIndex), zeros, sizeof(zeros), _clearFlag, (void *)&busy)) {
+		delay(1);
+	}
+	while(busy) {
+		// Can be queued behind the background erase
+		delay(1);
+	}
+
+	tailIndex = (tailIndex + 1) % numSectors;
+}
+
+void SpiFlashLog::advanceSector() {
+	programCurrent();
+
+	// The next sector was erased in the background when this one was started
+	while(eraseBusy) {
+		delay(1);
+	}
+
+	headIndex = (headIndex + 1) % numSectors;
+	headSeq++;
+
+	LogSectorHeader hdr;
+	hdr.magic = SECTOR_MAGIC;
+	hdr.seq = headSeq;
+	hdr.seqInverted = ~headSeq;
+
+	writeOffset = 0;
+	appendBytes((const uint8_t *)&hdr, sizeof(hdr));
+
+	eraseAhead();
+}
+
+void SpiFlashLog::eraseAhead() {
+	size_t index = (headIndex + 1) % numSectors;
+
+	// The oldest sector is discarded
+	if (tailIndex == index && index != headIndex) {
+		tailIndex = (index + 1) % numSectors;
+	}
+
+	eraseBusy = true;
+	while(!flash.sectorEraseAsync(sectorAddr(index), _clearFlag, (void *)&eraseBusy)) {
+		delay(1);
+	}
+}
+
+void SpiFlashLog::appendBytes(const uint8_t *buf, size_t bufLen) {
+	while(bufLen > 0) {
+		size_t addr = sectorAddr(headIndex) + writeOffset;
+		size_t pageOffset = addr % SpiFlash::PAGE_SIZE;
+		size_t pageStart = addr - pageOffset;
+
+		if (curPage->addr != pageStart) {
+			// Switch to the other buffer so the previous page can be programmed in the background
+			programCurrent();
+			curPage = (curPage == &pageBuffers[0]) ? &pageBuffers[1] : &pageBuffers[0];
+			while(curPage->busy) {
+				delay(1);
+			}
+			memset(curPage->data, 0xff, sizeof(curPage->data));
+			curPage->addr = pageStart;
+			curPage->dirtyStart = curPage->dirtyEnd = pageOffset;
+		}
+
+		size_t count = SpiFlash::PAGE_SIZE - pageOffset;
+		if (count > bufLen) {
+			count = bufLen;
+		}
+		memcpy(&curPage->data[pageOffset], buf, count);
+		curPage->dirtyEnd = pageOffset + count;
+
+		writeOffset += count;
+		buf += count;
+		bufLen -= count;
+
+		if (curPage->dirtyEnd == SpiFlash::PAGE_SIZE) {
+			programCurrent();
+		}
+	}
+}
+
+void SpiFlashLog::programCurrent() {
+	if (curPage->dirtyEnd <= curPage->dirtyStart) {
+		return;
+	}
+
+	// A page that was partially programmed by flush() is programmed again with only the new bytes
+	while(curPage->busy) {
+		delay(1);
+	}
+	curPage->busy = true;
+
+	size_t offset = curPage->dirtyStart;
+	while(!flash.writePageAsync(curPage->addr + offset, &curPage->data[offset], curPage->dirtyEnd - offset, _clearFlag, (void *)&curPage->busy)) {
+		delay(1);
+	}
+	curPage->dirtyStart = curPage->dirtyEnd;
+}
+
+void SpiFlashLog::readSync(size_t addr, void *buf, size_t bufLen) {
+	uint8_t *bytes = (uint8_t *)buf;
+	volatile bool busy = true;
+
+	// Determine which buffers to apply before reading; a program that completes after this
+	// point leaves the same bytes in the flash, and applying them again is harmless
+	bool pending[2];
+	for(size_t ii = 0; ii < 2; ii++) {
+		pending[ii] = pageBuffers[ii].busy || pageBuffers[ii].dirtyStart < pageBuffers[ii].dirtyEnd;
+	}
+
+	while(!flash.readDataPriorityAsync(addr, buf, bufLen, _clearFlag, (void *)&busy)) {
+		delay(1);
+	}
+	while(busy) {
+		// Normally only waits for the transfer, or for the erase in progress to be suspended
+		SPIFLASH_BUSY_WAIT();
+	}
+
+	for(size_t ii = 0; ii < 2; ii++) {
+		PageBuffer *page = &pageBuffers[ii];
+		if (!pending[ii]) {
+			continue;
+		}
+
+		// Unwritten bytes in the buffer are 0xFF, so AND works for the whole page
+		size_t start = page->addr;
+		size_t end = page->addr + page->dirtyEnd;
+		if (start < addr) {
+			start = addr;
+		}
+		if (end > addr + bufLen) {
+			end = addr + bufLen;
+		}
+		for(size_t cur = start; cur < end; cur++) {
+			bytes[cur - addr] &= page->data[cur - page->addr];
+		}
+	}
+}
+
+// [static]
+void SpiFlashLog::_clearFlag(void *param) {
+	*(volatile bool *)param = false;
+}
+
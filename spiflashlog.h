@@ -0,0 +1,219 @@
+#ifndef __SPIFLASHLOG_H
+#define __SPIFLASHLOG_H
+
+#include "spiflash.h"
+
+/**
+ * Append-only circular log of records stored in 4K flash sectors
+ *
+ * Each sector starts with a header containing a sequence number, followed by records. A record is a
+ * 2-byte little endian length followed by the data. Records don't span sectors; if a record does not
+ * fit in the rest of the sector, the log moves on to the next sector. The unused space at the end of
+ * a sector reads as 0xFF, which is not a valid length.
+ *
+ * Appends are gathered in RAM page buffers so the flash is programmed a full page at a time. The sector
+ * after the one being written is erased in the background using the async erase, so moving to the next
+ * sector normally doesn't wait for an erase. Because of this, the oldest sector is discarded one sector
+ * before the log wraps around, and the capacity is (numSectors - 1) sectors.
+ *
+ * begin() recovers the state after a reset by reading only the sector headers, plus the records of the
+ * sector being written to find the append position.
+ *
+ * All flash access goes through the SpiFlash async queue; reads use readDataPriorityAsync() so they don't
+ * wait for a background erase. Don't use the synchronous SpiFlash functions on the same chip while the
+ * log is in use.
+ */
+class SpiFlashLog {
+public:
+	/**
+	 * Position of a record in the log, used for reading
+	 */
+	struct Position {
+		size_t index;			//!< Index of the sector, 0 <= index < numSectors
+		size_t offset;			//!< Offset of the record within the sector
+	};
+
+	/**
+	 * Constructs the log object
+	 *
+	 * flash The flash chip
+	 * firstSector Sector number of the first sector used by the log
+	 * numSectors Number of sectors used by the log, must be at least 2
+	 */
+	SpiFlashLog(SpiFlash &flash, size_t firstSector = 0, size_t numSectors = SpiFlash::NUM_SECTORS);
+	virtual ~SpiFlashLog();
+
+	/**
+	 * Finds the oldest and newest sectors and the append position. If there is no valid log, starts a
+	 * new one. Call after flash.begin(), probably from setup().
+	 */
+	void begin();
+
+	/**
+	 * Erases all of the log sectors and starts a new, empty log
+	 */
+	void format();
+
+	/**
+	 * Appends a record. The data is copied, so buf can be reused after this returns.
+	 *
+	 * The record may stay in a RAM page buffer until the page fills; use flush() to make sure it's
+	 * stored in the flash. readNext() sees buffered records either way.
+	 *
+	 * buf The record data
+	 * bufLen The number of bytes, 1 <= bufLen <= MAX_RECORD_SIZE
+	 * pos If not NULL, filled in with the position of the new record
+	 *
+	 * Returns false if bufLen is out of range.
+	 */
+	bool append(const void *buf, size_t bufLen, Position *pos = NULL);
+
+	/**
+	 * Programs any buffered records and waits for the page programs to complete
+	 */
+	void flush();
+
+	/**
+	 * Gets the position of the oldest record in the log
+	 */
+	void getOldest(Position &pos) const;
+
+	/**
+	 * Reads the record at pos and advances pos to the next record
+	 *
+	 * pos Position to read from, typically initialized using getOldest()
+	 * buf Buffer to store the record in. If the record is larger than bufLen, it's truncated.
+	 * bufLen Size of buf
+	 * recordPos If not NULL, filled in with the position of the record that was read. This differs
+	 * from pos on entry if pos was at the end of a sector.
+	 *
+	 * The length and the first READ_AHEAD_SIZE bytes of the record are read in one transfer, so a short
+	 * record costs one flash read and a longer one two.
+	 *
+	 * Returns the length of the record, or -1 if there are no more records.
+	 */
+	int readNext(Position &pos, void *buf, size_t bufLen, Position *recordPos = NULL);
+
+	/**
+	 * Reads the raw bytes of a sector in one transfer, for walking many records in RAM. Each record
+	 * is a 2-byte little endian length followed by the data, starting at HEADER_SIZE; a length of
+	 * 0xFFFF marks the end of the records in the sector.
+	 *
+	 * index Index of the sector, 0 <= index < getNumSectors()
+	 * offset Offset within the sector to read from
+	 * buf Buffer to store the data in
+	 * bufLen Number of bytes to read. Reads stop at the end of the sector.
+	 *
+	 * Returns the number of bytes read.
+	 */
+	size_t readSector(size_t index, size_t offset, void *buf, size_t bufLen);
+
+	/**
+	 * Discards the oldest sector, making room without waiting for the log to wrap around. Its header
+	 * is invalidated so begin() won't find it again. Does nothing if the head is the only sector.
+	 *
+	 * Used to reclaim a sector after copying the records that are still needed to the head.
+	 */
+	void discardOldest();
+
+	/**
+	 * Returns the number of sectors holding records, including the sector being written
+	 */
+	size_t getUsedSectors() const { return (headIndex + numSectors - tailIndex) % numSectors + 1; }
+
+	/**
+	 * Returns the number of sectors not holding records. When this reaches 1, moving to the next sector
+	 * discards the oldest one.
+	 */
+	size_t getFreeSectors() const { return numSectors - getUsedSectors(); }
+
+	/**
+	 * Returns the number of sectors used by the log
+	 */
+	size_t getNumSectors() const { return numSectors; }
+
+	/**
+	 * Returns the sequence number of the sector being written
+	 */
+	uint32_t getSequence() const { return headSeq; }
+
+	static const uint32_t SECTOR_MAGIC = 0x31474f4c; // "LOG1" little endian
+
+	static const size_t HEADER_SIZE = 12;
+
+	static const size_t RECORD_HEADER_SIZE = 2;
+
+	static const size_t MAX_RECORD_SIZE = SpiFlash::SECTOR_SIZE - HEADER_SIZE - RECORD_HEADER_SIZE;
+
+	static const size_t READ_AHEAD_SIZE = 62;
+
+protected:
+	/**
+	 * RAM buffer for one flash page
+	 */
+	struct PageBuffer {
+		size_t addr;					//!< Address of the start of the page
+		uint16_t dirtyStart;			//!< Offset of the first byte not yet programmed
+		uint16_t dirtyEnd;				//!< Offset after the last byte appended
+		volatile bool busy;				//!< True while the page is being programmed
+		uint8_t data[SpiFlash::PAGE_SIZE];
+	};
+
+	/**
+	 * Returns the address of a log sector
+	 */
+	size_t sectorAddr(size_t index) const { return (firstSector + index) * SpiFlash::SECTOR_SIZE; }
+
+	/**
+	 * Starts a new log in sector index with sequence number seq
+	 *
+	 * erased true if every log sector is already erased, so neither sector index nor the one after
+	 * it needs to be erased again
+	 */
+	void startLog(size_t index, uint32_t seq, bool erased = false);
+
+	/**
+	 * Moves the write position to the start of the next sector and writes its header
+	 */
+	void advanceSector();
+
+	/**
+	 * Starts the background erase of the sector after the head
+	 */
+	void eraseAhead();
+
+	/**
+	 * Copies bytes to the page buffers at the write position, programming pages as they fill
+	 */
+	void appendBytes(const uint8_t *buf, size_t bufLen);
+
+	/**
+	 * Queues a program of the bytes in the current page buffer that haven't been programmed yet
+	 */
+	void programCurrent();
+
+	/**
+	 * Reads from the flash ahead of anything queued and waits for the read to complete. Bytes in the
+	 * page buffers that may not have been programmed yet are applied to the result.
+	 */
+	void readSync(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * Completion callback for readSync(), discardOldest() and eraseAhead(); param points to a volatile
+	 * bool to clear
+	 */
+	static void _clearFlag(void *param);
+
+	SpiFlash &flash;
+	size_t firstSector;
+	size_t numSectors;
+	size_t headIndex = 0;
+	size_t tailIndex = 0;
+	uint32_t headSeq = 0;
+	size_t writeOffset = 0;
+	volatile bool eraseBusy = false;
+	PageBuffer pageBuffers[2];
+	PageBuffer *curPage = NULL;
+};
+
+#endif /* __SPIFLASHLOG_H */
@@ -0,0 +1,171 @@
+
+#include "Particle.h"
+
+#include "spiflashlz.h"
+
+size_t SpiFlashLz::compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstMax) {
+	size_t dstPos = 0;
+	size_t anchor = 0;
+	size_t pos = 0;
+
+	if (srcLen > MAX_OFFSET) {
+		return 0;
+	}
+	memset(hashTable, 0, sizeof(hashTable));
+
+	if (srcLen > MFLIMIT) {
+		size_t matchLimit = srcLen - LAST_LITERALS;
+
+		while(pos < srcLen - MFLIMIT) {
+			uint32_t h = hash(&src[pos]);
+			size_t ref = hashTable[h];
+			hashTable[h] = (uint16_t) (pos + 1);
+
+			if (ref == 0 || memcmp(&src[ref - 1], &src[pos], MIN_MATCH) != 0) {
+				pos++;
+				continue;
+			}
+			ref--;
+
+			size_t matchLen = MIN_MATCH;
+			while(pos + matchLen < matchLimit && src[ref + matchLen] == src[pos + matchLen]) {
+				matchLen++;
+			}
+
+			if (!putSequence(&src[anchor], pos - anchor, pos - ref, matchLen, dst, dstPos, dstMax)) {
+				return 0;
+			}
+			pos += matchLen;
+			anchor = pos;
+		}
+	}
+
+	if (!putSequence(&src[anchor], srcLen - anchor, 0, 0, dst, dstPos, dstMax)) {
+		return 0;
+	}
+	return dstPos;
+}
+
+// [static]
+int SpiFlashLz::decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstMax) {
+	size_t srcPos = 0;
+	size_t dstPos = 0;
+
+	while(srcPos < srcLen) {
+		uint8_t token = src[srcPos++];
+
+		size_t litLen = token >> 4;
+		if (litLen == 15 && !getLength(src, srcLen, srcPos, litLen)) {
+			return -1;
+		}
+		if (litLen > srcLen - srcPos || litLen > dstMax - dstPos) {
+			return -1;
+		}
+		memcpy(&dst[dstPos], &src[srcPos], litLen);
+		srcPos += litLen;
+		dstPos += litLen;
+
+		if (srcPos == srcLen) {
+			// The last sequence has no match
+			break;
+		}
+
+		if (srcLen - srcPos < 2) {
+			return -1;
+		}
+		size_t offset = src[srcPos] | (src[srcPos + 1] << 8);
+		srcPos += 2;
+		if (offset == 0 || offset > dstPos) {
+			return -1;
+		}
+
+		size_t matchLen = token & 0x0f;
+		if (matchLen == 15 && !getLength(src, srcLen, srcPos, matchLen)) {
+			return -1;
+		}
+		matchLen += MIN_MATCH;
+		if (matchLen > dstMax - dstPos) {
+			return -1;
+		}
+
+		// Byte at a time, since the match can overlap the bytes it produces
+		for(size_t ii = 0; ii < matchLen; ii++) {
+			dst[dstPos] = dst[dstPos - offset];
+			dstPos++;
+		}
+	}
+	return (int) dstPos;
+}
+
+// [static]
+bool SpiFlashLz::putSequence(const uint8_t *lits, size_t litLen, size_t offset, size_t matchLen, uint8_t *dst, size_t &dstPos, size_t dstMax) {
+	if (dstPos >= dstMax) {
+		return false;
+	}
+
+	size_t matchCode = (matchLen != 0) ? (matchLen - MIN_MATCH) : 0;
+	uint8_t &token = dst[dstPos++];
+	token = (uint8_t) (((litLen < 15) ? litLen : 15) << 4 | ((matchCode < 15) ? matchCode : 15));
+
+	if (litLen >= 15 && !putLength(litLen - 15, dst, dstPos, dstMax)) {
+		return false;
+	}
+	if (litLen > dstMax - dstPos) {
+		return false;
+	}
+	memcpy(&dst[dstPos], lits, litLen);
+	dstPos += litLen;
+
+	if (matchLen == 0) {
+		return true;
+	}
+
+	if (dstMax - dstPos < 2) {
+		return false;
+	}
+	dst[dstPos++] = (uint8_t) offset;
+	dst[dstPos++] = (uint8_t) (offset >> 8);
+
+	if (matchCode >= 15 && !putLength(matchCode - 15, dst, dstPos, dstMax)) {
+		return false;
+	}
+	return true;
+}
+
+// [static]
+bool SpiFlashLz::putLength(size_t len, uint8_t *dst, size_t &dstPos, size_t dstMax) {
+	while(true) {
+		if (dstPos >= dstMax) {
+			return false;
+		}
+		if (len < 255) {
+			dst[dstPos++] = (uint8_t) len;
+			return true;
+		}
+		dst[dstPos++] = 255;
+		len -= 255;
+	}
+}
+
+// [static]
+bool SpiFlashLz::getLength(const uint8_t *src, size_t srcLen, size_t &srcPos, size_t &len) {
+	uint8_t value;
+
+	do {
+		if (srcPos >= srcLen) {
+			return false;
+		}
+		value = src[srcPos++];
+		len += value;
+	} while(value == 255);
+
+	return true;
+}
+
+// [static]
+uint32_t SpiFlashLz::hash(const uint8_t *p) {
+	uint32_t value = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+
+	// Knuth's multiplicative hash, keeping the top bits
+	return ((uint32_t) (value * 2654435761UL)) >> (32 - HASH_BITS);
+}
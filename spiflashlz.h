@@ -0,0 +1,86 @@
+#ifndef __SPIFLASHLZ_H
+#define __SPIFLASHLZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Small LZ77 codec for data stored in the flash, producing the LZ4 block format
+ *
+ * The encoder is greedy with a 4-byte hash table of HASH_SIZE entries, so it's fast and needs no
+ * allocation: the table is a member, and the object is normally allocated statically. Offsets are
+ * limited to MAX_OFFSET, so compress at most that many bytes at a time; independent blocks of a
+ * few K are the intended use. Output follows the LZ4 rules for the end of a block, so blocks can
+ * also be decoded off the device with standard LZ4 tools.
+ *
+ * Decoding needs no state and checks every length and offset against the buffers, so corrupted
+ * or truncated input is reported instead of overrunning.
+ */
+class SpiFlashLz {
+public:
+	SpiFlashLz() {}
+
+	/**
+	 * Compresses src into dst
+	 *
+	 * src Data to compress, at most MAX_OFFSET bytes
+	 * srcLen Number of bytes of data
+	 * dst Buffer for the compressed data
+	 * dstMax Size of dst
+	 *
+	 * Returns the compressed length, or 0 if it wouldn't fit in dstMax bytes. Pass dstMax smaller
+	 * than srcLen to only accept output that is actually smaller.
+	 */
+	size_t compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstMax);
+
+	/**
+	 * Decompresses a block produced by compress()
+	 *
+	 * Returns the decompressed length, or -1 if the block is corrupt or doesn't fit in dstMax bytes.
+	 */
+	static int decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstMax);
+
+	/**
+	 * Returns the largest compressed size for srcLen bytes, for incompressible data
+	 */
+	static size_t maxCompressedSize(size_t srcLen) { return srcLen + srcLen / 255 + 16; }
+
+	static const size_t MAX_OFFSET = 65535;
+
+	static const size_t HASH_BITS = 9;
+	static const size_t HASH_SIZE = 1 << HASH_BITS;
+
+	static const size_t MIN_MATCH = 4;
+
+	// LZ4 end of block rules: the last match starts at least MFLIMIT bytes before the end, and the
+	// last LAST_LITERALS bytes are always literals
+	static const size_t MFLIMIT = 12;
+	static const size_t LAST_LITERALS = 5;
+
+protected:
+	/**
+	 * Appends a sequence to dst: litLen literal bytes from lits, then a match of matchLen bytes at
+	 * offset, or no match if matchLen is 0. Returns false if it doesn't fit.
+	 */
+	static bool putSequence(const uint8_t *lits, size_t litLen, size_t offset, size_t matchLen, uint8_t *dst, size_t &dstPos, size_t dstMax);
+
+	/**
+	 * Appends the extra length bytes for a length that didn't fit in a token nibble
+	 */
+	static bool putLength(size_t len, uint8_t *dst, size_t &dstPos, size_t dstMax);
+
+	/**
+	 * Reads the extra length bytes after a token nibble of 15, adding them to len
+	 */
+	static bool getLength(const uint8_t *src, size_t srcLen, size_t &srcPos, size_t &len);
+
+	/**
+	 * Returns the hash table index for the 4 bytes at p
+	 */
+	static uint32_t hash(const uint8_t *p);
+
+	// Position + 1 of the last occurrence of each hash; 0 for none
+	uint16_t hashTable[HASH_SIZE];
+};
+
+#endif /* __SPIFLASHLZ_H */
@@ -0,0 +1,129 @@
+
+#include "Particle.h"
+
+#include "spiflashlzlog.h"
+
+SpiFlashLzLog::SpiFlashLzLog(SpiFlashLog &log, uint8_t *blockBuf, uint8_t *workBuf, uint8_t *readBuf, size_t blockSize) :
+	log(log), blockBuf(blockBuf), workBuf(workBuf), readBuf(readBuf), blockSize(blockSize) {
+	resetStats();
+}
+
+SpiFlashLzLog::~SpiFlashLzLog() {
+
+}
+
+bool SpiFlashLzLog::append(const void *buf, size_t bufLen) {
+	if (bufLen == 0 || bufLen > getMaxRecordSize()) {
+		return false;
+	}
+
+	if (blockLen + RECORD_HEADER_SIZE + bufLen > blockSize) {
+		storeBlock();
+	}
+
+	blockBuf[blockLen++] = (uint8_t) bufLen;
+	blockBuf[blockLen++] = (uint8_t) (bufLen >> 8);
+	memcpy(&blockBuf[blockLen], buf, bufLen);
+	blockLen += bufLen;
+
+	stats.records++;
+	stats.rawBytes += RECORD_HEADER_SIZE + bufLen;
+	return true;
+}
+
+void SpiFlashLzLog::flush() {
+	if (blockLen > 1) {
+		storeBlock();
+	}
+	log.flush();
+}
+
+void SpiFlashLzLog::getOldest(Position &pos) const {
+	log.getOldest(pos.block);
+	pos.offset = 0;
+}
+
+int SpiFlashLzLog::readNext(Position &pos, void *buf, size_t bufLen) {
+	while(true) {
+		SpiFlashLog::Position next;
+		if (!loadBlock(pos.block, next)) {
+			return -1;
+		}
+
+		if (pos.offset + RECORD_HEADER_SIZE <= readLen) {
+			size_t len = readBuf[pos.offset] | (readBuf[pos.offset + 1] << 8);
+			if (len != 0 && pos.offset + RECORD_HEADER_SIZE + len <= readLen) {
+				if (bufLen > len) {
+					bufLen = len;
+				}
+				memcpy(buf, &readBuf[pos.offset + RECORD_HEADER_SIZE], bufLen);
+
+				pos.offset += RECORD_HEADER_SIZE + len;
+				return (int) len;
+			}
+		}
+
+		// End of the block
+		pos.block = next;
+		pos.offset = 0;
+	}
+}
+
+void SpiFlashLzLog::storeBlock() {
+	size_t rawLen = blockLen - 1;
+
+	// Only keep the compressed data if it's smaller
+	size_t lzLen = lz.compress(&blockBuf[1], rawLen, &workBuf[1], rawLen - 1);
+	if (lzLen != 0) {
+		workBuf[0] = BLOCK_LZ;
+		log.append(workBuf, 1 + lzLen);
+		stats.storedBytes += 1 + lzLen;
+	}
+	else {
+		blockBuf[0] = BLOCK_STORED;
+		log.append(blockBuf, blockLen);
+		stats.storedBytes += blockLen;
+		stats.storedBlocks++;
+	}
+	stats.blocks++;
+	blockLen = 1;
+
+	// The append may have wrapped the log over the block in readBuf
+	readValid = false;
+}
+
+bool SpiFlashLzLog::loadBlock(SpiFlashLog::Position &pos, SpiFlashLog::Position &next) {
+	if (readValid && samePosition(pos, readPos)) {
+		next = readNextPos;
+		return true;
+	}
+
+	SpiFlashLog::Position recordPos;
+	next = pos;
+	int len = log.readNext(next, workBuf, blockSize, &recordPos);
+	if (len < 0) {
+		return false;
+	}
+
+	// Anything that isn't a valid block reads as an empty one
+	readLen = 0;
+	if (len >= 1 && (size_t) len <= blockSize) {
+		if (workBuf[0] == BLOCK_STORED) {
+			memcpy(readBuf, &workBuf[1], len - 1);
+			readLen = len - 1;
+		}
+		else
+		if (workBuf[0] == BLOCK_LZ) {
+			int rawLen = SpiFlashLz::decompress(&workBuf[1], len - 1, readBuf, blockSize - 1);
+			if (rawLen > 0) {
+				readLen = rawLen;
+			}
+		}
+	}
+
+	pos = recordPos;
+	readPos = recordPos;
+	readNextPos = next;
+	readValid = true;
+	return true;
+}
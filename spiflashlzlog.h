@@ -0,0 +1,170 @@
+#ifndef __SPIFLASHLZLOG_H
+#define __SPIFLASHLZLOG_H
+
+#include "spiflashlog.h"
+#include "spiflashlz.h"
+
+/**
+ * Compressing front end for a SpiFlashLog
+ *
+ * Records are gathered in a RAM block. When the next record doesn't fit, the block is compressed
+ * with SpiFlashLz and appended to the log as a single log record, so both the page programs and the
+ * erases per record go down by the compression ratio. A block that doesn't get smaller is stored
+ * as is. Each block is compressed on its own, so sectors can still be discarded from the tail as the
+ * log wraps, and reading starts at any block.
+ *
+ * Records stay in the RAM block, and are not returned by readNext(), until the block fills or flush()
+ * is called, so call flush() at points where losing the recent records to a reset matters.
+ *
+ * Each block record stored in the log is a 1-byte format (BLOCK_STORED or BLOCK_LZ) followed by the
+ * data. Within the uncompressed block, each record is a 2-byte little endian length and the data.
+ *
+ * All of the buffers are members; use SpiFlashLzLogStatic to allocate them, for example:
+ *
+ * SpiFlash spiFlash(SPI, A2);
+ * SpiFlashLog log(spiFlash);
+ * SpiFlashLzLogStatic<2048> lzLog(log);
+ */
+class SpiFlashLzLog {
+public:
+	/**
+	 * Position of a record, used for reading
+	 */
+	struct Position {
+		SpiFlashLog::Position block;	//!< Position of the block record in the log
+		size_t offset;					//!< Offset of the record in the uncompressed block
+	};
+
+	/**
+	 * Usage counters, see getStats()
+	 */
+	struct Stats {
+		uint32_t records;				//!< Records appended
+		uint32_t blocks;				//!< Blocks appended to the log
+		uint32_t storedBlocks;			//!< Blocks stored uncompressed because they didn't get smaller
+		uint32_t rawBytes;				//!< Record bytes appended, including the record headers
+		uint32_t storedBytes;			//!< Bytes appended to the log, including the block formats
+	};
+
+	/**
+	 * Constructs the front end. You normally use SpiFlashLzLogStatic instead.
+	 *
+	 * log The log to store the blocks in. Call its begin() or format() before using this object.
+	 * blockBuf blockSize bytes for the block being appended
+	 * workBuf blockSize bytes for compressed data
+	 * readBuf blockSize bytes for the block being read
+	 * blockSize Size of the block records, including the format byte; at most SpiFlashLog::MAX_RECORD_SIZE
+	 */
+	SpiFlashLzLog(SpiFlashLog &log, uint8_t *blockBuf, uint8_t *workBuf, uint8_t *readBuf, size_t blockSize);
+	virtual ~SpiFlashLzLog();
+
+	/**
+	 * Appends a record to the RAM block, compressing and storing the block first if the record doesn't fit
+	 *
+	 * buf The record data. It's copied, so buf can be reused after this returns.
+	 * bufLen The number of bytes, 1 <= bufLen <= getMaxRecordSize()
+	 *
+	 * Returns false if bufLen is out of range.
+	 */
+	bool append(const void *buf, size_t bufLen);
+
+	/**
+	 * Compresses and stores the records in the RAM block, if any, and flushes the log
+	 */
+	void flush();
+
+	/**
+	 * Gets the position of the oldest record
+	 */
+	void getOldest(Position &pos) const;
+
+	/**
+	 * Reads the record at pos and advances pos to the next record
+	 *
+	 * pos Position to read from, typically initialized using getOldest()
+	 * buf Buffer to store the record in. If the record is larger than bufLen, it's truncated.
+	 * bufLen Size of buf
+	 *
+	 * Returns the length of the record, or -1 if there are no more. Blocks that don't decompress are
+	 * skipped.
+	 */
+	int readNext(Position &pos, void *buf, size_t bufLen);
+
+	/**
+	 * Returns the largest record that can be appended
+	 */
+	size_t getMaxRecordSize() const { return blockSize - 1 - RECORD_HEADER_SIZE; }
+
+	/**
+	 * Returns the counters. The compression ratio is rawBytes / storedBytes.
+	 */
+	const Stats &getStats() const { return stats; }
+
+	/**
+	 * Clears the counters
+	 */
+	void resetStats() { memset(&stats, 0, sizeof(stats)); }
+
+	// Block formats
+	static const uint8_t BLOCK_STORED = 0x00;
+	static const uint8_t BLOCK_LZ = 0x01;
+
+	static const size_t RECORD_HEADER_SIZE = 2;
+
+protected:
+	/**
+	 * Compresses the RAM block and appends it to the log
+	 */
+	void storeBlock();
+
+	/**
+	 * Makes the block record at pos the one in readBuf, decompressing it if it isn't already there.
+	 * Sets pos to the block's actual position and next to the position after it.
+	 *
+	 * Returns false if there are no more blocks.
+	 */
+	bool loadBlock(SpiFlashLog::Position &pos, SpiFlashLog::Position &next);
+
+	/**
+	 * Returns true if two log positions are the same
+	 */
+	static bool samePosition(const SpiFlashLog::Position &a, const SpiFlashLog::Position &b) { return a.index == b.index && a.offset == b.offset; }
+
+	SpiFlashLog &log;
+	SpiFlashLz lz;
+	uint8_t *blockBuf;				// Format byte, then the records
+	uint8_t *workBuf;
+	uint8_t *readBuf;
+	size_t blockSize;
+	size_t blockLen = 1;
+
+	// Block in readBuf
+	bool readValid = false;
+	SpiFlashLog::Position readPos;
+	SpiFlashLog::Position readNextPos;
+	size_t readLen = 0;
+
+	Stats stats;
+};
+
+/**
+ * Compressing log front end with statically allocated buffers for blocks of BLOCK_SIZE bytes
+ *
+ * Larger blocks compress better and mean fewer log records, but hold more records in RAM until
+ * they're stored, and readNext() decompresses a whole block at a time. Uses 3 * BLOCK_SIZE bytes plus
+ * the SpiFlashLz hash table.
+ */
+template<size_t BLOCK_SIZE>
+class SpiFlashLzLogStatic : public SpiFlashLzLog {
+public:
+	explicit SpiFlashLzLogStatic(SpiFlashLog &log) : SpiFlashLzLog(log, staticBlock, staticWork, staticRead, BLOCK_SIZE) {}
+
+	static_assert(BLOCK_SIZE <= SpiFlashLog::MAX_RECORD_SIZE, "a block must fit in a log record");
+
+protected:
+	uint8_t staticBlock[BLOCK_SIZE];
+	uint8_t staticWork[BLOCK_SIZE];
+	uint8_t staticRead[BLOCK_SIZE];
+};
+
+#endif /* __SPIFLASHLZLOG_H */
@@ -0,0 +1,62 @@
+
+#include "Particle.h"
+
+#include "spiflashreadcache.h"
+
+SpiFlashReadCache::SpiFlashReadCache(Line *lines, size_t numLines) : lines(lines), numLines(numLines) {
+	invalidateAll();
+}
+
+SpiFlashReadCache::~SpiFlashReadCache() {
+
+}
+
+uint8_t *SpiFlashReadCache::find(size_t pageAddr) {
+	for(size_t ii = 0; ii < numLines; ii++) {
+		Line *line = &lines[ii];
+		if (line->valid && line->addr == pageAddr) {
+			line->lastUse = ++useCounter;
+			hits++;
+			return line->data;
+		}
+	}
+	misses++;
+	return NULL;
+}
+
+uint8_t *SpiFlashReadCache::allocate(size_t pageAddr) {
+	Line *victim = &lines[0];
+
+	for(size_t ii = 0; ii < numLines; ii++) {
+		Line *line = &lines[ii];
+		if (!line->valid) {
+			victim = line;
+			break;
+		}
+		if ((int32_t)(line->lastUse - victim->lastUse) < 0) {
+			victim = line;
+		}
+	}
+
+	victim->addr = pageAddr;
+	victim->lastUse = ++useCounter;
+	victim->valid = true;
+
+	return victim->data;
+}
+
+void SpiFlashReadCache::invalidate(size_t addr, size_t len) {
+	for(size_t ii = 0; ii < numLines; ii++) {
+		Line *line = &lines[ii];
+		if (line->valid && line->addr < addr + len && line->addr + SpiFlash::PAGE_SIZE > addr) {
+			line->valid = false;
+		}
+	}
+}
+
+void SpiFlashReadCache::invalidateAll() {
+	for(size_t ii = 0; ii < numLines; ii++) {
+		lines[ii].valid = false;
+	}
+}
+
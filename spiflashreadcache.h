@@ -0,0 +1,110 @@
+#ifndef __SPIFLASHREADCACHE_H
+#define __SPIFLASHREADCACHE_H
+
+#include "spiflash.h"
+
+/**
+ * Read cache of 256-byte page lines with LRU replacement
+ *
+ * Attach one to a SpiFlash object using SpiFlash::setReadCache(). readDataSync() and readPageSync()
+ * are then served from the cache when possible. Page programs and erases, sync and async,
+ * invalidate the lines they affect so the cache stays coherent.
+ *
+ * Reads larger than the cache bypass it so a bulk read doesn't flush out the hot lines.
+ *
+ * Use the SpiFlashReadCacheStatic template to allocate the lines, for example:
+ *
+ * SpiFlash spiFlash(SPI, A2);
+ * SpiFlashReadCacheStatic<8> readCache;
+ *
+ * void setup() {
+ *     spiFlash.begin();
+ *     spiFlash.setReadCache(&readCache);
+ * }
+ */
+class SpiFlashReadCache {
+public:
+	/**
+	 * A cache line holding one page
+	 */
+	struct Line {
+		size_t addr;					//!< Address of the start of the page
+		uint32_t lastUse;				//!< Value of useCounter when last used, for LRU replacement
+		bool valid;						//!< True if data holds the contents of the page
+		uint8_t data[SpiFlash::PAGE_SIZE];
+	};
+
+	/**
+	 * Constructs the cache. You normally use SpiFlashReadCacheStatic instead.
+	 *
+	 * lines Array of cache lines
+	 * numLines Number of entries in lines
+	 */
+	SpiFlashReadCache(Line *lines, size_t numLines);
+	virtual ~SpiFlashReadCache();
+
+	/**
+	 * Returns the cached data for the page starting at pageAddr, or NULL if it's not cached.
+	 * Counts a hit or a miss.
+	 */
+	uint8_t *find(size_t pageAddr);
+
+	/**
+	 * Returns a line for the page starting at pageAddr, replacing the least recently used line. The
+	 * caller must fill the returned buffer with the page contents.
+	 */
+	uint8_t *allocate(size_t pageAddr);
+
+	/**
+	 * Invalidates lines for pages that overlap [addr, addr + len)
+	 */
+	void invalidate(size_t addr, size_t len);
+
+	/**
+	 * Invalidates all lines
+	 */
+	void invalidateAll();
+
+	/**
+	 * Returns true if a read of bufLen bytes should go through the cache
+	 */
+	bool isCacheable(size_t bufLen) const { return bufLen <= numLines * SpiFlash::PAGE_SIZE; }
+
+	/**
+	 * Returns the number of pages found in the cache
+	 */
+	uint32_t getHits() const { return hits; }
+
+	/**
+	 * Returns the number of pages that had to be read from the flash
+	 */
+	uint32_t getMisses() const { return misses; }
+
+	/**
+	 * Clears the hit and miss counters
+	 */
+	void resetStats() { hits = misses = 0; }
+
+protected:
+	Line *lines;
+	size_t numLines;
+	uint32_t useCounter = 0;
+	uint32_t hits = 0;
+	uint32_t misses = 0;
+};
+
+/**
+ * Read cache with NUM_LINES statically allocated lines
+ *
+ * Each line uses a little over SpiFlash::PAGE_SIZE (256) bytes of RAM.
+ */
+template<size_t NUM_LINES>
+class SpiFlashReadCacheStatic : public SpiFlashReadCache {
+public:
+	SpiFlashReadCacheStatic() : SpiFlashReadCache(staticLines, NUM_LINES) {}
+
+protected:
+	Line staticLines[NUM_LINES];
+};
+
+#endif /* __SPIFLASHREADCACHE_H */
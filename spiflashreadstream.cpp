@@ -0,0 +1,180 @@
+
+#include "Particle.h"
+
+#include "spiflashreadstream.h"
+
+SpiFlashReadStream::SpiFlashReadStream(SpiFlash &flash, Buffer *buffers, size_t numBuffers, uint8_t *data, size_t bufferSize) :
+	flash(flash), buffers(buffers), numBuffers(numBuffers), bufferSize(bufferSize) {
+	for(size_t ii = 0; ii < numBuffers; ii++) {
+		buffers[ii].stream = this;
+		buffers[ii].data = &data[ii * bufferSize];
+		buffers[ii].addr = 0;
+		buffers[ii].len = 0;
+		buffers[ii].state = BUFFER_FREE;
+	}
+}
+
+SpiFlashReadStream::~SpiFlashReadStream() {
+
+}
+
+void SpiFlashReadStream::setDataCallback(DataCallback callback, void *param) {
+	dataCallback = callback;
+	dataParam = param;
+}
+
+void SpiFlashReadStream::start(size_t addr, size_t len) {
+	for(size_t ii = 0; ii < numBuffers; ii++) {
+		buffers[ii].state = BUFFER_FREE;
+	}
+	fillIndex = deliverIndex = releaseIndex = 0;
+	nextAddr = addr;
+	remaining = len;
+
+	fill();
+}
+
+const uint8_t *SpiFlashReadStream::getData(size_t &len) {
+	Buffer *buf = NULL;
+
+	ATOMIC_BLOCK() {
+		if (buffers[deliverIndex].state == BUFFER_READY) {
+			buf = &buffers[deliverIndex];
+			buf->state = BUFFER_CONSUMING;
+			deliverIndex = (deliverIndex + 1) % numBuffers;
+		}
+	}
+
+	if (buf == NULL) {
+		// Retry reads that couldn't be queued earlier
+		fill();
+		return NULL;
+	}
+
+	len = buf->len;
+	return buf->data;
+}
+
+void SpiFlashReadStream::release() {
+	ATOMIC_BLOCK() {
+		if (buffers[releaseIndex].state == BUFFER_CONSUMING) {
+			buffers[releaseIndex].state = BUFFER_FREE;
+			releaseIndex = (releaseIndex + 1) % numBuffers;
+		}
+	}
+
+	fill();
+}
+
+bool SpiFlashReadStream::isDone() const {
+	if (remaining > 0) {
+		return false;
+	}
+	for(size_t ii = 0; ii < numBuffers; ii++) {
+		if (buffers[ii].state != BUFFER_FREE) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void SpiFlashReadStream::stop() {
+	ATOMIC_BLOCK() {
+		remaining = 0;
+		for(size_t ii = 0; ii < numBuffers; ii++) {
+			if (buffers[ii].state == BUFFER_PENDING) {
+				buffers[ii].state = BUFFER_FREE;
+			}
+		}
+	}
+
+	// Queued reads can't be removed from the flash queue, so let them finish
+	for(size_t ii = 0; ii < numBuffers; ii++) {
+		while(buffers[ii].state == BUFFER_READING) {
+			delay(1);
+		}
+	}
+
+	for(size_t ii = 0; ii < numBuffers; ii++) {
+		buffers[ii].state = BUFFER_FREE;
+	}
+	fillIndex = deliverIndex = releaseIndex = 0;
+}
+
+void SpiFlashReadStream::fill() {
+	// Assign ranges in ring order, so deliverIndex always points at the lowest address
+	ATOMIC_BLOCK() {
+		while(remaining > 0 && buffers[fillIndex].state == BUFFER_FREE) {
+			Buffer *buf = &buffers[fillIndex];
+
+			buf->addr = nextAddr;
+			buf->len = (remaining < bufferSize) ? remaining : bufferSize;
+			buf->state = BUFFER_PENDING;
+
+			nextAddr += buf->len;
+			remaining -= buf->len;
+			fillIndex = (fillIndex + 1) % numBuffers;
+		}
+	}
+
+	// Queue the reads oldest first. This can be called from both the application and the read completion
+	// callback, so each buffer is claimed before it's queued.
+	for(size_t ii = 0; ii < numBuffers; ii++) {
+		Buffer *buf = &buffers[(deliverIndex + ii) % numBuffers];
+		bool claimed = false;
+
+		ATOMIC_BLOCK() {
+			if (buf->state == BUFFER_PENDING) {
+				buf->state = BUFFER_READING;
+				claimed = true;
+			}
+		}
+		if (!claimed) {
+			continue;
+		}
+
+		if (!flash.readDataAsync(buf->addr, buf->data, buf->len, _readDone, buf)) {
+			// Queue is full; retried on the next completion, release(), or getData()
+			buf->state = BUFFER_PENDING;
+			break;
+		}
+	}
+}
+
+void SpiFlashReadStream::deliver() {
+	while(true) {
+		Buffer *buf = NULL;
+
+		ATOMIC_BLOCK() {
+			if (!delivering && buffers[deliverIndex].state == BUFFER_READY) {
+				buf = &buffers[deliverIndex];
+				buf->state = BUFFER_CONSUMING;
+				deliverIndex = (deliverIndex + 1) % numBuffers;
+				delivering = true;
+			}
+		}
+		if (buf == NULL) {
+			// Nothing ready, or the callback is already running (it picks up this buffer when it returns)
+			break;
+		}
+
+		dataCallback(dataParam, buf->data, buf->len);
+		delivering = false;
+	}
+}
+
+// [static]
+void SpiFlashReadStream::_readDone(void *param) {
+	Buffer *buf = (Buffer *)param;
+	SpiFlashReadStream *stream = buf->stream;
+
+	buf->state = BUFFER_READY;
+
+	// Keep the bus busy before handing the data to the application
+	stream->fill();
+
+	if (stream->dataCallback != NULL) {
+		stream->deliver();
+	}
+}
+
@@ -0,0 +1,153 @@
+#ifndef __SPIFLASHREADSTREAM_H
+#define __SPIFLASHREADSTREAM_H
+
+#include "spiflash.h"
+
+/**
+ * Streams a range of the flash through a ring of RAM buffers, keeping reads in flight while the
+ * application consumes earlier buffers
+ *
+ * start() queues async reads into all of the buffers. As each buffer fills it's handed to the
+ * application in address order, either from getData() (pull) or by calling the data callback (push).
+ * When the application calls release() the buffer is immediately queued for the next part of the
+ * range, so the flash reads overlap with whatever the application does with the data, such as
+ * sending it over the network.
+ *
+ * With the data callback, buffers are delivered from the DMA completion interrupt (or the timer thread
+ * when the queue was idle). The callback doesn't need to call release() itself; the buffer stays
+ * owned by the application until release(), so it can be passed to another thread.
+ *
+ * Use the SpiFlashReadStreamStatic template to allocate the buffers, for example:
+ *
+ * SpiFlash spiFlash(SPI, A2);
+ * SpiFlashReadStreamStatic<3, 1024> readStream(spiFlash);
+ */
+class SpiFlashReadStream {
+public:
+	/**
+	 * Callback for a filled buffer
+	 *
+	 * param The param passed to setDataCallback()
+	 * data The data
+	 * len The number of bytes of data
+	 */
+	typedef void (*DataCallback)(void *param, const uint8_t *data, size_t len);
+
+	/**
+	 * State of a buffer in the ring
+	 */
+	enum BufferState {
+		BUFFER_FREE = 0,	//!< Available for the next read
+		BUFFER_PENDING,		//!< Assigned a range, but the flash queue was full
+		BUFFER_READING,		//!< Read queued or in progress
+		BUFFER_READY,		//!< Filled, waiting to be delivered
+		BUFFER_CONSUMING	//!< Delivered, owned by the application until release()
+	};
+
+	/**
+	 * One buffer in the ring
+	 */
+	struct Buffer {
+		SpiFlashReadStream *stream;		//!< The stream the buffer belongs to, for the read callback
+		uint8_t *data;					//!< bufferSize bytes
+		size_t addr;					//!< Flash address of the data
+		size_t len;						//!< Number of bytes read into data
+		volatile uint8_t state;			//!< BufferState
+	};
+
+	/**
+	 * Constructs the stream. You normally use SpiFlashReadStreamStatic instead.
+	 *
+	 * flash The flash chip to read from
+	 * buffers Array of numBuffers Buffer structures
+	 * numBuffers Number of buffers, at least 2
+	 * data numBuffers * bufferSize bytes of buffer memory
+	 * bufferSize Size of each buffer
+	 */
+	SpiFlashReadStream(SpiFlash &flash, Buffer *buffers, size_t numBuffers, uint8_t *data, size_t bufferSize);
+	virtual ~SpiFlashReadStream();
+
+	/**
+	 * Sets the callback used to deliver buffers, or NULL to use getData(). Set before start().
+	 */
+	void setDataCallback(DataCallback callback, void *param);
+
+	/**
+	 * Starts streaming [addr, addr + len). Any previous stream must be done or stopped.
+	 */
+	void start(size_t addr, size_t len);
+
+	/**
+	 * Gets the next buffer in address order, if it has been filled. Doesn't block. Only used
+	 * when there is no data callback.
+	 *
+	 * len Filled in with the number of bytes of data
+	 *
+	 * Returns the data, or NULL if the next buffer is not ready yet. Call release() when done with it.
+	 */
+	const uint8_t *getData(size_t &len);
+
+	/**
+	 * Finishes with the oldest buffer delivered by getData() or the data callback and queues the
+	 * next read into it
+	 */
+	void release();
+
+	/**
+	 * Returns true once all of the data has been delivered and released
+	 */
+	bool isDone() const;
+
+	/**
+	 * Stops streaming, waiting for reads already queued to finish. Buffers that haven't been
+	 * released are discarded.
+	 */
+	void stop();
+
+protected:
+	/**
+	 * Assigns the next part of the range to free buffers, in ring order, and queues reads for them
+	 * and for any pending buffers
+	 */
+	void fill();
+
+	/**
+	 * Calls the data callback for the ready buffers that are next in order
+	 */
+	void deliver();
+
+	/**
+	 * Read completion callback; param is the Buffer
+	 */
+	static void _readDone(void *param);
+
+	SpiFlash &flash;
+	Buffer *buffers;
+	size_t numBuffers;
+	size_t bufferSize;
+	DataCallback dataCallback = NULL;
+	void *dataParam = NULL;
+	size_t nextAddr = 0;
+	size_t remaining = 0;
+	size_t fillIndex = 0;			// Next buffer to assign a range to
+	size_t deliverIndex = 0;		// Next buffer to hand to the application
+	size_t releaseIndex = 0;		// Oldest buffer owned by the application
+	volatile bool delivering = false;
+};
+
+/**
+ * Read stream with NUM_BUFFERS statically allocated buffers of BUFFER_SIZE bytes
+ *
+ * Three buffers are usually enough to keep the bus busy while the application holds one.
+ */
+template<size_t NUM_BUFFERS, size_t BUFFER_SIZE>
+class SpiFlashReadStreamStatic : public SpiFlashReadStream {
+public:
+	explicit SpiFlashReadStreamStatic(SpiFlash &flash) : SpiFlashReadStream(flash, staticBuffers, NUM_BUFFERS, staticData, BUFFER_SIZE) {}
+
+protected:
+	Buffer staticBuffers[NUM_BUFFERS];
+	uint8_t staticData[NUM_BUFFERS * BUFFER_SIZE];
+};
+
+#endif /* __SPIFLASHREADSTREAM_H */
@@ -0,0 +1,228 @@
+
+#include "Particle.h"
+
+#include "spiflashstripe.h"
+
+SpiFlashStripe::SpiFlashStripe(SpiFlash *chips[], size_t numChips, size_t stripeSize) : numChips(numChips), stripeSize(stripeSize) {
+	if (this->numChips > MAX_CHIPS) {
+		this->numChips = MAX_CHIPS;
+	}
+	for(size_t ii = 0; ii < this->numChips; ii++) {
+		this->chips[ii] = chips[ii];
+	}
+
+	// Stripes must evenly divide a sector so a sector erase on each chip is a whole number of stripes
+	if (stripeSize < SpiFlash::PAGE_SIZE || stripeSize > SpiFlash::SECTOR_SIZE || (stripeSize & (stripeSize - 1)) != 0) {
+		this->stripeSize = SpiFlash::PAGE_SIZE;
+	}
+}
+
+SpiFlashStripe::~SpiFlashStripe() {
+
+}
+
+bool SpiFlashStripe::begin() {
+	// Every operation is split into async operations on the chips, and waits for them to finish
+	if (numChips == 0) {
+		return false;
+	}
+	for(size_t ii = 0; ii < numChips; ii++) {
+		if (chips[ii] == NULL || !chips[ii]->isAsyncAvailable()) {
+			return false;
+		}
+	}
+
+	for(size_t ii = 0; ii < numChips; ii++) {
+		chips[ii]->begin();
+	}
+	started = true;
+	return true;
+}
+
+bool SpiFlashStripe::isValidChip() {
+	if (!started) {
+		return false;
+	}
+	for(size_t ii = 0; ii < numChips; ii++) {
+		if (!chips[ii]->isValidChip()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void SpiFlashStripe::mapAddr(size_t addr, size_t &chipIndex, size_t &chipAddr) const {
+	size_t stripe = addr / stripeSize;
+
+	chipIndex = stripe % numChips;
+	chipAddr = (stripe / numChips) * stripeSize + (addr % stripeSize);
+}
+
+void SpiFlashStripe::readDataSync(size_t addr, void *buf, size_t bufLen) {
+	uint8_t *curBuf = (uint8_t *)buf;
+
+	if (!started) {
+		return;
+	}
+
+	while(bufLen > 0) {
+		size_t chipIndex, chipAddr;
+		mapAddr(addr, chipIndex, chipAddr);
+
+		size_t count = stripeSize - (addr % stripeSize);
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		beginOp();
+		while(!chips[chipIndex]->readDataAsync(chipAddr, curBuf, count, _opDone, this)) {
+			// Queue for this chip is full; wait for one of its reads to finish
+			SPIFLASH_BUSY_WAIT();
+		}
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+	}
+
+	waitForOps(false);
+}
+
+void SpiFlashStripe::writeDataSync(size_t addr, const void *buf, size_t bufLen) {
+	const uint8_t *data = (const uint8_t *)buf;
+	size_t end = addr + bufLen;
+	size_t next[MAX_CHIPS];		// Logical address of the next byte each chip programs
+
+	if (!started || bufLen == 0) {
+		return;
+	}
+
+	// Each chip works through its own stripes, starting with the first one at or after addr
+	size_t firstStripe = addr / stripeSize;
+	for(size_t ii = 0; ii < numChips; ii++) {
+		size_t offset = (ii + numChips - firstStripe % numChips) % numChips;
+		next[ii] = (offset == 0) ? addr : (firstStripe + offset) * stripeSize;
+	}
+
+	// Queued programs are only seen to finish on the 1 ms poll timer, which is much longer than a
+	// page program on most chips. Instead, start a program on each chip and poll them in turn,
+	// starting the next page on whichever chip is done.
+	bool writing = true;
+	while(writing) {
+		bool progressed = false;
+
+		writing = false;
+		for(size_t ii = 0; ii < numChips; ii++) {
+			if (next[ii] >= end) {
+				continue;
+			}
+			writing = true;
+			if (!chips[ii]->pollWriteComplete()) {
+				continue;
+			}
+
+			size_t chipIndex, chipAddr;
+			mapAddr(next[ii], chipIndex, chipAddr);
+
+			// Stripes are at least a page and page aligned, so stopping at the end of the page on
+			// the chip also stops at the end of the stripe
+			size_t count = SpiFlash::PAGE_SIZE - (chipAddr % SpiFlash::PAGE_SIZE);
+			if (count > end - next[ii]) {
+				count = end - next[ii];
+			}
+			chips[ii]->writePageStart(chipAddr, &data[next[ii] - addr], count);
+			progressed = true;
+
+			next[ii] += count;
+			if (next[ii] % stripeSize == 0) {
+				// Skip the stripes on the other chips
+				next[ii] += (numChips - 1) * stripeSize;
+			}
+		}
+		if (writing && !progressed) {
+			SPIFLASH_BUSY_WAIT();
+		}
+	}
+
+	for(size_t ii = 0; ii < numChips; ii++) {
+		chips[ii]->waitForWriteComplete();
+	}
+}
+
+void SpiFlashStripe::sectorErase(size_t addr) {
+	if (!started) {
+		// getSectorSize() and getBlockSize() are 0 without any chips
+		return;
+	}
+	eraseAll(ERASE_SECTOR, (addr / getSectorSize()) * SpiFlash::SECTOR_SIZE);
+}
+
+void SpiFlashStripe::blockErase(size_t addr) {
+	if (!started) {
+		return;
+	}
+	eraseAll(ERASE_BLOCK, (addr / getBlockSize()) * SpiFlash::BLOCK_SIZE);
+}
+
+void SpiFlashStripe::chipErase() {
+	eraseAll(ERASE_CHIP, 0);
+}
+
+void SpiFlashStripe::eraseAll(EraseType type, size_t chipAddr) {
+	if (!started) {
+		return;
+	}
+
+	for(size_t ii = 0; ii < numChips; ii++) {
+		beginOp();
+		while(true) {
+			bool queued;
+			switch(type) {
+			case ERASE_SECTOR:
+				queued = chips[ii]->sectorEraseAsync(chipAddr, _opDone, this);
+				break;
+
+			case ERASE_BLOCK:
+				queued = chips[ii]->blockEraseAsync(chipAddr, _opDone, this);
+				break;
+
+			default:
+				queued = chips[ii]->chipEraseAsync(_opDone, this);
+				break;
+			}
+			if (queued) {
+				break;
+			}
+			delay(1);
+		}
+	}
+
+	waitForOps(true);
+}
+
+void SpiFlashStripe::beginOp() {
+	ATOMIC_BLOCK() {
+		pendingOps++;
+	}
+}
+
+void SpiFlashStripe::waitForOps(bool erasing) {
+	while(pendingOps > 0) {
+		if (erasing) {
+			delay(1);
+		}
+		else {
+			SPIFLASH_BUSY_WAIT();
+		}
+	}
+}
+
+// [static]
+void SpiFlashStripe::_opDone(void *param) {
+	SpiFlashStripe *stripe = (SpiFlashStripe *)param;
+
+	ATOMIC_BLOCK() {
+		stripe->pendingOps--;
+	}
+}
+
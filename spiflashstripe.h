@@ -0,0 +1,143 @@
+#ifndef __SPIFLASHSTRIPE_H
+#define __SPIFLASHSTRIPE_H
+
+#include "spiflash.h"
+
+/**
+ * Object that spans several SpiFlash chips, striping data across them (RAID-0 style)
+ *
+ * Consecutive stripes of stripeSize bytes go to consecutive chips, so a large read or write
+ * uses all of the chips at once, and page programs on different chips overlap. Each chip must be on
+ * its own SPI bus because the transfers run in parallel. Writes start a page program on each chip and
+ * poll the chips' status registers in turn, so both reads and writes scale with the number of chips.
+ *
+ * The erase units are the chip's erase units multiplied by the number of chips. For example, with
+ * two chips sectorErase() erases 8K, one 4K sector on each chip.
+ *
+ * Typically you create one of these as a global object, after the SpiFlash objects:
+ *
+ * SpiFlash flash0(SPI, A2);
+ * SpiFlash flash1(SPI1, D5);
+ * SpiFlash *chips[] = { &flash0, &flash1 };
+ * SpiFlashStripe stripe(chips, 2);
+ */
+class SpiFlashStripe {
+public:
+	/**
+	 * Constructs the stripe object
+	 *
+	 * chips Array of pointers to SpiFlash objects. The array is copied.
+	 * numChips Number of chips, 1 <= numChips <= MAX_CHIPS. Extra chips are ignored and 0 makes
+	 * begin() fail.
+	 * stripeSize Number of bytes stored on one chip before moving on to the next. Must be a power of 2
+	 * between SpiFlash::PAGE_SIZE and SpiFlash::SECTOR_SIZE; other values use PAGE_SIZE.
+	 */
+	SpiFlashStripe(SpiFlash *chips[], size_t numChips, size_t stripeSize = SpiFlash::PAGE_SIZE);
+	virtual ~SpiFlashStripe();
+
+	/**
+	 * Calls begin() on each of the chips
+	 *
+	 * Returns false, without starting any of the chips, if there are no chips or a chip can't do
+	 * async operations (see SpiFlash::isAsyncAvailable()). The other functions do nothing until this
+	 * has succeeded.
+	 */
+	bool begin();
+
+	/**
+	 * Returns true if every chip appears to be valid
+	 */
+	bool isValidChip();
+
+	/**
+	 * Reads data synchronously, reading from all chips in parallel
+	 *
+	 * addr The logical address to read from
+	 * buf The buffer to store data in
+	 * bufLen The number of bytes to read
+	 */
+	void readDataSync(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * Writes data synchronously, programming pages on all chips in parallel
+	 *
+	 * addr The logical address to write to
+	 * buf The data to write
+	 * bufLen The number of bytes to write
+	 */
+	void writeDataSync(size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * Erases the logical sector containing addr (getSectorSize() bytes); the sector is erased on all
+	 * chips at the same time
+	 */
+	void sectorErase(size_t addr);
+
+	/**
+	 * Erases the logical block containing addr (getBlockSize() bytes)
+	 */
+	void blockErase(size_t addr);
+
+	/**
+	 * Erases all of the chips
+	 */
+	void chipErase();
+
+	/**
+	 * Returns the number of bytes erased by sectorErase()
+	 */
+	size_t getSectorSize() const { return numChips * SpiFlash::SECTOR_SIZE; }
+
+	/**
+	 * Returns the number of bytes erased by blockErase()
+	 */
+	size_t getBlockSize() const { return numChips * SpiFlash::BLOCK_SIZE; }
+
+	/**
+	 * Returns the total number of bytes in the volume
+	 */
+	size_t getSize() const { return numChips * SpiFlash::SECTOR_SIZE * SpiFlash::NUM_SECTORS; }
+
+	static const size_t MAX_CHIPS = SpiFlash::MAX_INSTANCES;
+
+private:
+	enum EraseType {
+		ERASE_SECTOR = 0,
+		ERASE_BLOCK,
+		ERASE_CHIP
+	};
+
+	/**
+	 * Converts a logical address into a chip and the address on that chip
+	 */
+	void mapAddr(size_t addr, size_t &chipIndex, size_t &chipAddr) const;
+
+	/**
+	 * Counts an operation that is about to be queued
+	 */
+	void beginOp();
+
+	/**
+	 * Waits until all queued operations are done. If erasing is true, calls delay(1) while waiting
+	 * so the cloud connection will be serviced in non-threaded mode.
+	 */
+	void waitForOps(bool erasing);
+
+	/**
+	 * Erases the erase unit at chipAddr on every chip in parallel
+	 */
+	void eraseAll(EraseType type, size_t chipAddr);
+
+	/**
+	 * Completion callback for the per-chip operations
+	 */
+	static void _opDone(void *param);
+
+	SpiFlash *chips[MAX_CHIPS];
+	size_t numChips;
+	size_t stripeSize;
+	bool started = false;
+	volatile size_t pendingOps = 0;
+};
+
+#endif /* __SPIFLASHSTRIPE_H */
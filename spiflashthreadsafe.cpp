@@ -0,0 +1,231 @@
+
+#include "Particle.h"
+
+#include "spiflashthreadsafe.h"
+
+#if PLATFORM_THREADING
+
+SpiFlashRequest::~SpiFlashRequest() {
+	if (doneSemaphore != NULL) {
+		// The worker may still be giving the semaphore just after marking the request done
+		if (owner != NULL) {
+			owner->doneMutex.lock();
+		}
+		os_semaphore_destroy(doneSemaphore);
+		if (owner != NULL) {
+			owner->doneMutex.unlock();
+		}
+	}
+}
+
+bool SpiFlashRequest::wait(unsigned long timeoutMs) {
+	unsigned long start = millis();
+
+	while(state != STATE_DONE) {
+		system_tick_t remaining = CONCURRENT_WAIT_FOREVER;
+
+		if (state == STATE_IDLE) {
+			return false;
+		}
+		if (timeoutMs != WAIT_FOREVER) {
+			unsigned long elapsed = millis() - start;
+			if (elapsed >= timeoutMs) {
+				return false;
+			}
+			remaining = timeoutMs - elapsed;
+		}
+
+		// Given once the request is done. A timeout just goes around to check the time again.
+		os_semaphore_take(doneSemaphore, remaining, false);
+	}
+	return true;
+}
+
+SpiFlashThreadSafe::SpiFlashThreadSafe(SpiFlash &flash) : flash(flash) {
+
+}
+
+SpiFlashThreadSafe::~SpiFlashThreadSafe() {
+	// The worker never exits, so the front end is meant to live as long as the program
+}
+
+bool SpiFlashThreadSafe::begin(os_thread_prio_t priority, size_t stackSize) {
+	if (completedSemaphore == NULL) {
+		// The worker takes every completed request each time it wakes up, so one pending give is enough
+		if (os_semaphore_create(&completedSemaphore, 1, 0) != 0) {
+			completedSemaphore = NULL;
+			return false;
+		}
+	}
+	if (workerThread == NULL) {
+		workerThread = new Thread("spiflash", _worker, this, priority, stackSize);
+		if (workerThread == NULL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SpiFlashThreadSafe::read(SpiFlashRequest &req, size_t addr, void *buf, size_t bufLen) {
+	return submit(req, OP_READ, addr, buf, bufLen);
+}
+
+bool SpiFlashThreadSafe::writePage(SpiFlashRequest &req, size_t addr, const void *buf, size_t bufLen) {
+	return submit(req, OP_WRITE_PAGE, addr, buf, bufLen);
+}
+
+bool SpiFlashThreadSafe::sectorErase(SpiFlashRequest &req, size_t addr) {
+	return submit(req, OP_SECTOR_ERASE, addr, NULL, 0);
+}
+
+bool SpiFlashThreadSafe::eraseRange(SpiFlashRequest &req, size_t addr, size_t len) {
+	return submit(req, OP_ERASE_RANGE, addr, NULL, len);
+}
+
+bool SpiFlashThreadSafe::eraseAndWrite(SpiFlashRequest &req, size_t addr, const void *buf, size_t bufLen) {
+	return submit(req, OP_ERASE_AND_WRITE, addr, buf, bufLen);
+}
+
+void SpiFlashThreadSafe::lock() {
+	mutex.lock();
+
+	// Nothing new can be submitted now, so this only waits for the flash to finish what's already
+	// queued. outstanding is decremented by the completion, not the worker, which may be blocked on
+	// the mutex in a callback that submits.
+	while(outstanding > 0) {
+		delay(1);
+	}
+}
+
+void SpiFlashThreadSafe::unlock() {
+	mutex.unlock();
+}
+
+bool SpiFlashThreadSafe::submit(SpiFlashRequest &req, OpType type, size_t addr, const void *buf, size_t bufLen) {
+	if (completedSemaphore == NULL) {
+		return false;
+	}
+
+	mutex.lock();
+
+	// Checked with the mutex held, so two threads can't both submit the same request
+	if (req.state == SpiFlashRequest::STATE_QUEUED) {
+		mutex.unlock();
+		return false;
+	}
+	if (req.doneSemaphore == NULL) {
+		if (os_semaphore_create(&req.doneSemaphore, 1, 0) != 0) {
+			req.doneSemaphore = NULL;
+			mutex.unlock();
+			return false;
+		}
+	}
+	else {
+		// Still given if the last wait() found the request done without taking it
+		os_semaphore_take(req.doneSemaphore, 0, false);
+	}
+
+	req.owner = this;
+	req.state = SpiFlashRequest::STATE_QUEUED;
+	ATOMIC_BLOCK() {
+		outstanding++;
+	}
+
+	while(true) {
+		bool queued = false;
+
+		switch(type) {
+		case OP_READ:
+			queued = flash.readDataAsync(addr, const_cast<void *>(buf), bufLen, _completion, &req);
+			break;
+
+		case OP_WRITE_PAGE:
+			queued = flash.writePageAsync(addr, buf, bufLen, _completion, &req);
+			break;
+
+		case OP_SECTOR_ERASE:
+			queued = flash.sectorEraseAsync(addr, _completion, &req);
+			break;
+
+		case OP_ERASE_RANGE:
+			queued = flash.eraseRangeAsync(addr, bufLen, _completion, &req);
+			break;
+
+		case OP_ERASE_AND_WRITE:
+			queued = flash.eraseAndWriteAsync(addr, buf, bufLen, _completion, &req);
+			break;
+		}
+		if (queued) {
+			break;
+		}
+
+		// Queue full, or another range operation in progress. Both are freed by the flash, never by
+		// the worker. Other submitters wait on the mutex, which keeps the operations in submission order.
+		delay(1);
+	}
+
+	mutex.unlock();
+	return true;
+}
+
+// [static]
+void SpiFlashThreadSafe::_completion(void *param) {
+	SpiFlashRequest *req = (SpiFlashRequest *)param;
+	SpiFlashThreadSafe *owner = req->owner;
+
+	req->next = NULL;
+	ATOMIC_BLOCK() {
+		if (owner->completedLast != NULL) {
+			owner->completedLast->next = req;
+		}
+		else {
+			owner->completedFirst = req;
+		}
+		owner->completedLast = req;
+		owner->outstanding--;
+	}
+
+	// Fails harmlessly if the worker already has a wakeup pending
+	os_semaphore_give(owner->completedSemaphore, false);
+}
+
+// [static]
+void SpiFlashThreadSafe::_worker(void *param) {
+	((SpiFlashThreadSafe *)param)->worker();
+}
+
+void SpiFlashThreadSafe::worker() {
+	while(true) {
+		os_semaphore_take(completedSemaphore, CONCURRENT_WAIT_FOREVER, false);
+
+		// Everything completed since the last wakeup, in order
+		while(true) {
+			SpiFlashRequest *req;
+
+			ATOMIC_BLOCK() {
+				req = completedFirst;
+				if (req != NULL) {
+					completedFirst = req->next;
+					if (completedFirst == NULL) {
+						completedLast = NULL;
+					}
+				}
+			}
+			if (req == NULL) {
+				break;
+			}
+
+			if (req->callback != NULL) {
+				req->callback(req, req->param);
+			}
+
+			// Once the state is done the request can be reused or destroyed, which waits for doneMutex
+			doneMutex.lock();
+			req->state = SpiFlashRequest::STATE_DONE;
+			os_semaphore_give(req->doneSemaphore, false);
+			doneMutex.unlock();
+		}
+	}
+}
+
+#endif /* PLATFORM_THREADING */
@@ -0,0 +1,216 @@
+#ifndef __SPIFLASHTHREADSAFE_H
+#define __SPIFLASHTHREADSAFE_H
+
+#include "spiflash.h"
+
+#if PLATFORM_THREADING
+
+class SpiFlashThreadSafe;
+
+/**
+ * Handle for an operation submitted to SpiFlashThreadSafe, which can be waited on from any thread
+ *
+ * A request can be reused once it's done. It must stay valid, along with the buffer passed with it,
+ * until then. Each request has its own semaphore for wait(), created the first time it's submitted.
+ */
+class SpiFlashRequest {
+public:
+	/**
+	 * Called from the SpiFlashThreadSafe worker thread when the operation is complete, just before
+	 * the request becomes done
+	 *
+	 * req The request
+	 * param The param passed to setCallback()
+	 */
+	typedef void (*Callback)(SpiFlashRequest *req, void *param);
+
+	/**
+	 * State of the request
+	 */
+	enum State {
+		STATE_IDLE = 0,		//!< Not submitted yet
+		STATE_QUEUED,		//!< In the flash queue or in progress
+		STATE_DONE			//!< Complete, can be reused
+	};
+
+	SpiFlashRequest() {}
+	virtual ~SpiFlashRequest();
+
+	/**
+	 * Sets a function to call on completion. It runs in the worker thread, not an interrupt, so it
+	 * can block, submit more operations, and use other threads' APIs. Set before submitting.
+	 */
+	void setCallback(Callback callback, void *param) { this->callback = callback; this->param = param; }
+
+	/**
+	 * Returns true once the operation is complete and the callback, if any, has returned
+	 */
+	bool isDone() const { return state == STATE_DONE; }
+
+	/**
+	 * Returns the state of the request
+	 */
+	State getState() const { return (State) state; }
+
+	/**
+	 * Blocks the calling thread on the request's semaphore until the operation is done or timeoutMs
+	 * milliseconds have elapsed. The default waits forever.
+	 *
+	 * Returns true if the operation is done, false on timeout or if the request has never been
+	 * submitted. The operation keeps going after a timeout and the request can be waited on again.
+	 */
+	bool wait(unsigned long timeoutMs = WAIT_FOREVER);
+
+	static const unsigned long WAIT_FOREVER = 0xffffffff;
+
+protected:
+	friend class SpiFlashThreadSafe;
+
+	SpiFlashThreadSafe *owner = NULL;
+	Callback callback = NULL;
+	void *param = NULL;
+	volatile uint8_t state = STATE_IDLE;
+	os_semaphore_t doneSemaphore = NULL;
+	SpiFlashRequest *next = NULL;		// In the owner's list of completed requests
+};
+
+/**
+ * Front end that lets several application threads share one SpiFlash with async operations
+ *
+ * Operations are submitted with a mutex held and go into the SpiFlash async queue. The SpiFlash
+ * completion callbacks run from the DMA interrupt or the software timer thread; this class only adds
+ * the request to a list and gives a semaphore from there (which Device OS allows at interrupt
+ * priority), and a worker thread calls the request's callback and marks it done. The list is linked
+ * through the requests, so it never fills up. Application threads wait with SpiFlashRequest::wait(),
+ * which has a timeout, instead of blocking in the sync calls.
+ *
+ * Nothing holding the mutex ever waits for the worker, so callbacks can submit more operations at
+ * any time. They block until unlock() if another thread has called lock().
+ *
+ * Once begin() has been called, use the SpiFlash object only through this class, or between lock()
+ * and unlock(). Only available with threading (PLATFORM_THREADING), for example:
+ *
+ * SpiFlash spiFlash(SPI, A2);
+ * SpiFlashThreadSafe flash(spiFlash);
+ *
+ * void setup() {
+ *     spiFlash.begin();
+ *     flash.begin();
+ * }
+ *
+ * // In any thread
+ * SpiFlashRequest req;
+ * flash.read(req, addr, buf, sizeof(buf));
+ * if (!req.wait(100)) {
+ *     ...
+ * }
+ */
+class SpiFlashThreadSafe {
+public:
+	/**
+	 * Constructs the front end. Call begin() before using it.
+	 */
+	explicit SpiFlashThreadSafe(SpiFlash &flash);
+	virtual ~SpiFlashThreadSafe();
+
+	/**
+	 * Creates the completion queue and the worker thread. Call from setup(), after SpiFlash::begin().
+	 *
+	 * Returns false if they couldn't be allocated.
+	 */
+	bool begin(os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = 3072);
+
+	/**
+	 * Queues SpiFlash::readDataAsync(). If the flash queue is full, waits with delay(1) until there's room.
+	 *
+	 * Returns false if req hasn't finished a previous operation, begin() hasn't been called, or its
+	 * semaphore couldn't be created.
+	 */
+	bool read(SpiFlashRequest &req, size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * Queues SpiFlash::writePageAsync(); the data must be within one page
+	 */
+	bool writePage(SpiFlashRequest &req, size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * Queues SpiFlash::sectorEraseAsync()
+	 */
+	bool sectorErase(SpiFlashRequest &req, size_t addr);
+
+	/**
+	 * Starts SpiFlash::eraseRangeAsync(), waiting for any other range operation to finish first
+	 */
+	bool eraseRange(SpiFlashRequest &req, size_t addr, size_t len);
+
+	/**
+	 * Starts SpiFlash::eraseAndWriteAsync(), waiting for any other range operation to finish first
+	 */
+	bool eraseAndWrite(SpiFlashRequest &req, size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * Gets exclusive use of the SpiFlash object for the sync API: waits for the flash to finish the
+	 * operations already queued by all threads, and keeps other threads from submitting until unlock().
+	 *
+	 * The callbacks of those operations may still be running in the worker thread, and any that submit
+	 * wait for unlock(). Don't wait() on requests between lock() and unlock().
+	 */
+	void lock();
+
+	/**
+	 * Ends exclusive use started by lock()
+	 */
+	void unlock();
+
+	/**
+	 * Returns the underlying flash object
+	 */
+	SpiFlash &getFlash() { return flash; }
+
+protected:
+	friend class SpiFlashRequest;
+
+	/**
+	 * The operation submit() retries until the flash accepts it
+	 */
+	enum OpType {
+		OP_READ = 0,
+		OP_WRITE_PAGE,
+		OP_SECTOR_ERASE,
+		OP_ERASE_RANGE,
+		OP_ERASE_AND_WRITE
+	};
+
+	/**
+	 * Marks req queued and hands the operation to the flash, with the mutex held
+	 */
+	bool submit(SpiFlashRequest &req, OpType type, size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * SpiFlash completion callback, from the DMA interrupt or timer thread; param is the request
+	 */
+	static void _completion(void *param);
+
+	/**
+	 * Worker thread function; param is the SpiFlashThreadSafe
+	 */
+	static void _worker(void *param);
+
+	/**
+	 * Runs the callbacks and marks requests done, forever
+	 */
+	void worker();
+
+	SpiFlash &flash;
+	Mutex mutex;
+	Mutex doneMutex;						// Held while the worker marks a request done and signals it
+	os_semaphore_t completedSemaphore = NULL;
+	SpiFlashRequest *completedFirst = NULL;	// Completed requests the worker hasn't run yet, oldest first
+	SpiFlashRequest *completedLast = NULL;
+	Thread *workerThread = NULL;
+	volatile size_t outstanding = 0;		// Submitted and not completed by the flash yet, for lock()
+};
+
+#endif /* PLATFORM_THREADING */
+
+#endif /* __SPIFLASHTHREADSAFE_H */
@@ -0,0 +1,182 @@
+
+#include "Particle.h"
+
+#include "spiflashwritecache.h"
+#include "spiflashcrc.h"
+
+SpiFlashWriteCache::SpiFlashWriteCache(SpiFlash &flash, Page *pages, size_t numPages) : flash(flash), pages(pages), numPages(numPages) {
+	// getPage() has to evict a buffer when none are free, so it needs at least one
+	if (pages == NULL) {
+		this->numPages = 0;
+	}
+	for(size_t ii = 0; ii < this->numPages; ii++) {
+		pages[ii].inUse = false;
+	}
+}
+
+SpiFlashWriteCache::~SpiFlashWriteCache() {
+
+}
+
+void SpiFlashWriteCache::writeDataSync(size_t addr, const void *buf, size_t bufLen) {
+	const uint8_t *curBuf = (const uint8_t *)buf;
+
+	writeCount++;
+
+	if (numPages == 0) {
+		// No buffers, so nothing to gather the writes in; one program per page written
+		if (bufLen > 0) {
+			programCount += (addr + bufLen - 1) / SpiFlash::PAGE_SIZE - addr / SpiFlash::PAGE_SIZE + 1;
+			flash.writeDataSync(addr, buf, bufLen);
+		}
+		return;
+	}
+
+	while(bufLen > 0) {
+		size_t pageOffset = addr % SpiFlash::PAGE_SIZE;
+		size_t pageStart = addr - pageOffset;
+
+		size_t count = SpiFlash::PAGE_SIZE - pageOffset;
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		Page *page = getPage(pageStart);
+
+		// AND rather than copy so repeated writes of the same byte behave like repeated programs
+		for(size_t ii = 0; ii < count; ii++) {
+			page->data[pageOffset + ii] &= curBuf[ii];
+		}
+		if (pageOffset < page->dirtyStart) {
+			page->dirtyStart = pageOffset;
+		}
+		if (pageOffset + count > page->dirtyEnd) {
+			page->dirtyEnd = pageOffset + count;
+		}
+		page->lastUse = ++useCounter;
+
+		if (page->dirtyStart == 0 && page->dirtyEnd == SpiFlash::PAGE_SIZE) {
+			// Page is full, no reason to wait any longer
+			programPage(page);
+		}
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+	}
+}
+
+uint32_t SpiFlashWriteCache::writeDataSyncCrc(size_t addr, const void *buf, size_t bufLen) {
+	uint32_t crc = SpiFlashCrc32::update(0, buf, bufLen);
+
+	uint8_t crcBuf[SpiFlashCrc32::CRC_SIZE];
+	crcBuf[0] = (uint8_t) crc;
+	crcBuf[1] = (uint8_t) (crc >> 8);
+	crcBuf[2] = (uint8_t) (crc >> 16);
+	crcBuf[3] = (uint8_t) (crc >> 24);
+
+	writeDataSync(addr, buf, bufLen);
+	writeDataSync(addr + bufLen, crcBuf, sizeof(crcBuf));
+
+	return crc;
+}
+
+void SpiFlashWriteCache::readDataSync(size_t addr, void *buf, size_t bufLen) {
+	uint8_t *bytes = (uint8_t *)buf;
+
+	flash.readDataSync(addr, buf, bufLen);
+
+	// Apply data that hasn't been programmed yet
+	for(size_t ii = 0; ii < numPages; ii++) {
+		Page *page = &pages[ii];
+		if (!page->inUse) {
+			continue;
+		}
+
+		size_t start = page->addr + page->dirtyStart;
+		size_t end = page->addr + page->dirtyEnd;
+		if (start < addr) {
+			start = addr;
+		}
+		if (end > addr + bufLen) {
+			end = addr + bufLen;
+		}
+		for(size_t cur = start; cur < end; cur++) {
+			bytes[cur - addr] &= page->data[cur - page->addr];
+		}
+	}
+}
+
+void SpiFlashWriteCache::flush() {
+	for(size_t ii = 0; ii < numPages; ii++) {
+		if (pages[ii].inUse) {
+			programPage(&pages[ii]);
+		}
+	}
+}
+
+void SpiFlashWriteCache::sectorErase(size_t addr) {
+	discard(addr - (addr % SpiFlash::SECTOR_SIZE), SpiFlash::SECTOR_SIZE);
+	flash.sectorErase(addr);
+}
+
+void SpiFlashWriteCache::blockErase(size_t addr) {
+	discard(addr - (addr % SpiFlash::BLOCK_SIZE), SpiFlash::BLOCK_SIZE);
+	flash.blockErase(addr);
+}
+
+void SpiFlashWriteCache::chipErase() {
+	for(size_t ii = 0; ii < numPages; ii++) {
+		pages[ii].inUse = false;
+	}
+	flash.chipErase();
+}
+
+SpiFlashWriteCache::Page *SpiFlashWriteCache::getPage(size_t pageAddr) {
+	Page *freePage = NULL;
+	Page *oldestPage = NULL;
+
+	for(size_t ii = 0; ii < numPages; ii++) {
+		Page *page = &pages[ii];
+		if (page->inUse) {
+			if (page->addr == pageAddr) {
+				return page;
+			}
+			if (oldestPage == NULL || (int32_t)(page->lastUse - oldestPage->lastUse) < 0) {
+				oldestPage = page;
+			}
+		}
+		else if (freePage == NULL) {
+			freePage = page;
+		}
+	}
+
+	if (freePage == NULL) {
+		programPage(oldestPage);
+		freePage = oldestPage;
+	}
+
+	freePage->addr = pageAddr;
+	freePage->dirtyStart = SpiFlash::PAGE_SIZE;
+	freePage->dirtyEnd = 0;
+	freePage->inUse = true;
+	memset(freePage->data, 0xff, sizeof(freePage->data));
+
+	return freePage;
+}
+
+void SpiFlashWriteCache::programPage(Page *page) {
+	flash.writePageSync(page->addr + page->dirtyStart, &page->data[page->dirtyStart], page->dirtyEnd - page->dirtyStart);
+	page->inUse = false;
+	programCount++;
+}
+
+void SpiFlashWriteCache::discard(size_t addr, size_t len) {
+	for(size_t ii = 0; ii < numPages; ii++) {
+		Page *page = &pages[ii];
+		if (page->inUse && page->addr >= addr && page->addr < addr + len) {
+			page->inUse = false;
+		}
+	}
+}
+
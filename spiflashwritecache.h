@@ -0,0 +1,149 @@
+#ifndef __SPIFLASHWRITECACHE_H
+#define __SPIFLASHWRITECACHE_H
+
+#include "spiflash.h"
+
+/**
+ * Write-behind page cache for SpiFlash
+ *
+ * Writes smaller than a page are gathered in RAM page buffers, keyed by page address, and each page
+ * is programmed once when it is completely written, on flush(), or when its buffer is needed for a
+ * different page. For workloads that append small records this replaces one WREN/program/wait cycle
+ * per record with one per page.
+ *
+ * Unwritten bytes in a buffer are 0xFF, and writing the same byte twice ANDs the values, exactly as
+ * two page programs would, so the flash ends up with the same contents as with direct writes.
+ *
+ * Use the SpiFlashWriteCacheStatic template to allocate the page buffers, for example:
+ *
+ * SpiFlash spiFlash(SPI, A2);
+ * SpiFlashWriteCacheStatic<4> writeCache(spiFlash);
+ */
+class SpiFlashWriteCache {
+public:
+	/**
+	 * A page buffer
+	 */
+	struct Page {
+		size_t addr;					//!< Address of the start of the page
+		uint16_t dirtyStart;			//!< Offset of the first byte written
+		uint16_t dirtyEnd;				//!< Offset after the last byte written
+		uint32_t lastUse;				//!< Value of useCounter when last written, for LRU eviction
+		bool inUse;						//!< True if the buffer holds data that has not been programmed
+		uint8_t data[SpiFlash::PAGE_SIZE];
+	};
+
+	/**
+	 * Constructs the cache. You normally use SpiFlashWriteCacheStatic instead.
+	 *
+	 * flash The flash chip to write to
+	 * pages Array of page buffers
+	 * numPages Number of entries in pages, at least 1. With 0, or if pages is NULL, nothing is cached
+	 * and writes go straight to the flash.
+	 */
+	SpiFlashWriteCache(SpiFlash &flash, Page *pages, size_t numPages);
+	virtual ~SpiFlashWriteCache();
+
+	/**
+	 * Writes data through the cache. Can write data across page boundaries.
+	 *
+	 * addr The address to write to
+	 * buf The data to write
+	 * bufLen The number of bytes to write
+	 */
+	void writeDataSync(size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * Writes data through the cache followed by its 4-byte little endian CRC-32, so the record
+	 * can be checked with SpiFlash::readDataSyncCheckCrc(). The CRC is gathered into the same page
+	 * buffers as the data, so it doesn't cost an extra program.
+	 *
+	 * addr The address to write to
+	 * buf The data to write
+	 * bufLen The number of bytes to write, not including the CRC
+	 *
+	 * Returns the CRC.
+	 */
+	uint32_t writeDataSyncCrc(size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * Reads data synchronously, including data that is still in the cache
+	 *
+	 * addr The address to read from
+	 * buf The buffer to store data in
+	 * bufLen The number of bytes to read
+	 */
+	void readDataSync(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * Programs all cached pages
+	 */
+	void flush();
+
+	/**
+	 * Discards cached data in the sector and erases it
+	 */
+	void sectorErase(size_t addr);
+
+	/**
+	 * Discards cached data in the block and erases it
+	 */
+	void blockErase(size_t addr);
+
+	/**
+	 * Discards all cached data and erases the chip
+	 */
+	void chipErase();
+
+	/**
+	 * Returns the number of page programs done by the cache, for sizing the cache
+	 */
+	uint32_t getProgramCount() const { return programCount; }
+
+	/**
+	 * Returns the number of writeDataSync() calls, for comparison with getProgramCount()
+	 */
+	uint32_t getWriteCount() const { return writeCount; }
+
+protected:
+	/**
+	 * Returns the buffer for the page starting at pageAddr, allocating one (and programming the least
+	 * recently used page if necessary) if the page is not cached
+	 */
+	Page *getPage(size_t pageAddr);
+
+	/**
+	 * Programs the written part of a page and frees its buffer
+	 */
+	void programPage(Page *page);
+
+	/**
+	 * Frees the buffers for pages in [addr, addr + len) without programming them
+	 */
+	void discard(size_t addr, size_t len);
+
+	SpiFlash &flash;
+	Page *pages;
+	size_t numPages;
+	uint32_t useCounter = 0;
+	uint32_t programCount = 0;
+	uint32_t writeCount = 0;
+};
+
+/**
+ * Write-behind page cache with NUM_PAGES statically allocated page buffers
+ *
+ * Each page buffer uses a little over SpiFlash::PAGE_SIZE (256) bytes of RAM.
+ */
+template<size_t NUM_PAGES>
+class SpiFlashWriteCacheStatic : public SpiFlashWriteCache {
+public:
+	explicit SpiFlashWriteCacheStatic(SpiFlash &flash) : SpiFlashWriteCache(flash, staticPages, NUM_PAGES) {}
+
+	static_assert(NUM_PAGES >= 1, "needs at least 1 page buffer");
+
+protected:
+	Page staticPages[NUM_PAGES];
+};
+
+#endif /* __SPIFLASHWRITECACHE_H */